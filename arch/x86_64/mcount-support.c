@@ -1,9 +1,13 @@
 #include <assert.h>
 #include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "mcount-arch.h"
 #include "libmcount/mcount.h"
 #include "utils/filter.h"
+#include "utils/compiler.h"
 
 int mcount_get_register_arg(struct mcount_arg_context *ctx,
 			    struct ftrace_arg_spec *spec)
@@ -122,3 +126,89 @@ void mcount_arch_get_retval(struct mcount_arg_context *ctx,
 	else
 		asm volatile ("movsd %%xmm0, %0\n" : "=m" (ctx->val.v));
 }
+
+#define XRAY_SLED_SIZE    11
+#define XRAY_TRAMP_RANGE  0x7ff00000UL
+
+/* jmp *0(%rip); .quad mcount_xray_entry */
+static unsigned char xray_tramp_insn[] = {
+	0xff, 0x25, 0x00, 0x00, 0x00, 0x00,
+	0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static unsigned long xray_tramp_addr;
+
+extern void __weak mcount_xray_entry(void);
+
+/*
+ * The sled can only have a 32-bit relative call, so it needs a trampoline
+ * within the range to jump to the real entry in the libmcount.
+ */
+static unsigned long alloc_xray_trampoline(unsigned long addr)
+{
+	unsigned long page = getpagesize();
+	unsigned long entry = (unsigned long)mcount_xray_entry;
+	unsigned long hint;
+	void *tramp;
+	int i;
+
+	if (mcount_xray_entry == NULL)
+		return 0;
+
+	for (i = 1; i < 2048; i++) {
+		hint = (addr & ~(page - 1)) - i * 0x100000UL;
+		if (hint > addr)
+			break;
+
+		tramp = mmap((void *)hint, page, PROT_READ | PROT_WRITE,
+			     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (tramp == MAP_FAILED)
+			return 0;
+
+		if (addr - (unsigned long)tramp < XRAY_TRAMP_RANGE)
+			goto found;
+
+		munmap(tramp, page);
+	}
+	return 0;
+
+found:
+	memcpy(&xray_tramp_insn[6], &entry, sizeof(entry));
+	memcpy(tramp, xray_tramp_insn, sizeof(xray_tramp_insn));
+	mprotect(tramp, page, PROT_READ | PROT_EXEC);
+
+	return (unsigned long)tramp;
+}
+
+int mcount_arch_xray_patch(struct xray_sled *sled, bool enable)
+{
+	unsigned char *insn = (void *)sled->addr;
+	long disp;
+	int32_t disp32;
+
+	if (!enable) {
+		/* restore the original "jmp +9" instruction */
+		__atomic_store_n((uint16_t *)insn, 0x09eb, __ATOMIC_RELEASE);
+		return 0;
+	}
+
+	if (xray_tramp_addr == 0) {
+		xray_tramp_addr = alloc_xray_trampoline(sled->addr);
+		if (xray_tramp_addr == 0)
+			return -1;
+	}
+
+	disp = xray_tramp_addr - (sled->addr + XRAY_SLED_SIZE);
+	if (disp != (int32_t)disp)
+		return -1;
+	disp32 = disp;
+
+	/* mov $id, %r10d; call <trampoline> */
+	memcpy(insn + 2, &sled->id, 4);
+	insn[6] = 0xe8;
+	memcpy(insn + 7, &disp32, 4);
+
+	/* update the first instruction at last so that it can be atomic */
+	__atomic_store_n((uint16_t *)insn, 0xba41, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * uftrace control command related routines
+ *
+ * It changes filter settings of a process being recorded.
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "uftrace.h"
+#include "libmcount/mcount.h"
+#include "utils/utils.h"
+
+static void fill_control(struct control_setting *cs, struct opts *opts)
+{
+	cs->flags = 0;
+	if (opts->filter)
+		cs->flags |= MCOUNT_CTRL_FILTER;
+	if (opts->trigger)
+		cs->flags |= MCOUNT_CTRL_TRIGGER;
+	if (opts->depth != OPT_DEPTH_DEFAULT)
+		cs->flags |= MCOUNT_CTRL_DEPTH;
+	if (opts->threshold)
+		cs->flags |= MCOUNT_CTRL_THRESHOLD;
+
+	cs->depth = opts->depth;
+	cs->threshold = opts->threshold;
+	cs->filter = opts->filter;
+	cs->trigger = opts->trigger;
+}
+
+static int update_control(char *sid, struct opts *opts)
+{
+	char buf[128];
+	struct mcount_control *ctrl;
+	struct control_setting cs;
+	int fd;
+
+	snprintf(buf, sizeof(buf), MCOUNT_CONTROL_FMT, sid);
+
+	fd = shm_open(buf, O_RDWR, 0600);
+	if (fd < 0) {
+		/* the session has already finished */
+		if (errno == ENOENT)
+			return 0;
+		pr_err("cannot open control block: %s", buf);
+	}
+
+	ctrl = mmap(NULL, MCOUNT_CONTROL_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+	if (ctrl == MAP_FAILED)
+		pr_err("cannot mmap control block: %s", buf);
+
+	fill_control(&cs, opts);
+	if (write_control(ctrl, &cs) < 0)
+		pr_err_ns("filter and trigger are too long\n");
+
+	pr_dbg("session %s updated (seqnum: %u)\n", sid, ctrl->seqnum);
+
+	munmap(ctrl, MCOUNT_CONTROL_SIZE);
+	close(fd);
+	return 1;
+}
+
+int command_control(int argc, char *argv[], struct opts *opts)
+{
+	DIR *dp;
+	struct dirent *ent;
+	char sid[20];
+	int nr_sess = 0;
+	size_t len = 2;
+
+	if (!opts->filter && !opts->trigger && !opts->threshold &&
+	    opts->depth == OPT_DEPTH_DEFAULT) {
+		pr_use("no filter setting is given\n");
+		return -1;
+	}
+
+	if (opts->filter)
+		len += strlen(opts->filter);
+	if (opts->trigger)
+		len += strlen(opts->trigger);
+	if (len > MCOUNT_CONTROL_SIZE - sizeof(struct mcount_control))
+		pr_err_ns("filter and trigger are too long\n");
+
+	dp = opendir(opts->dirname);
+	if (dp == NULL)
+		pr_err("cannot open data directory: %s", opts->dirname);
+
+	/* every (running) session has its own map file */
+	while ((ent = readdir(dp)) != NULL) {
+		if (sscanf(ent->d_name, "sid-%16[0-9a-f].map", sid) != 1)
+			continue;
+
+		nr_sess += update_control(sid, opts);
+	}
+	closedir(dp);
+
+	if (nr_sess == 0) {
+		pr_use("no running session found in %s\n", opts->dirname);
+		return -1;
+	}
+
+	pr_dbg("updated %d session(s)\n", nr_sess);
+	return 0;
+}
@@ -5,7 +5,9 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <time.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "uftrace.h"
 #include "utils/compiler.h"
@@ -13,6 +15,7 @@
 #include "utils/utils.h"
 #include "utils/fstack.h"
 #include "utils/filter.h"
+#include "utils/protobuf.h"
 #include "libtraceevent/kbuffer.h"
 
 
@@ -45,6 +48,10 @@ struct uftrace_dump_ops {
 	/* this is called at the end */
 	void (*footer)(struct uftrace_dump_ops *ops,
 		       struct ftrace_file_handle *handle, struct opts *opts);
+	/* this is called in a dump job to save its state (optional) */
+	void (*job_end)(struct uftrace_dump_ops *ops, FILE *data);
+	/* this is called to merge output and state of a dump job (optional) */
+	void (*job_merge)(struct uftrace_dump_ops *ops, FILE *out, FILE *data);
 };
 
 struct uftrace_raw_dump {
@@ -62,10 +69,31 @@ struct uftrace_chrome_dump {
 struct uftrace_flame_dump {
 	struct uftrace_dump_ops ops;
 	struct rb_root tasks;
-	struct fg_node *node;
+	/* call tree: node 0 is the root */
+	struct fg_node *nodes;
+	unsigned nr_nodes;
+	unsigned nr_alloc;
+	unsigned *node_hash;
+	unsigned node_hash_size;
+	/* interned function names */
+	char **names;
+	unsigned nr_names;
+	unsigned *name_hash;
+	unsigned name_hash_size;
 	uint64_t sample_time;
 };
 
+struct uftrace_perfetto_dump {
+	struct uftrace_dump_ops ops;
+	struct pb_buf pb;
+	struct rb_root names;
+	struct rb_root tracks;
+	uint64_t last_iid;
+	uint64_t last_time;
+	bool clock_set;
+	unsigned lost_event_cnt;
+};
+
 static void pr_time(uint64_t timestamp)
 {
 	unsigned sec   = timestamp / 1000000000;
@@ -392,7 +420,11 @@ static void print_raw_header(struct uftrace_dump_ops *ops,
 static void print_raw_task_start(struct uftrace_dump_ops *ops,
 				 struct ftrace_task_handle *task)
 {
+	struct uftrace_raw_dump *raw = container_of(ops, typeof(*raw), ops);
+
 	pr_out("reading %d.dat\n", task->tid);
+
+	raw->file_offset = 0;
 }
 
 static void print_raw_inverted_time(struct uftrace_dump_ops *ops,
@@ -623,32 +655,90 @@ static void print_chrome_footer(struct uftrace_dump_ops *ops,
 	}
 }
 
+struct chrome_job_result {
+	unsigned lost_event_cnt;
+	bool has_events;
+};
+
+static void print_chrome_job_end(struct uftrace_dump_ops *ops, FILE *data)
+{
+	struct uftrace_chrome_dump *chrome = container_of(ops, typeof(*chrome), ops);
+	struct chrome_job_result res = {
+		.lost_event_cnt = chrome->lost_event_cnt,
+		.has_events     = chrome->last_comma,
+	};
+
+	if (fwrite(&res, sizeof(res), 1, data) != 1)
+		pr_err("cannot write dump job result");
+}
+
+static void copy_dump_output(FILE *fp)
+{
+	char buf[65536];
+	size_t len;
+
+	rewind(fp);
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		if (fwrite(buf, 1, len, outfp) != len)
+			pr_err("cannot write dump output");
+	}
+}
+
+static void print_chrome_job_merge(struct uftrace_dump_ops *ops,
+				   FILE *out, FILE *data)
+{
+	struct uftrace_chrome_dump *chrome = container_of(ops, typeof(*chrome), ops);
+	struct chrome_job_result res;
+
+	rewind(data);
+	if (fread(&res, sizeof(res), 1, data) != 1)
+		pr_err_ns("invalid dump job result\n");
+
+	/* events of each job should be separated by a comma */
+	if (res.has_events) {
+		if (chrome->last_comma)
+			pr_out(",\n");
+		copy_dump_output(out);
+		chrome->last_comma = true;
+	}
+
+	chrome->lost_event_cnt += res.lost_event_cnt;
+}
+
 /* flamegraph support */
+
+/*
+ * Nodes of the call tree are kept in an array and refer to each other
+ * by index.  A child is found by a hash table keyed by the parent index
+ * and the name index, and function names are interned so that each
+ * name is saved only once.
+ */
 struct fg_node {
+	unsigned parent;
+	unsigned name;
+	unsigned first_child;
+	unsigned next_sibling;
+	unsigned depth;
 	int calls;
-	char *name;
 	uint64_t total_time;
 	uint64_t child_time;
-	struct fg_node *parent;
-	struct list_head siblings;
-	struct list_head children;
 };
 
-static struct fg_node fg_root = {
-	.siblings = LIST_HEAD_INIT(fg_root.siblings),
-	.children = LIST_HEAD_INIT(fg_root.children),
-};
+/* index 0 is the root node (and the end of sibling list) */
+#define FG_ROOT  0
+
+#define FG_HASH_INIT  1024
 
 struct fg_task {
 	int tid;
-	struct fg_node *node;
+	unsigned node;
 	struct rb_node link;
 };
 
-static struct fg_task * find_fg_task(struct rb_root *root, int tid)
+static struct fg_task * find_fg_task(struct uftrace_flame_dump *flame, int tid)
 {
 	struct rb_node *parent = NULL;
-	struct rb_node **p = &root->rb_node;
+	struct rb_node **p = &flame->tasks.rb_node;
 	struct fg_task *iter, *new;
 
 	while (*p) {
@@ -666,52 +756,173 @@ static struct fg_task * find_fg_task(struct rb_root *root, int tid)
 
 	new = xmalloc(sizeof(*new));
 	new->tid = tid;
-	new->node = &fg_root;
+	new->node = FG_ROOT;
 
 	rb_link_node(&new->link, parent, p);
-	rb_insert_color(&new->link, root);
+	rb_insert_color(&new->link, &flame->tasks);
 
 	return new;
 }
 
-static struct fg_node * add_fg_node(struct fg_node *parent, char *name)
+static unsigned long fg_name_hash(const char *name)
 {
-	struct fg_node *child;
+	/* FNV-1a */
+	unsigned long hash = 14695981039346656037UL;
 
-	list_for_each_entry(child, &parent->children, siblings) {
-		if (!strcmp(name, child->name))
-			break;
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211UL;
 	}
+	return hash;
+}
 
-	if (list_no_entry(child, &parent->children, siblings)) {
-		child = xmalloc(sizeof(*child));
+static unsigned long fg_node_hash(unsigned parent, unsigned name)
+{
+	return ((unsigned long)parent << 32 | name) * 0x9e3779b97f4a7c15UL >> 16;
+}
 
-		child->name = xstrdup(name);
-		child->calls = 0;
-		child->parent = parent;
-		child->total_time = 0;
-		child->child_time = 0;
+/* hash tables save (index + 1) so that 0 means an empty slot */
+static unsigned *fg_hash_slot(unsigned *table, unsigned size,
+			      unsigned long hash)
+{
+	return &table[hash & (size - 1)];
+}
+
+static void fg_grow_names(struct uftrace_flame_dump *flame)
+{
+	unsigned size = flame->name_hash_size * 2 ?: FG_HASH_INIT;
+	unsigned *table = xcalloc(size, sizeof(*table));
+	unsigned i;
 
-		INIT_LIST_HEAD(&child->children);
-		list_add(&child->siblings, &parent->children);
+	for (i = 0; i < flame->nr_names; i++) {
+		unsigned long hash = fg_name_hash(flame->names[i]);
+		unsigned *slot = fg_hash_slot(table, size, hash);
+
+		while (*slot)
+			slot = fg_hash_slot(table, size, ++hash);
+		*slot = i + 1;
 	}
 
-	child->calls++;
-	return child;
+	free(flame->name_hash);
+	flame->name_hash = table;
+	flame->name_hash_size = size;
 }
 
-static struct fg_node * add_fg_time(struct fg_node *node,
-				    struct ftrace_task_handle *task,
-				    uint64_t sample_time)
+static unsigned intern_fg_name(struct uftrace_flame_dump *flame, char *name)
+{
+	unsigned long hash;
+	unsigned *slot;
+
+	/* keep the load factor under 1/2 */
+	if ((flame->nr_names + 1) * 2 > flame->name_hash_size)
+		fg_grow_names(flame);
+
+	hash = fg_name_hash(name);
+	slot = fg_hash_slot(flame->name_hash, flame->name_hash_size, hash);
+	while (*slot) {
+		if (!strcmp(flame->names[*slot - 1], name))
+			return *slot - 1;
+
+		slot = fg_hash_slot(flame->name_hash, flame->name_hash_size,
+				    ++hash);
+	}
+
+	flame->names = xrealloc(flame->names,
+				(flame->nr_names + 1) * sizeof(*flame->names));
+	flame->names[flame->nr_names] = xstrdup(name);
+
+	*slot = ++flame->nr_names;
+	return *slot - 1;
+}
+
+static void fg_grow_nodes(struct uftrace_flame_dump *flame)
+{
+	unsigned size = flame->node_hash_size * 2 ?: FG_HASH_INIT;
+	unsigned *table = xcalloc(size, sizeof(*table));
+	unsigned i;
+
+	/* the root is not in the table */
+	for (i = 1; i < flame->nr_nodes; i++) {
+		struct fg_node *node = &flame->nodes[i];
+		unsigned long hash = fg_node_hash(node->parent, node->name);
+		unsigned *slot = fg_hash_slot(table, size, hash);
+
+		while (*slot)
+			slot = fg_hash_slot(table, size, ++hash);
+		*slot = i + 1;
+	}
+
+	free(flame->node_hash);
+	flame->node_hash = table;
+	flame->node_hash_size = size;
+}
+
+static unsigned add_fg_node(struct uftrace_flame_dump *flame,
+			    unsigned parent, char *name)
+{
+	unsigned name_idx = intern_fg_name(flame, name);
+	unsigned long hash;
+	struct fg_node *child;
+	unsigned *slot;
+	unsigned idx;
+
+	if ((flame->nr_nodes + 1) * 2 > flame->node_hash_size)
+		fg_grow_nodes(flame);
+
+	hash = fg_node_hash(parent, name_idx);
+	slot = fg_hash_slot(flame->node_hash, flame->node_hash_size, hash);
+	while (*slot) {
+		child = &flame->nodes[*slot - 1];
+
+		if (child->parent == parent && child->name == name_idx) {
+			child->calls++;
+			return *slot - 1;
+		}
+
+		slot = fg_hash_slot(flame->node_hash, flame->node_hash_size,
+				    ++hash);
+	}
+
+	if (flame->nr_nodes == flame->nr_alloc) {
+		flame->nr_alloc *= 2;
+		flame->nodes = xrealloc(flame->nodes,
+					flame->nr_alloc * sizeof(*flame->nodes));
+	}
+
+	idx = flame->nr_nodes++;
+	*slot = idx + 1;
+
+	child = &flame->nodes[idx];
+	memset(child, 0, sizeof(*child));
+
+	child->name = name_idx;
+	child->parent = parent;
+	child->depth = flame->nodes[parent].depth + 1;
+	child->calls = 1;
+
+	/* new child goes first */
+	child->next_sibling = flame->nodes[parent].first_child;
+	flame->nodes[parent].first_child = idx;
+
+	return idx;
+}
+
+static unsigned add_fg_time(struct uftrace_flame_dump *flame, unsigned idx,
+			    struct ftrace_task_handle *task,
+			    uint64_t sample_time)
 {
 	struct fstack *fstack = &task->func_stack[task->stack_count];
+	struct fg_node *node = &flame->nodes[idx];
+
+	if (idx == FG_ROOT)
+		return FG_ROOT;
 
 	if (sample_time) {
 		uint64_t curr_time = fstack->total_time;
 
 		node->total_time += curr_time;
 
-		if (node->parent != &fg_root) {
+		if (node->parent != FG_ROOT) {
 			/*
 			 * it needs to track the child time separately
 			 * since child time not accounted due to sample time
@@ -736,56 +947,72 @@ static struct fg_node * add_fg_time(struct fg_node *node,
 			uint64_t accounted_time;
 
 			accounted_time = (curr_time / sample_time) * sample_time;
-			node->parent->child_time += accounted_time;
+			flame->nodes[node->parent].child_time += accounted_time;
 		}
 	}
 
 	return node->parent;
 }
 
-static void print_flame_graph(struct fg_node *node, struct opts *opts)
+static void print_flame_graph(struct uftrace_flame_dump *flame,
+			      struct opts *opts)
 {
-	struct fg_node *child;
-	unsigned long sample = node->calls;
-
-	if (opts->sample_time)
-		sample = (node->total_time - node->child_time) / opts->sample_time;
-
-	if (sample) {
-		struct fg_node *parent = node;
-		char *names[opts->max_stack];
-		char *buf, *ptr;
-		int i = 0;
-		size_t len = 0;
-
-		while (parent != &fg_root) {
-			names[i++] = parent->name;
-			len += strlen(parent->name) + 1;
-			parent = parent->parent;
+	size_t *path_len = xcalloc(opts->max_stack + 1, sizeof(*path_len));
+	unsigned *stack = xmalloc(flame->nr_nodes * sizeof(*stack));
+	char *buf = NULL;
+	size_t buf_size = 0;
+	int top = 0;
+
+	/* pre-order walk: children are pushed in reverse order */
+	if (flame->nodes[FG_ROOT].first_child != FG_ROOT)
+		stack[top++] = flame->nodes[FG_ROOT].first_child;
+	while (top > 0) {
+		unsigned idx = stack[--top];
+		struct fg_node *node = &flame->nodes[idx];
+		unsigned long sample = node->calls;
+		char *name = flame->names[node->name];
+		size_t len = strlen(name);
+		unsigned depth = node->depth;
+
+		if (node->next_sibling != FG_ROOT)
+			stack[top++] = node->next_sibling;
+		if (node->first_child != FG_ROOT)
+			stack[top++] = node->first_child;
+
+		/* names deeper than the max stack are not shown */
+		if (depth > (unsigned)opts->max_stack)
+			depth = opts->max_stack;
+		else {
+			if (path_len[depth - 1] + len + 1 > buf_size) {
+				buf_size = ALIGN(path_len[depth - 1] + len + 1, 4096);
+				buf = xrealloc(buf, buf_size);
+			}
+			memcpy(buf + path_len[depth - 1], name, len);
+			buf[path_len[depth - 1] + len] = ';';
+			path_len[depth] = path_len[depth - 1] + len + 1;
 		}
 
-		buf = ptr = xmalloc(len + 32);
-		while (--i >= 0)
-			ptr += snprintf(ptr, len, "%s;", names[i]);
-		ptr[-1] = ' ';
-		snprintf(ptr, len, "%lu", sample);
+		if (opts->sample_time)
+			sample = (node->total_time - node->child_time) / opts->sample_time;
 
-		pr_out("%s\n", buf);
-		free(buf);
+		if (sample)
+			pr_out("%.*s %lu\n", (int)path_len[depth] - 1, buf, sample);
 	}
 
-	list_for_each_entry(child, &node->children, siblings)
-		print_flame_graph(child, opts);
-
-	free(node->name);
-	if (node != &fg_root)
-		free(node);
+	free(buf);
+	free(stack);
+	free(path_len);
 }
 
 static void print_flame_header(struct uftrace_dump_ops *ops,
 			       struct ftrace_file_handle *handle,
 			       struct opts *opts)
 {
+	struct uftrace_flame_dump *flame = container_of(ops, typeof(*flame), ops);
+
+	flame->nr_alloc = 1024;
+	flame->nodes = xzalloc(flame->nr_alloc * sizeof(*flame->nodes));
+	flame->nr_nodes = 1;  /* root */
 }
 
 static void print_flame_task_start(struct uftrace_dump_ops *ops,
@@ -803,18 +1030,15 @@ static void print_flame_task_rstack(struct uftrace_dump_ops *ops,
 {
 	struct ftrace_ret_stack *frs = task->rstack;
 	struct uftrace_flame_dump *flame = container_of(ops, typeof(*flame), ops);
-	struct fg_task *t = find_fg_task(&flame->tasks, task->tid);
-	struct fg_node *node = t->node;
+	struct fg_task *t = find_fg_task(flame, task->tid);
+	unsigned node = t->node;
 
 	if (frs->type == FTRACE_ENTRY)
-		node = add_fg_node(node, name);
+		node = add_fg_node(flame, node, name);
 	else if (frs->type == FTRACE_EXIT)
-		node = add_fg_time(node, task, flame->sample_time);
+		node = add_fg_time(flame, node, task, flame->sample_time);
 	else
-		node = &fg_root;
-
-	if (unlikely(node == NULL))
-		node = &fg_root;
+		node = FG_ROOT;
 
 	t->node = node;
 }
@@ -844,103 +1068,682 @@ static void print_flame_footer(struct uftrace_dump_ops *ops,
 			       struct ftrace_file_handle *handle,
 			       struct opts *opts)
 {
-	print_flame_graph(&fg_root, opts);
+	struct uftrace_flame_dump *flame = container_of(ops, typeof(*flame), ops);
+	unsigned i;
+
+	print_flame_graph(flame, opts);
+
+	for (i = 0; i < flame->nr_names; i++)
+		free(flame->names[i]);
+	free(flame->names);
+	free(flame->name_hash);
+	free(flame->node_hash);
+	free(flame->nodes);
 }
 
-static void do_dump_file(struct uftrace_dump_ops *ops, struct opts *opts,
-			 struct ftrace_file_handle *handle)
+/*
+ * A dump job saves its call tree in the node order so that a parent is
+ * always saved before its children.  The parent index is of the job.
+ */
+struct fg_job_node {
+	unsigned parent;
+	unsigned name_len;
+	int calls;
+	uint64_t total_time;
+	uint64_t child_time;
+};
+
+static void print_flame_job_end(struct uftrace_dump_ops *ops, FILE *data)
 {
-	int i;
-	uint64_t prev_time;
-	struct ftrace_task_handle *task;
+	struct uftrace_flame_dump *flame = container_of(ops, typeof(*flame), ops);
+	unsigned i;
+
+	for (i = 1; i < flame->nr_nodes; i++) {
+		struct fg_node *node = &flame->nodes[i];
+		char *name = flame->names[node->name];
+		struct fg_job_node jn = {
+			.parent     = node->parent,
+			.name_len   = strlen(name),
+			.calls      = node->calls,
+			.total_time = node->total_time,
+			.child_time = node->child_time,
+		};
 
-	ops->header(ops, handle, opts);
+		if (fwrite(&jn, sizeof(jn), 1, data) != 1 ||
+		    fwrite(name, jn.name_len, 1, data) != 1)
+			pr_err("cannot write dump job result");
+	}
+}
+
+static void print_flame_job_merge(struct uftrace_dump_ops *ops,
+				  FILE *out, FILE *data)
+{
+	struct uftrace_flame_dump *flame = container_of(ops, typeof(*flame), ops);
+	struct fg_job_node jn;
+	unsigned map_size = 1024;
+	unsigned *map = xmalloc(map_size * sizeof(*map));
+	unsigned nr_map = 1;
+	char *name = NULL;
+	size_t name_size = 0;
+
+	/* the root of the job is the root */
+	map[FG_ROOT] = FG_ROOT;
+
+	rewind(data);
+	while (fread(&jn, sizeof(jn), 1, data) == 1) {
+		struct fg_node *node;
+		unsigned idx;
+
+		if (jn.parent >= nr_map)
+			pr_err_ns("invalid dump job result\n");
+
+		if (jn.name_len + 1 > name_size) {
+			name_size = jn.name_len + 1;
+			name = xrealloc(name, name_size);
+		}
+		if (jn.name_len && fread(name, jn.name_len, 1, data) != 1)
+			pr_err_ns("invalid dump job result\n");
+		name[jn.name_len] = '\0';
+
+		/* add_fg_node() counts a call already */
+		idx = add_fg_node(flame, map[jn.parent], name);
+		node = &flame->nodes[idx];
+		node->calls += jn.calls - 1;
+		node->total_time += jn.total_time;
+		node->child_time += jn.child_time;
+
+		if (nr_map == map_size) {
+			map_size *= 2;
+			map = xrealloc(map, map_size * sizeof(*map));
+		}
+		map[nr_map++] = idx;
+	}
+
+	free(name);
+	free(map);
+}
+
+/* perfetto support */
+
+/* field numbers in perfetto protos (trace_packet.proto and so on) */
+#define PB_TRACE_PACKET			1
+
+#define PB_PACKET_CLOCK_SNAPSHOT	6
+#define PB_PACKET_TIMESTAMP		8
+#define PB_PACKET_SEQUENCE_ID		10
+#define PB_PACKET_TRACK_EVENT		11
+#define PB_PACKET_INTERNED_DATA		12
+#define PB_PACKET_SEQUENCE_FLAGS	13
+#define PB_PACKET_DEFAULTS		59
+#define PB_PACKET_TRACK_DESCRIPTOR	60
+
+#define PB_DEFAULTS_CLOCK_ID		58
+
+#define PB_CLOCK_SNAPSHOT_CLOCKS	1
+#define PB_CLOCK_ID			1
+#define PB_CLOCK_TIMESTAMP		2
+#define PB_CLOCK_INCREMENTAL		3
+
+#define PB_TRACK_UUID			1
+#define PB_TRACK_PROCESS		3
+#define PB_TRACK_THREAD			4
+#define PB_PROCESS_PID			1
+#define PB_PROCESS_NAME			6
+#define PB_THREAD_PID			1
+#define PB_THREAD_TID			2
+
+#define PB_EVENT_ANNOTATION		4
+#define PB_EVENT_TYPE			9
+#define PB_EVENT_NAME_IID		10
+#define PB_EVENT_TRACK_UUID		11
+#define PB_EVENT_NAME			23
+#define PB_ANNOTATION_STRING		6
+#define PB_ANNOTATION_NAME		10
+
+#define PB_INTERNED_EVENT_NAMES		2
+#define PB_EVENT_NAME_ENTRY_IID		1
+#define PB_EVENT_NAME_ENTRY_NAME	2
+
+#define PB_TYPE_SLICE_BEGIN		1
+#define PB_TYPE_SLICE_END		2
+#define PB_TYPE_INSTANT			3
+
+#define PB_SEQ_STATE_CLEARED		1
+#define PB_SEQ_NEEDS_STATE		2
+
+#define PB_CLOCK_MONOTONIC		3
+/* sequence-scoped clock: timestamps are delta from the previous one */
+#define PB_CLOCK_INCREMENTAL_ID		64
+
+#define PB_SEQUENCE_ID			1
+#define PB_PROCESS_UUID(pid)		((1ULL << 32) | (pid))
+
+struct perfetto_name {
+	struct rb_node link;
+	uint64_t iid;
+	char name[];
+};
+
+struct perfetto_track {
+	struct rb_node link;
+	int id;
+};
+
+static uint64_t perfetto_name_iid(struct uftrace_perfetto_dump *perfetto,
+				  char *name, bool *added)
+{
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &perfetto->names.rb_node;
+	struct perfetto_name *iter, *new;
+	int cmp;
+
+	*added = false;
+
+	while (*p) {
+		parent = *p;
+		iter = rb_entry(parent, struct perfetto_name, link);
+
+		cmp = strcmp(iter->name, name);
+		if (cmp == 0)
+			return iter->iid;
+
+		if (cmp > 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	new = xmalloc(sizeof(*new) + strlen(name) + 1);
+	new->iid = ++perfetto->last_iid;
+	strcpy(new->name, name);
+
+	rb_link_node(&new->link, parent, p);
+	rb_insert_color(&new->link, &perfetto->names);
+
+	*added = true;
+	return new->iid;
+}
+
+/* returns true if the track is new */
+static bool perfetto_new_track(struct rb_root *root, int id)
+{
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &root->rb_node;
+	struct perfetto_track *iter, *new;
+
+	while (*p) {
+		parent = *p;
+		iter = rb_entry(parent, struct perfetto_track, link);
+
+		if (iter->id == id)
+			return false;
+
+		if (iter->id > id)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	new = xmalloc(sizeof(*new));
+	new->id = id;
+
+	rb_link_node(&new->link, parent, p);
+	rb_insert_color(&new->link, root);
+	return true;
+}
+
+static void perfetto_flush_packet(struct uftrace_perfetto_dump *perfetto)
+{
+	struct pb_buf *pb = &perfetto->pb;
+
+	if (fwrite(pb->data, 1, pb->len, outfp) != pb->len)
+		pr_err("cannot write perfetto trace");
+	pb->len = 0;
+}
+
+/* set the (incremental) clock to the given timestamp */
+static void perfetto_clock_snapshot(struct uftrace_perfetto_dump *perfetto,
+				    uint64_t timestamp)
+{
+	struct pb_buf *pb = &perfetto->pb;
+	size_t packet, snapshot, clock;
+
+	packet = pb_begin(pb, PB_TRACE_PACKET);
+	pb_uint(pb, PB_PACKET_SEQUENCE_ID, PB_SEQUENCE_ID);
+
+	snapshot = pb_begin(pb, PB_PACKET_CLOCK_SNAPSHOT);
+
+	clock = pb_begin(pb, PB_CLOCK_SNAPSHOT_CLOCKS);
+	pb_uint(pb, PB_CLOCK_ID, PB_CLOCK_INCREMENTAL_ID);
+	pb_uint(pb, PB_CLOCK_TIMESTAMP, timestamp);
+	pb_uint(pb, PB_CLOCK_INCREMENTAL, 1);
+	pb_end(pb, clock);
+
+	clock = pb_begin(pb, PB_CLOCK_SNAPSHOT_CLOCKS);
+	pb_uint(pb, PB_CLOCK_ID, PB_CLOCK_MONOTONIC);
+	pb_uint(pb, PB_CLOCK_TIMESTAMP, timestamp);
+	pb_end(pb, clock);
+
+	pb_end(pb, snapshot);
+	pb_end(pb, packet);
+
+	perfetto_flush_packet(perfetto);
+	perfetto->last_time = timestamp;
+}
+
+static void perfetto_describe_task(struct uftrace_perfetto_dump *perfetto,
+				   struct ftrace_task_handle *task)
+{
+	struct pb_buf *pb = &perfetto->pb;
+	struct ftrace_session *sess;
+	size_t packet, track, desc;
+	int pid = task->t ? task->t->pid : task->tid;
+	char *name = NULL;
+
+	sess = get_task_session(task, task->rstack->time);
+	if (sess)
+		name = basename(sess->exename);
+
+	if (perfetto_new_track(&perfetto->tracks, -pid)) {
+		packet = pb_begin(pb, PB_TRACE_PACKET);
+		pb_uint(pb, PB_PACKET_SEQUENCE_ID, PB_SEQUENCE_ID);
+
+		track = pb_begin(pb, PB_PACKET_TRACK_DESCRIPTOR);
+		pb_uint(pb, PB_TRACK_UUID, PB_PROCESS_UUID(pid));
+		desc = pb_begin(pb, PB_TRACK_PROCESS);
+		pb_uint(pb, PB_PROCESS_PID, pid);
+		if (name)
+			pb_string(pb, PB_PROCESS_NAME, name);
+		pb_end(pb, desc);
+		pb_end(pb, track);
+
+		pb_end(pb, packet);
+	}
+
+	packet = pb_begin(pb, PB_TRACE_PACKET);
+	pb_uint(pb, PB_PACKET_SEQUENCE_ID, PB_SEQUENCE_ID);
+
+	track = pb_begin(pb, PB_PACKET_TRACK_DESCRIPTOR);
+	pb_uint(pb, PB_TRACK_UUID, task->tid);
+	desc = pb_begin(pb, PB_TRACK_THREAD);
+	pb_uint(pb, PB_THREAD_PID, pid);
+	pb_uint(pb, PB_THREAD_TID, task->tid);
+	pb_end(pb, desc);
+	pb_end(pb, track);
 
-	for (i = 0; i < handle->info.nr_tid; i++) {
-		int tid;
+	pb_end(pb, packet);
 
-		if (opts->kernel && opts->kernel_only)
+	perfetto_flush_packet(perfetto);
+}
+
+static void print_perfetto_header(struct uftrace_dump_ops *ops,
+				  struct ftrace_file_handle *handle,
+				  struct opts *opts)
+{
+	struct uftrace_perfetto_dump *perfetto = container_of(ops, typeof(*perfetto), ops);
+	struct pb_buf *pb = &perfetto->pb;
+	size_t packet, defaults;
+
+	/* use the incremental clock for all packets in the sequence */
+	packet = pb_begin(pb, PB_TRACE_PACKET);
+	pb_uint(pb, PB_PACKET_SEQUENCE_ID, PB_SEQUENCE_ID);
+	pb_uint(pb, PB_PACKET_SEQUENCE_FLAGS, PB_SEQ_STATE_CLEARED);
+
+	defaults = pb_begin(pb, PB_PACKET_DEFAULTS);
+	pb_uint(pb, PB_DEFAULTS_CLOCK_ID, PB_CLOCK_INCREMENTAL_ID);
+	pb_end(pb, defaults);
+
+	pb_end(pb, packet);
+
+	perfetto_flush_packet(perfetto);
+}
+
+static void print_perfetto_task_start(struct uftrace_dump_ops *ops,
+				      struct ftrace_task_handle *task)
+{
+}
+
+static void print_perfetto_inverted_time(struct uftrace_dump_ops *ops,
+					 struct ftrace_task_handle *task)
+{
+}
+
+static void print_perfetto_task_rstack(struct uftrace_dump_ops *ops,
+				       struct ftrace_task_handle *task, char *name)
+{
+	struct uftrace_perfetto_dump *perfetto = container_of(ops, typeof(*perfetto), ops);
+	struct ftrace_ret_stack *frs = task->rstack;
+	struct pb_buf *pb = &perfetto->pb;
+	enum argspec_string_bits str_mode = 0;
+	char spec_buf[1024];
+	size_t packet, event, pos;
+	uint64_t time = frs->time;
+	uint64_t iid = 0;
+	bool added = false;
+	int type;
+
+	if (frs->type == FTRACE_ENTRY)
+		type = PB_TYPE_SLICE_BEGIN;
+	else if (frs->type == FTRACE_EXIT)
+		type = PB_TYPE_SLICE_END;
+	else {
+		type = PB_TYPE_INSTANT;
+		perfetto->lost_event_cnt++;
+
+		/* lost records of kernel have no timestamp */
+		if (time == 0)
+			time = perfetto->last_time;
+	}
+
+	/* the delta should not be negative */
+	if (!perfetto->clock_set || time < perfetto->last_time) {
+		perfetto_clock_snapshot(perfetto, time);
+		perfetto->clock_set = true;
+	}
+
+	if (perfetto_new_track(&perfetto->tracks, task->tid))
+		perfetto_describe_task(perfetto, task);
+
+	if (type == PB_TYPE_SLICE_BEGIN)
+		iid = perfetto_name_iid(perfetto, name, &added);
+
+	packet = pb_begin(pb, PB_TRACE_PACKET);
+	pb_uint(pb, PB_PACKET_TIMESTAMP, time - perfetto->last_time);
+	pb_uint(pb, PB_PACKET_SEQUENCE_ID, PB_SEQUENCE_ID);
+	pb_uint(pb, PB_PACKET_SEQUENCE_FLAGS, PB_SEQ_NEEDS_STATE);
+
+	if (added) {
+		size_t interned, entry;
+
+		interned = pb_begin(pb, PB_PACKET_INTERNED_DATA);
+		entry = pb_begin(pb, PB_INTERNED_EVENT_NAMES);
+		pb_uint(pb, PB_EVENT_NAME_ENTRY_IID, iid);
+		pb_string(pb, PB_EVENT_NAME_ENTRY_NAME, name);
+		pb_end(pb, entry);
+		pb_end(pb, interned);
+	}
+
+	event = pb_begin(pb, PB_PACKET_TRACK_EVENT);
+	pb_uint(pb, PB_EVENT_TYPE, type);
+	pb_uint(pb, PB_EVENT_TRACK_UUID, task->tid);
+
+	if (type == PB_TYPE_SLICE_BEGIN)
+		pb_uint(pb, PB_EVENT_NAME_IID, iid);
+	else if (type == PB_TYPE_INSTANT)
+		pb_string(pb, PB_EVENT_NAME, "lost records");
+
+	if (frs->more && type != PB_TYPE_INSTANT) {
+		str_mode |= HAS_MORE;
+		if (type == PB_TYPE_SLICE_END)
+			str_mode |= IS_RETVAL;
+		get_argspec_string(task, spec_buf, sizeof(spec_buf), str_mode);
+
+		pos = pb_begin(pb, PB_EVENT_ANNOTATION);
+		pb_string(pb, PB_ANNOTATION_NAME,
+			  type == PB_TYPE_SLICE_BEGIN ? "arguments" : "retval");
+		pb_string(pb, PB_ANNOTATION_STRING, spec_buf);
+		pb_end(pb, pos);
+	}
+
+	pb_end(pb, event);
+	pb_end(pb, packet);
+
+	perfetto_flush_packet(perfetto);
+	perfetto->last_time = time;
+}
+
+/*
+ * Kernel records are read together with user records by read_rstack()
+ * and passed to print_perfetto_task_rstack() so that they are shown in
+ * the thread tracks.  The callbacks below are used for the raw dump of
+ * the kernel data (per-cpu) only.
+ */
+static void print_perfetto_kernel_start(struct uftrace_dump_ops *ops,
+					struct ftrace_kernel *kernel)
+{
+}
+
+static void print_perfetto_cpu_start(struct uftrace_dump_ops *ops,
+				     struct ftrace_kernel *kernel, int cpu)
+{
+}
+
+static void print_perfetto_kernel_rstack(struct uftrace_dump_ops *ops,
+					 struct ftrace_kernel *kernel, int cpu,
+					 struct ftrace_ret_stack *frs, char *name)
+{
+}
+
+static void print_perfetto_kernel_lost(struct uftrace_dump_ops *ops,
+				       uint64_t time, int tid, int losts)
+{
+}
+
+static void print_perfetto_footer(struct uftrace_dump_ops *ops,
+				  struct ftrace_file_handle *handle,
+				  struct opts *opts)
+{
+	struct uftrace_perfetto_dump *perfetto = container_of(ops, typeof(*perfetto), ops);
+	struct rb_node *node;
+
+	fflush(outfp);
+
+	while ((node = rb_first(&perfetto->names)) != NULL) {
+		rb_erase(node, &perfetto->names);
+		free(rb_entry(node, struct perfetto_name, link));
+	}
+	while ((node = rb_first(&perfetto->tracks)) != NULL) {
+		rb_erase(node, &perfetto->tracks);
+		free(rb_entry(node, struct perfetto_track, link));
+	}
+	free(perfetto->pb.data);
+
+	if (perfetto->lost_event_cnt) {
+		pr_warn("Some of function trace records are lost. "
+			"(%d times shown)\n", perfetto->lost_event_cnt);
+	}
+}
+
+static void dump_file_task(struct uftrace_dump_ops *ops, struct opts *opts,
+			   struct ftrace_file_handle *handle,
+			   struct ftrace_task_handle *task)
+{
+	uint64_t prev_time = 0;
+
+	task->rstack = &task->ustack;
+
+	ops->task_start(ops, task);
+
+	while (!read_task_ustack(handle, task) && !uftrace_done) {
+		struct ftrace_ret_stack *frs = &task->ustack;
+		struct ftrace_session *sess = get_task_session(task, frs->time);
+		struct symtabs *symtabs;
+		struct sym *sym = NULL;
+		char *name;
+
+		/* consume the rstack as it didn't call read_rstack() */
+		fstack_consume(handle, task);
+
+		if (!check_time_range(&handle->time_range, frs->time))
 			continue;
 
-		task = &handle->tasks[i];
-		tid = task->tid;
-		task->rstack = &task->ustack;
+		if (prev_time > frs->time)
+			ops->inverted_time(ops, task);
+		prev_time = frs->time;
 
-		prev_time = 0;
+		if (!fstack_check_filter(task))
+			continue;
 
-		ops->task_start(ops, task);
+		if (sess) {
+			symtabs = &sess->symtabs;
+			sym = find_symtabs_time(symtabs, frs->addr,
+						frs->time);
+		}
 
-		while (!read_task_ustack(handle, task) && !uftrace_done) {
-			struct ftrace_ret_stack *frs = &task->ustack;
-			struct ftrace_session *sess = find_task_session(tid, frs->time);
-			struct symtabs *symtabs;
-			struct sym *sym = NULL;
-			char *name;
+		name = symbol_getname(sym, frs->addr);
+		ops->task_rstack(ops, task, name);
+		symbol_putname(sym, name);
+	}
+}
 
-			/* consume the rstack as it didn't call read_rstack() */
-			fstack_consume(handle, task);
+static void dump_file_cpu(struct uftrace_dump_ops *ops,
+			  struct ftrace_file_handle *handle, int cpu)
+{
+	struct ftrace_kernel *kernel = handle->kern;
+	struct ftrace_ret_stack *frs = &kernel->rstacks[cpu];
+	struct sym *sym;
+	char *name;
 
-			if (!check_time_range(&handle->time_range, frs->time))
-				continue;
+	ops->cpu_start(ops, kernel, cpu);
 
-			if (prev_time > frs->time)
-				ops->inverted_time(ops, task);
-			prev_time = frs->time;
+	while (!read_kernel_cpu_data(kernel, cpu) && !uftrace_done) {
+		int tid = kernel->tids[cpu];
+		int losts = kernel->missed_events[cpu];
 
-			if (!fstack_check_filter(task))
-				continue;
+		if (losts) {
+			ops->lost(ops, frs->time, tid, losts);
+			kernel->missed_events[cpu] = 0;
+		}
 
-			if (sess) {
-				symtabs = &sess->symtabs;
-				sym = find_symtabs(symtabs, frs->addr);
+		if (!check_time_range(&handle->time_range, frs->time))
+			continue;
 
-				if (sym == NULL)
-					sym = session_find_dlsym(sess,
-								 frs->time,
-								 frs->addr);
-			}
+		sym = find_symtabs(NULL, frs->addr);
+		name = symbol_getname(sym, frs->addr);
 
-			name = symbol_getname(sym, frs->addr);
-			ops->task_rstack(ops, task, name);
-			symbol_putname(sym, name);
+		ops->kernel(ops, kernel, cpu, frs, name);
+
+		symbol_putname(sym, name);
+	}
+}
+
+/*
+ * Data files are dumped in the order of tasks and then kernel cpus.
+ * Each of them is independent so it can be dumped in parallel.
+ */
+static void dump_file_range(struct uftrace_dump_ops *ops, struct opts *opts,
+			    struct ftrace_file_handle *handle,
+			    int start, int end)
+{
+	int nr_tasks = handle->info.nr_tid;
+	int i;
+
+	if (opts->kernel && opts->kernel_only && start < nr_tasks)
+		start = nr_tasks;
+
+	for (i = start; i < end && !uftrace_done; i++) {
+		if (i < nr_tasks) {
+			dump_file_task(ops, opts, handle, &handle->tasks[i]);
+			continue;
 		}
+
+		if (i == nr_tasks)
+			ops->kernel_start(ops, handle->kern);
+
+		dump_file_cpu(ops, handle, i - nr_tasks);
 	}
+}
 
-	if (!opts->kernel || handle->kern == NULL || uftrace_done)
-		goto footer;
+typedef void (*dump_range_t)(struct uftrace_dump_ops *ops, struct opts *opts,
+			     struct ftrace_file_handle *handle,
+			     int start, int end);
 
-	ops->kernel_start(ops, handle->kern);
+struct dump_job {
+	pid_t pid;
+	FILE *out;
+	FILE *data;
+};
 
-	for (i = 0; i < handle->kern->nr_cpus; i++) {
-		struct ftrace_kernel *kernel = handle->kern;
-		struct ftrace_ret_stack *frs = &kernel->rstacks[i];
-		struct sym *sym;
-		char *name;
+/* dump files with multiple processes and merge their output in order */
+static int dump_file_jobs(struct uftrace_dump_ops *ops, struct opts *opts,
+			  struct ftrace_file_handle *handle, int nr_items,
+			  dump_range_t dump_range)
+{
+	int nr_jobs = opts->nr_jobs;
+	struct dump_job *jobs;
+	int i, status;
 
-		ops->cpu_start(ops, kernel, i);
+	if (nr_jobs > nr_items)
+		nr_jobs = nr_items;
+	if (nr_jobs < 2)
+		return -1;
 
-		while (!read_kernel_cpu_data(kernel, i) && !uftrace_done) {
-			int tid = kernel->tids[i];
-			int losts = kernel->missed_events[i];
+	pr_dbg("dump data files using %d jobs\n", nr_jobs);
 
-			if (losts) {
-				ops->lost(ops, frs->time, tid, losts);
-				kernel->missed_events[i] = 0;
-			}
+	jobs = xcalloc(nr_jobs, sizeof(*jobs));
 
-			if (!check_time_range(&handle->time_range, frs->time))
-				continue;
+	/* do not duplicate pending output in the workers */
+	fflush(NULL);
 
-			sym = find_symtabs(NULL, frs->addr);
-			name = symbol_getname(sym, frs->addr);
+	for (i = 0; i < nr_jobs; i++) {
+		struct dump_job *job = &jobs[i];
 
-			ops->kernel(ops, kernel, i, frs, name);
+		job->out = tmpfile();
+		if (job->out == NULL)
+			pr_err("cannot create dump output file");
 
-			symbol_putname(sym, name);
+		if (ops->job_end) {
+			job->data = tmpfile();
+			if (job->data == NULL)
+				pr_err("cannot create dump output file");
+		}
+
+		job->pid = fork();
+		if (job->pid < 0)
+			pr_err("cannot fork dump job");
+
+		if (job->pid == 0) {
+			outfp = job->out;
+
+			dump_range(ops, opts, handle,
+				   nr_items * i / nr_jobs,
+				   nr_items * (i + 1) / nr_jobs);
+
+			if (ops->job_end) {
+				ops->job_end(ops, job->data);
+				fflush(job->data);
+			}
+
+			fflush(outfp);
+			_exit(0);
 		}
 	}
 
-footer:
+	for (i = 0; i < nr_jobs; i++) {
+		struct dump_job *job = &jobs[i];
+
+		waitpid(job->pid, &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			pr_err_ns("dump job %d failed\n", i);
+
+		if (ops->job_merge)
+			ops->job_merge(ops, job->out, job->data);
+		else
+			copy_dump_output(job->out);
+
+		fclose(job->out);
+		if (job->data)
+			fclose(job->data);
+	}
+
+	free(jobs);
+	return 0;
+}
+
+static void do_dump_file(struct uftrace_dump_ops *ops, struct opts *opts,
+			 struct ftrace_file_handle *handle)
+{
+	int nr_items = handle->info.nr_tid;
+
+	if (opts->kernel && handle->kern)
+		nr_items += handle->kern->nr_cpus;
+
+	ops->header(ops, handle, opts);
+
+	if (opts->nr_jobs < 2 ||
+	    dump_file_jobs(ops, opts, handle, nr_items, dump_file_range) < 0)
+		dump_file_range(ops, opts, handle, 0, nr_items);
+
 	ops->footer(ops, handle, opts);
 }
 
@@ -975,12 +1778,10 @@ static void dump_replay_task(struct uftrace_dump_ops *ops,
 	struct sym *sym = NULL;
 	char *name;
 
-	sess = find_task_session(task->tid, frs->time);
+	sess = get_task_session(task, frs->time);
 	if (sess || is_kernel_address(frs->addr)) {
-		sym = find_symtabs(&sess->symtabs, frs->addr);
-		if (sym == NULL && sess)
-			sym = session_find_dlsym(sess, frs->time,
-						 frs->addr);
+		sym = find_symtabs_time(&sess->symtabs, frs->addr,
+					frs->time);
 	}
 
 	name = symbol_getname(sym, frs->addr);
@@ -988,6 +1789,68 @@ static void dump_replay_task(struct uftrace_dump_ops *ops,
 	symbol_putname(sym, name);
 }
 
+/* add duration of remaining functions */
+static void dump_replay_remaining(struct uftrace_dump_ops *ops,
+				  struct opts *opts,
+				  struct ftrace_file_handle *handle,
+				  struct ftrace_task_handle *task)
+{
+	uint64_t last_time;
+
+	if (task->stack_count == 0)
+		return;
+
+	last_time = task->rstack->time;
+
+	if (handle->time_range.stop)
+		last_time = handle->time_range.stop;
+
+	while (--task->stack_count >= 0) {
+		struct fstack *fstack;
+
+		fstack = &task->func_stack[task->stack_count];
+
+		if (fstack->addr == 0)
+			continue;
+
+		if (fstack->total_time > last_time)
+			continue;
+
+		fstack->total_time = last_time - fstack->total_time;
+		if (fstack->child_time > fstack->total_time)
+			fstack->total_time = fstack->child_time;
+
+		if (task->stack_count > 0)
+			fstack[-1].child_time += fstack->total_time;
+
+		task->rstack = &task->ustack;
+		task->rstack->time = last_time;
+		task->rstack->type = FTRACE_EXIT;
+		task->rstack->addr = fstack->addr;
+
+		if (check_task_rstack(task, opts))
+			dump_replay_task(ops, task);
+	}
+}
+
+/*
+ * Without kernel data, the output of a task doesn't depend on other
+ * tasks so each task can be dumped separately and merged later.
+ */
+static void dump_replay_range(struct uftrace_dump_ops *ops, struct opts *opts,
+			      struct ftrace_file_handle *handle,
+			      int start, int end)
+{
+	int i;
+
+	for (i = start; i < end && !uftrace_done; i++) {
+		struct ftrace_task_handle *task = &handle->tasks[i];
+
+		dump_file_task(ops, opts, handle, task);
+		dump_replay_remaining(ops, opts, handle, task);
+	}
+}
+
 static void do_dump_replay(struct uftrace_dump_ops *ops, struct opts *opts,
 			   struct ftrace_file_handle *handle)
 {
@@ -997,6 +1860,12 @@ static void do_dump_replay(struct uftrace_dump_ops *ops, struct opts *opts,
 
 	ops->header(ops, handle, opts);
 
+	if (ops->job_merge && !(opts->kernel && handle->kern) &&
+	    opts->nr_jobs >= 2 &&
+	    dump_file_jobs(ops, opts, handle, handle->info.nr_tid,
+			   dump_replay_range) == 0)
+		goto out;
+
 	while (!read_rstack(handle, &task) && !uftrace_done) {
 		struct ftrace_ret_stack *frs = task->rstack;
 
@@ -1010,48 +1879,10 @@ static void do_dump_replay(struct uftrace_dump_ops *ops, struct opts *opts,
 		dump_replay_task(ops, task);
 	}
 
-	/* add duration of remaining functions */
-	for (i = 0; i < handle->nr_tasks; i++) {
-		uint64_t last_time;
-
-		task = &handle->tasks[i];
-
-		if (task->stack_count == 0)
-			continue;
-
-		last_time = task->rstack->time;
-
-		if (handle->time_range.stop)
-			last_time = handle->time_range.stop;
-
-		while (--task->stack_count >= 0) {
-			struct fstack *fstack;
-
-			fstack = &task->func_stack[task->stack_count];
-
-			if (fstack->addr == 0)
-				continue;
-
-			if (fstack->total_time > last_time)
-				continue;
-
-			fstack->total_time = last_time - fstack->total_time;
-			if (fstack->child_time > fstack->total_time)
-				fstack->total_time = fstack->child_time;
-
-			if (task->stack_count > 0)
-				fstack[-1].child_time += fstack->total_time;
-
-			task->rstack = &task->ustack;
-			task->rstack->time = last_time;
-			task->rstack->type = FTRACE_EXIT;
-			task->rstack->addr = fstack->addr;
-
-			if (check_task_rstack(task, opts))
-				dump_replay_task(ops, task);
-		}
-	}
+	for (i = 0; i < handle->nr_tasks; i++)
+		dump_replay_remaining(ops, opts, handle, &handle->tasks[i]);
 
+out:
 	ops->footer(ops, handle, opts);
 }
 
@@ -1088,7 +1919,28 @@ int command_dump(int argc, char *argv[], struct opts *opts)
 				.kernel         = print_chrome_kernel_rstack,
 				.lost           = print_chrome_kernel_lost,
 				.footer         = print_chrome_footer,
+				.job_end        = print_chrome_job_end,
+				.job_merge      = print_chrome_job_merge,
+			},
+		};
+
+		do_dump_replay(&dump.ops, opts, &handle);
+	}
+	else if (opts->perfetto) {
+		struct uftrace_perfetto_dump dump = {
+			.ops = {
+				.header         = print_perfetto_header,
+				.task_start     = print_perfetto_task_start,
+				.inverted_time  = print_perfetto_inverted_time,
+				.task_rstack    = print_perfetto_task_rstack,
+				.kernel_start   = print_perfetto_kernel_start,
+				.cpu_start      = print_perfetto_cpu_start,
+				.kernel         = print_perfetto_kernel_rstack,
+				.lost           = print_perfetto_kernel_lost,
+				.footer         = print_perfetto_footer,
 			},
+			.names = RB_ROOT,
+			.tracks = RB_ROOT,
 		};
 
 		do_dump_replay(&dump.ops, opts, &handle);
@@ -1105,6 +1957,8 @@ int command_dump(int argc, char *argv[], struct opts *opts)
 				.kernel         = print_flame_kernel_rstack,
 				.lost           = print_flame_kernel_lost,
 				.footer         = print_flame_footer,
+				.job_end        = print_flame_job_end,
+				.job_merge      = print_flame_job_merge,
 			},
 			.tasks = RB_ROOT,
 			.sample_time = opts->sample_time,
@@ -14,12 +14,18 @@
 #include "utils/fstack.h"
 
 
+/*
+ * Backtraces are saved as a tree of call sites so that each one is a
+ * node of the tree and shares the common part with others.  Nodes in
+ * the bt_list were hit by the function (others are just a prefix).
+ */
 struct graph_backtrace {
 	struct list_head list;
+	struct graph_backtrace *parent;
+	unsigned long addr;
 	int len;
 	int hit;
 	uint64_t time;
-	unsigned long addr[];
 };
 
 struct graph_node {
@@ -33,6 +39,21 @@ struct graph_node {
 	struct graph_node *parent;
 };
 
+/* hash table to find a (backtrace or graph) node by its parent and address */
+struct graph_hash_entry {
+	void *parent;
+	unsigned long addr;
+	void *node;
+};
+
+struct graph_hash {
+	struct graph_hash_entry *entries;
+	unsigned size;
+	unsigned nr;
+};
+
+#define GRAPH_HASH_INIT  256
+
 struct uftrace_graph {
 	char *func;
 	bool kernel_only;
@@ -40,6 +61,8 @@ struct uftrace_graph {
 	struct uftrace_graph *next;
 	struct graph_backtrace *bt_curr;
 	struct list_head bt_list;
+	struct graph_hash bt_hash;
+	struct graph_hash node_hash;
 	struct graph_node root;
 };
 
@@ -90,7 +113,7 @@ static struct uftrace_graph * get_graph(struct ftrace_task_handle *task,
 	struct uftrace_graph *graph;
 	struct ftrace_session *sess;
 
-	sess = find_task_session(task->tid, time);
+	sess = get_task_session(task, time);
 	if (sess == NULL) {
 		if (is_kernel_address(addr))
 			sess = first_session;
@@ -142,13 +165,83 @@ out:
 	return tg;
 }
 
+static unsigned long graph_hash_key(void *parent, unsigned long addr)
+{
+	unsigned long key = (unsigned long)parent ^ (addr * 0x9e3779b97f4a7c15UL);
+
+	return key ^ (key >> 29);
+}
+
+static struct graph_hash_entry *graph_hash_find(struct graph_hash *hash,
+						void *parent, unsigned long addr)
+{
+	unsigned long mask = hash->size - 1;
+	unsigned long pos = graph_hash_key(parent, addr) & mask;
+	struct graph_hash_entry *entry;
+
+	while (true) {
+		entry = &hash->entries[pos];
+
+		if (entry->node == NULL)
+			return entry;
+
+		if (entry->parent == parent && entry->addr == addr)
+			return entry;
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static void graph_hash_grow(struct graph_hash *hash)
+{
+	struct graph_hash_entry *old = hash->entries;
+	unsigned old_size = hash->size;
+	unsigned i;
+
+	hash->size = old_size ? old_size * 2 : GRAPH_HASH_INIT;
+	hash->entries = xcalloc(hash->size, sizeof(*hash->entries));
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].node == NULL)
+			continue;
+
+		*graph_hash_find(hash, old[i].parent, old[i].addr) = old[i];
+	}
+	free(old);
+}
+
+static void *graph_hash_lookup(struct graph_hash *hash,
+			       void *parent, unsigned long addr)
+{
+	if (hash->size == 0)
+		return NULL;
+
+	return graph_hash_find(hash, parent, addr)->node;
+}
+
+static void graph_hash_add(struct graph_hash *hash, void *parent,
+			   unsigned long addr, void *node)
+{
+	struct graph_hash_entry *entry;
+
+	/* keep the load factor under 1/2 */
+	if ((hash->nr + 1) * 2 > hash->size)
+		graph_hash_grow(hash);
+
+	entry = graph_hash_find(hash, parent, addr);
+	entry->parent = parent;
+	entry->addr = addr;
+	entry->node = node;
+	hash->nr++;
+}
+
 static int save_backtrace_addr(struct task_graph *tg)
 {
 	int i;
 	int skip = 0;
 	int len = tg->task->stack_count;
-	unsigned long addrs[len];
-	struct graph_backtrace *bt;
+	struct graph_backtrace *bt = NULL;
+	struct graph_backtrace *parent;
 
 	if (tg->graph->kernel_only) {
 		skip = tg->task->user_stack_count;
@@ -158,26 +251,28 @@ static int save_backtrace_addr(struct task_graph *tg)
 	if (len == 0)
 		return 0;
 
-	for (i = len - 1; i >= 0; i--)
-		addrs[i] = tg->task->func_stack[i + skip].addr;
+	for (i = 0; i < len; i++) {
+		unsigned long addr = tg->task->func_stack[i + skip].addr;
 
-	list_for_each_entry(bt, &tg->graph->bt_list, list) {
-		if (len == bt->len &&
-		    !memcmp(addrs, bt->addr, len * sizeof(*addrs)))
-			goto found;
-	}
+		parent = bt;
+		bt = graph_hash_lookup(&tg->graph->bt_hash, parent, addr);
+		if (bt)
+			continue;
 
-	bt = xmalloc(sizeof(*bt) + len * sizeof(*addrs));
+		bt = xmalloc(sizeof(*bt));
 
-	bt->len = len;
-	bt->hit = 0;
-	bt->time = 0;
-	memcpy(bt->addr, addrs, len * sizeof(*addrs));
+		bt->parent = parent;
+		bt->addr = addr;
+		bt->len = i + 1;
+		bt->hit = 0;
+		bt->time = 0;
 
-	list_add(&bt->list, &tg->graph->bt_list);
+		graph_hash_add(&tg->graph->bt_hash, parent, addr, bt);
+	}
+
+	if (bt->hit++ == 0)
+		list_add(&bt->list, &tg->graph->bt_list);
 
-found:
-	bt->hit++;
 	tg->bt_curr = bt;
 
 	return 0;
@@ -196,28 +291,38 @@ static void save_backtrace_time(struct task_graph *tg)
 static int print_backtrace(struct uftrace_graph *graph)
 {
 	int i = 0, k;
-	struct graph_backtrace *bt;
+	struct graph_backtrace *bt, *iter;
 	struct sym *sym;
 	char *symname;
+	unsigned long *addrs = NULL;
+	int max_len = 0;
 
 	list_for_each_entry(bt, &graph->bt_list, list) {
 		pr_out(" backtrace #%d: hit %d, time ", i++, bt->hit);
 		print_time_unit(bt->time);
 		pr_out("\n");
 
+		if (bt->len > max_len) {
+			max_len = bt->len;
+			addrs = xrealloc(addrs, max_len * sizeof(*addrs));
+		}
+
+		/* the tree has the addresses in the reverse order */
+		for (iter = bt, k = bt->len; iter; iter = iter->parent)
+			addrs[--k] = iter->addr;
+
 		for (k = 0; k < bt->len; k++) {
-			sym = find_symtabs(&graph->sess->symtabs, bt->addr[k]);
-			if (sym == NULL)
-				sym = session_find_dlsym(graph->sess,
-							 bt->time, bt->addr[k]);
+			sym = session_find_sym(graph->sess, bt->time, addrs[k]);
 
-			symname = symbol_getname(sym, bt->addr[k]);
-			pr_out("   [%d] %s (%#lx)\n", k, symname, bt->addr[k]);
+			symname = symbol_getname(sym, addrs[k]);
+			pr_out("   [%d] %s (%#lx)\n", k, symname, addrs[k]);
 			symbol_putname(sym, symname);
 		}
 		pr_out("\n");
 	}
 
+	free(addrs);
+
 	return 0;
 }
 
@@ -263,12 +368,8 @@ static int add_graph_entry(struct task_graph *tg)
 	if (tg->lost)
 		return 1;  /* ignore kernel functions after LOST */
 
-	list_for_each_entry(node, &curr->head, list) {
-		if (node->addr == rstack->addr)
-			break;
-	}
-
-	if (list_no_entry(node, &curr->head, list)) {
+	node = graph_hash_lookup(&tg->graph->node_hash, curr, rstack->addr);
+	if (node == NULL) {
 		node = xcalloc(1, sizeof(*node));
 
 		node->addr = rstack->addr;
@@ -277,6 +378,8 @@ static int add_graph_entry(struct task_graph *tg)
 		node->parent = curr;
 		list_add_tail(&node->list, &node->parent->head);
 		node->parent->nr_edges++;
+
+		graph_hash_add(&tg->graph->node_hash, curr, node->addr, node);
 	}
 
 	node->nr_calls++;
@@ -433,8 +536,9 @@ static int print_graph(struct uftrace_graph *graph, struct opts *opts)
 	return 1;
 }
 
-static void build_graph_node (struct ftrace_task_handle *task, uint64_t time,
-			      unsigned long addr, int type, char *func)
+static struct task_graph *
+build_graph_node(struct ftrace_task_handle *task, uint64_t time,
+		 unsigned long addr, int type, char *func)
 {
 	struct task_graph *tg;
 	struct sym *sym = NULL;
@@ -446,7 +550,7 @@ static void build_graph_node (struct ftrace_task_handle *task, uint64_t time,
 
 	/* cannot find a session for this record */
 	if (tg->graph == NULL)
-		return;
+		return tg;
 
 	sym = find_symtabs(&tg->graph->sess->symtabs, addr);
 	name = symbol_getname(sym, addr);
@@ -459,6 +563,7 @@ static void build_graph_node (struct ftrace_task_handle *task, uint64_t time,
 	}
 
 	symbol_putname(sym, name);
+	return tg;
 }
 
 static int build_graph(struct opts *opts, struct ftrace_file_handle *handle,
@@ -467,6 +572,7 @@ static int build_graph(struct opts *opts, struct ftrace_file_handle *handle,
 	int ret = 0;
 	struct ftrace_task_handle *task;
 	struct uftrace_graph *graph;
+	struct task_graph *tg;
 	uint64_t prev_time = 0;
 	int i;
 
@@ -490,8 +596,6 @@ static int build_graph(struct opts *opts, struct ftrace_file_handle *handle,
 			continue;
 
 		if (frs->type == FTRACE_LOST) {
-			struct task_graph *tg;
-
 			if (opts->kernel_skip_out && !task->user_stack_count)
 				continue;
 
@@ -534,7 +638,12 @@ static int build_graph(struct opts *opts, struct ftrace_file_handle *handle,
 		if (task->stack_count >= opts->max_stack)
 			continue;
 
-		build_graph_node(task, frs->time, frs->addr, frs->type, func);
+		tg = build_graph_node(task, frs->time, frs->addr, frs->type,
+				      func);
+
+		/* skip data until the function is called again */
+		if (!tg->enabled)
+			fstack_skip_func_index(task);
 	}
 
 	/* add duration of remaining functions */
@@ -606,6 +715,40 @@ static int find_func(struct ftrace_session *s, void *arg)
 	return data->found;
 }
 
+struct graph_func_arg {
+	char *name;
+	unsigned long addr;
+	bool found;
+};
+
+static int find_graph_func(struct ftrace_session *s, void *arg)
+{
+	struct graph_func_arg *gfa = arg;
+	struct sym *sym;
+	char *name;
+
+	/* same as build_graph_node() */
+	sym = find_symtabs(&s->symtabs, gfa->addr);
+	name = symbol_getname(sym, gfa->addr);
+
+	if (!strcmp(name, gfa->name))
+		gfa->found = true;
+
+	symbol_putname(sym, name);
+	return gfa->found;
+}
+
+static bool match_graph_func(unsigned long addr, void *arg)
+{
+	struct graph_func_arg gfa = {
+		.name = arg,
+		.addr = addr,
+	};
+
+	walk_sessions(find_graph_func, &gfa);
+	return gfa.found;
+}
+
 static void synthesize_depth_trigger(struct opts *opts, char *func)
 {
 	size_t old_len = opts->trigger ? strlen(opts->trigger) : 0;
@@ -628,6 +771,7 @@ int command_graph(int argc, char *argv[], struct opts *opts)
 	struct ftrace_file_handle handle;
 	struct ftrace_kernel kern;
 	char *func;
+	bool use_index;
 
 	__fsetlocking(outfp, FSETLOCKING_BYCALLER);
 	__fsetlocking(logfp, FSETLOCKING_BYCALLER);
@@ -650,6 +794,9 @@ int command_graph(int argc, char *argv[], struct opts *opts)
 		}
 	}
 
+	/* user filters and triggers can change the function stack */
+	use_index = !opts->filter && !opts->trigger;
+
 	if (opts->depth != OPT_DEPTH_DEFAULT) {
 		/*
 		 * Applying depth filter before the function might
@@ -661,6 +808,9 @@ int command_graph(int argc, char *argv[], struct opts *opts)
 
 	fstack_setup_filters(opts, &handle);
 
+	if (use_index)
+		fstack_setup_func_index(&handle, match_graph_func, func);
+
 	ret = build_graph(opts, &handle, func);
 
 	if (handle.kern)
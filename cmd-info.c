@@ -200,6 +200,10 @@ static int fill_exit_status(void *arg)
 {
 	struct fill_handler_arg *fha = arg;
 
+	/* the recording is not finished yet */
+	if (fha->rusage == NULL)
+		return -1;
+
 	return dprintf(fha->fd, "exit_status:%d\n", fha->exit_status);
 }
 
@@ -549,6 +553,9 @@ static int fill_usageinfo(void *arg)
 	struct fill_handler_arg *fha = arg;
 	struct rusage *r = fha->rusage;
 
+	if (r == NULL)
+		return -1;
+
 	dprintf(fha->fd, "usageinfo:lines=6\n");
 	dprintf(fha->fd, "usageinfo:systime=%lu.%06lu\n",
 		r->ru_stime.tv_sec, r->ru_stime.tv_usec);
@@ -38,6 +38,7 @@ static LIST_HEAD(shmem_need_unlink);
 struct buf_list {
 	struct list_head list;
 	int tid;
+	size_t size;
 	void *shmem_buf;
 };
 
@@ -188,6 +189,11 @@ static void setup_child_environ(struct opts *opts, int pfd)
 		setenv("UFTRACE_BUFFER", buf, 1);
 	}
 
+	if (opts->buffer_limit) {
+		snprintf(buf, sizeof(buf), "%lu", opts->buffer_limit);
+		setenv("UFTRACE_BUFFER_LIMIT", buf, 1);
+	}
+
 	if (opts->logfile) {
 		snprintf(buf, sizeof(buf), "%d", fileno(logfp));
 		setenv("UFTRACE_LOGFD", buf, 1);
@@ -240,6 +246,9 @@ static uint64_t calc_feat_mask(struct opts *opts)
 	if (opts->retval)
 		features |= RETVAL;
 
+	if (opts->container && !opts->host)
+		features |= DATA_CONTAINER;
+
 	return features;
 }
 
@@ -248,15 +257,23 @@ static int fill_file_header(struct opts *opts, int status, struct rusage *rusage
 	int fd, efd;
 	int ret = -1;
 	char *filename = NULL;
+	char *tmpname = NULL;
 	struct ftrace_file_header hdr;
 	char elf_ident[EI_NIDENT];
 
 	xasprintf(&filename, "%s/info", opts->dirname);
 	pr_dbg3("fill header (metadata) info in %s\n", filename);
 
-	fd = open(filename, O_WRONLY | O_CREAT| O_TRUNC, 0644);
+	/*
+	 * The info file can be read while recording (--follow) so write
+	 * it to a temp file and rename it not to show a partial file.
+	 */
+	xasprintf(&tmpname, "%s/.info", opts->dirname);
+
+	fd = open(tmpname, O_WRONLY | O_CREAT| O_TRUNC, 0644);
 	if (fd < 0) {
 		pr_log("cannot open info file: %s\n", strerror(errno));
+		free(tmpname);
 		free(filename);
 		return -1;
 	}
@@ -293,6 +310,7 @@ try_write:
 			goto try_write;
 
 		pr_dbg("writing header info failed.\n");
+		ret = -1;
 		goto close_efd;
 	}
 
@@ -302,6 +320,15 @@ close_efd:
 	close(efd);
 close_fd:
 	close(fd);
+
+	if (ret == 0 && rename(tmpname, filename) < 0) {
+		pr_dbg("cannot rename info file: %s\n", strerror(errno));
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(tmpname);
+
+	free(tmpname);
 	free(filename);
 
 	return ret;
@@ -314,7 +341,7 @@ static void parse_msg_id(char *id, uint64_t *sid, int *tid, int *seq)
 	unsigned _seq;
 
 	/*
-	 * parse message id of "/uftrace-SESSION-TID-SEQ".
+	 * parse message id of "/uftrace-SESSION-PID-SEQ".
 	 */
 	if (sscanf(id, "/uftrace-%016"SCNx64"-%u-%03u", &_sid, &_tid, &_seq) != 3)
 		pr_err("parse msg id failed");
@@ -340,6 +367,7 @@ static void write_buffer_file(const char *dirname, struct buf_list *buf)
 {
 	int fd;
 	char *filename;
+	off_t offset;
 	struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
 
 	filename = make_disk_name(dirname, buf->tid);
@@ -347,6 +375,11 @@ static void write_buffer_file(const char *dirname, struct buf_list *buf)
 	if (fd < 0)
 		pr_err("open disk file");
 
+	offset = lseek(fd, 0, SEEK_END);
+	if (offset >= 0)
+		write_task_index(dirname, buf->tid, offset,
+				 shmbuf->data, shmbuf->size);
+
 	if (write_all(fd, shmbuf->data, shmbuf->size) < 0)
 		pr_err("write shmem buffer");
 
@@ -354,10 +387,16 @@ static void write_buffer_file(const char *dirname, struct buf_list *buf)
 	free(filename);
 }
 
-static void write_buffer(struct buf_list *buf, struct opts *opts, int sock)
+static void write_buffer(struct buf_list *buf, struct opts *opts, int sock,
+			 int idx)
 {
 	struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
 
+	/* each writer has its own segment file */
+	if (!opts->host && opts->container)
+		return write_task_chunk(opts->dirname, idx, buf->tid,
+					shmbuf->data, shmbuf->size);
+
 	if (!opts->host)
 		return write_buffer_file(opts->dirname, buf);
 
@@ -384,7 +423,7 @@ static void write_buf_list(struct list_head *buf_head, struct opts *opts,
 	list_for_each_entry(buf, buf_head, list) {
 		struct mcount_shmem_buffer *shmbuf = buf->shmem_buf;
 
-		write_buffer(buf, opts, warg->sock);
+		write_buffer(buf, opts, warg->sock, warg->idx);
 
 		/*
 		 * Now it has consumed all contents in the shmem buffer,
@@ -394,7 +433,7 @@ static void write_buf_list(struct list_head *buf_head, struct opts *opts,
 		__sync_synchronize();
 		shmbuf->flag = SHMEM_FL_WRITTEN;
 
-		munmap(shmbuf, opts->bufsize);
+		munmap(shmbuf, buf->size);
 		buf->shmem_buf = NULL;
 	}
 
@@ -526,7 +565,8 @@ static struct buf_list *make_write_buffer(void)
 	return buf;
 }
 
-static void copy_to_buffer(struct mcount_shmem_buffer *shm, char *sess_id)
+static void copy_to_buffer(struct mcount_shmem_buffer *shm, size_t size,
+			   char *sess_id)
 {
 	struct buf_list *buf = NULL;
 	struct writer_arg *writer;
@@ -547,7 +587,12 @@ static void copy_to_buffer(struct mcount_shmem_buffer *shm, char *sess_id)
 	}
 
 	buf->shmem_buf = shm;
-	parse_msg_id(sess_id, NULL, &buf->tid, NULL);
+	buf->size = size;
+	/* buffers can be reused by other threads in the same process */
+	if (shm->tid)
+		buf->tid = shm->tid;
+	else
+		parse_msg_id(sess_id, NULL, &buf->tid, NULL);
 
 	pthread_mutex_lock(&write_list_lock);
 	/* check some writers work for this tid */
@@ -574,6 +619,7 @@ static int record_mmap_file(const char *dirname, char *sess_id, int bufsize)
 	int fd;
 	struct shmem_list *sl;
 	struct mcount_shmem_buffer *shmem_buf;
+	struct stat stbuf;
 
 	/* write (append) it to disk */
 	fd = shm_open(sess_id, O_RDWR, 0600);
@@ -582,6 +628,10 @@ static int record_mmap_file(const char *dirname, char *sess_id, int bufsize)
 		return 0;
 	}
 
+	/* libmcount can change buffer size for each thread */
+	if (fstat(fd, &stbuf) == 0 && stbuf.st_size > 0)
+		bufsize = stbuf.st_size;
+
 	shmem_buf = mmap(NULL, bufsize, PROT_READ | PROT_WRITE,
 			 MAP_SHARED, fd, 0);
 	if (shmem_buf == MAP_FAILED)
@@ -613,7 +663,7 @@ static int record_mmap_file(const char *dirname, char *sess_id, int bufsize)
 
 		if (shmem_buf->size) {
 			/* shmem_buf will be unmapped */
-			copy_to_buffer(shmem_buf, sess_id);
+			copy_to_buffer(shmem_buf, bufsize, sess_id);
 		}
 	}
 
@@ -634,8 +684,8 @@ static void record_remaining_buffer(struct opts *opts, int sock)
 	/* called after all writers gone, no lock is needed */
 	while (!list_empty(&buf_write_list)) {
 		buf = list_first_entry(&buf_write_list, struct buf_list, list);
-		write_buffer(buf, opts, sock);
-		munmap(buf->shmem_buf, opts->bufsize);
+		write_buffer(buf, opts, sock, 0);
+		munmap(buf->shmem_buf, buf->size);
 
 		list_del(&buf->list);
 		free(buf);
@@ -702,21 +752,24 @@ static void unlink_shmem_list(void)
 
 static void flush_old_shmem(const char *dirname, int tid, int bufsize)
 {
-	struct shmem_list *sl;
+	struct shmem_list *sl, *tmp;
 
-	/* flush remaining list (due to abnormal termination) */
-	list_for_each_entry(sl, &shmem_list_head, list) {
-		int sl_tid;
+	/*
+	 * flush remaining list (due to abnormal termination).
+	 * the buffer name has the pid (= tid of the main thread) and
+	 * other threads in the old process can have their buffers.
+	 */
+	list_for_each_entry_safe(sl, tmp, &shmem_list_head, list) {
+		int sl_pid;
 
-		sscanf(sl->id, "/uftrace-%*x-%d-%*d", &sl_tid);
+		sscanf(sl->id, "/uftrace-%*x-%d-%*d", &sl_pid);
 
-		if (tid == sl_tid) {
+		if (tid == sl_pid) {
 			pr_dbg3("flushing %s\n", sl->id);
 
 			list_del(&sl->list);
 			record_mmap_file(dirname, sl->id, bufsize);
 			free(sl);
-			return;
 		}
 	}
 }
@@ -1263,7 +1316,8 @@ static void print_child_usage(struct rusage *ru)
 "\tplease give it the absolute pathname (like /usr/bin/%s).\n"
 
 #define MCOUNT_MSG  "Can't find '%s' symbol in the '%s'.\n"		\
-"\tIt seems not to be compiled with -pg or -finstrument-functions flag\n" 	\
+"\tIt seems not to be compiled with -pg, -finstrument-functions\n"		\
+"\tor -fxray-instrument flag\n"						\
 "\twhich generates traceable code.  Please check your binary file.\n"
 
 #define FTRACE_ELF_MSG  "Cannot trace '%s': Invalid file\n"		\
@@ -1495,6 +1549,14 @@ int command_record(int argc, char *argv[], struct opts *opts)
 		pthread_create(&writers[i], NULL, writer_thread, warg);
 	}
 
+	/*
+	 * Write the info file without exit status so that replay (or
+	 * report) can read the data while recording.  It'll be written
+	 * again when the recording is finished.
+	 */
+	if (fill_file_header(opts, 0, NULL) < 0)
+		pr_dbg("cannot write info file\n");
+
 	/* signal child that I'm ready */
 	if (write(efd, &go, sizeof(go)) != (ssize_t)sizeof(go))
 		pr_err("signal to child failed");
@@ -1572,9 +1634,6 @@ int command_record(int argc, char *argv[], struct opts *opts)
 	if (opts->kernel)
 		stop_kernel_tracing(&kern);
 
-	if (fill_file_header(opts, status, &usage) < 0)
-		pr_err("cannot generate data file");
-
 	if (opts->time) {
 		print_child_time(&ts1, &ts2);
 		print_child_usage(&usage);
@@ -1599,6 +1658,10 @@ int command_record(int argc, char *argv[], struct opts *opts)
 	if (opts->kernel)
 		finish_kernel_tracing(&kern);
 
+	/* --follow treats the data as complete when it sees exit status */
+	if (fill_file_header(opts, status, &usage) < 0)
+		pr_err("cannot generate data file");
+
 	if (opts->host) {
 		send_task_file(sock, opts->dirname, &symtabs);
 		send_map_files(sock, opts->dirname);
@@ -11,6 +11,7 @@
 #include <netdb.h>
 #include <sys/signalfd.h>
 #include <sys/epoll.h>
+#include <sys/stat.h>
 #include <linux/limits.h>
 
 #include "uftrace.h"
@@ -344,6 +345,9 @@ static void recv_trace_data(int sock, int len)
 	struct client_data *client;
 	int32_t tid;
 	char *filename = NULL;
+	char path[PATH_MAX];
+	struct stat stbuf;
+	uint64_t offset = 0;
 	void *buffer;
 
 	client = find_client(sock);
@@ -362,6 +366,11 @@ static void recv_trace_data(int sock, int len)
 	if (read_all(sock, buffer, len) < 0)
 		pr_err("recv buffer failed");
 
+	snprintf(path, sizeof(path), "%s/%s", client->dirname, filename);
+	if (stat(path, &stbuf) == 0)
+		offset = stbuf.st_size;
+
+	write_task_index(client->dirname, tid, offset, buffer, len);
 	write_client_file(client, filename, 1, buffer, len);
 
 	free(buffer);
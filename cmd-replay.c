@@ -289,13 +289,11 @@ static void print_backtrace(struct ftrace_task_handle *task)
 		struct replay_field *field;
 
 		fstack = &task->func_stack[i];
-		sess = find_task_session(task->tid, fstack->total_time);
+		sess = get_task_session(task, fstack->total_time);
 
 		if (sess || is_kernel_address(fstack->addr)) {
-			sym = find_symtabs(&sess->symtabs, fstack->addr);
-			if (sym == NULL && sess)
-				sym = session_find_dlsym(sess, fstack->total_time,
-							 fstack->addr);
+			sym = find_symtabs_time(&sess->symtabs, fstack->addr,
+						fstack->total_time);
 		}
 		else
 			sym = NULL;
@@ -323,7 +321,7 @@ static int print_flat_rstack(struct ftrace_file_handle *handle,
 {
 	static int count;
 	struct ftrace_ret_stack *rstack = task->rstack;
-	struct ftrace_session *sess = find_task_session(task->tid, rstack->time);
+	struct ftrace_session *sess = get_task_session(task, rstack->time);
 	struct symtabs *symtabs;
 	struct sym *sym = NULL;
 	char *name;
@@ -331,10 +329,7 @@ static int print_flat_rstack(struct ftrace_file_handle *handle,
 
 	if (sess || is_kernel_address(rstack->addr)) {
 		symtabs = &sess->symtabs;
-		sym = find_symtabs(symtabs, rstack->addr);
-		if (sym == NULL && sess)
-			sym = session_find_dlsym(sess, rstack->time,
-						 rstack->addr);
+		sym = find_symtabs_time(symtabs, rstack->addr, rstack->time);
 	}
 
 	name = symbol_getname(sym, rstack->addr);
@@ -573,13 +568,10 @@ static int print_graph_rstack(struct ftrace_file_handle *handle,
 	if (rstack->type == FTRACE_LOST)
 		goto lost;
 
-	sess = find_task_session(task->tid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 	if (sess || is_kernel_address(rstack->addr)) {
 		symtabs = &sess->symtabs;
-		sym = find_symtabs(symtabs, rstack->addr);
-		if (sym == NULL && sess)
-			sym = session_find_dlsym(sess, rstack->time,
-						 rstack->addr);
+		sym = find_symtabs_time(symtabs, rstack->addr, rstack->time);
 	}
 	symname = symbol_getname(sym, rstack->addr);
 
@@ -813,7 +805,7 @@ static void print_remaining_stack(struct opts *opts,
 		while (task->stack_count-- > 0) {
 			struct fstack *fstack = &task->func_stack[task->stack_count];
 			uint64_t time = fstack->total_time;
-			struct ftrace_session *sess = find_task_session(task->tid, time);
+			struct ftrace_session *sess = get_task_session(task, time);
 			unsigned long ip = fstack->addr;
 			struct symtabs *symtabs;
 			struct sym *sym;
@@ -821,12 +813,10 @@ static void print_remaining_stack(struct opts *opts,
 
 			if (sess || is_kernel_address(ip)) {
 				symtabs = &sess->symtabs;
-				sym = find_symtabs(symtabs, ip);
+				sym = find_symtabs_time(symtabs, ip, time);
 			} else
 				sym = NULL;
 
-			if (sym == NULL && sess)
-				sym = session_find_dlsym(sess, time, ip);
 			symname = symbol_getname(sym, ip);
 
 			pr_out("[%d] %s\n", task->stack_count - zero_count, symname);
@@ -855,7 +845,8 @@ int command_replay(int argc, char *argv[], struct opts *opts)
 	if (ret < 0)
 		return -1;
 
-	if (opts->kernel && (handle.hdr.feat_mask & KERNEL)) {
+	/* kernel data is not followed */
+	if (opts->kernel && (handle.hdr.feat_mask & KERNEL) && !handle.follow) {
 		kern.output_dir = opts->dirname;
 		kern.skip_out = opts->kernel_skip_out;
 		if (setup_kernel_data(&kern) == 0) {
@@ -867,12 +858,33 @@ int command_replay(int argc, char *argv[], struct opts *opts)
 	fstack_setup_filters(opts, &handle);
 	setup_field(opts);
 
+	/* skip data outside of the filtered functions */
+	if (!opts->flat)
+		fstack_setup_filter_index(&handle);
+
+	/*
+	 * write the output in a separate thread (formatting is still done
+	 * here).  a file gets the output only when the buffer is full.
+	 */
+	if (!handle.follow)
+		start_output_writer();
+
 	if (!opts->flat)
 		print_header();
 
-	while (read_rstack(&handle, &task) == 0 && !uftrace_done) {
-		struct ftrace_ret_stack *rstack = task->rstack;
-		uint64_t curr_time = rstack->time;
+	while (!uftrace_done) {
+		struct ftrace_ret_stack *rstack;
+		uint64_t curr_time;
+
+		if (read_rstack(&handle, &task) < 0) {
+			/* wait for new data if it's being recorded */
+			if (follow_data_file(&handle) == 0)
+				continue;
+			break;
+		}
+
+		rstack = task->rstack;
+		curr_time = rstack->time;
 
 		/* skip user functions if --kernel-only is set */
 		if (opts->kernel_only && !is_kernel_address(rstack->addr))
@@ -882,9 +894,11 @@ int command_replay(int argc, char *argv[], struct opts *opts)
 		 * data sanity check: timestamp should be ordered.
 		 * But print_graph_rstack() may change task->rstack
 		 * during fstack_skip().  So check the timestamp here.
+		 * Records of other tasks can be written later when
+		 * following the data.
 		 */
 		if (curr_time) {
-			if (prev_time > curr_time)
+			if (prev_time > curr_time && !opts->follow)
 				print_warning(task);
 			prev_time = rstack->time;
 		}
@@ -896,10 +910,14 @@ int command_replay(int argc, char *argv[], struct opts *opts)
 
 		if (ret)
 			break;
+
+		fstack_skip_func_index(task);
 	}
 
 	print_remaining_stack(opts, &handle);
 
+	finish_output_writer();
+
 	if (handle.kern)
 		finish_kernel_data(handle.kern);
 
@@ -2,6 +2,16 @@
 #include <string.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "uftrace.h"
 #include "utils/utils.h"
@@ -9,6 +19,7 @@
 #include "utils/symbol.h"
 #include "utils/list.h"
 #include "utils/fstack.h"
+#include "utils/histogram.h"
 
 
 enum {
@@ -27,17 +38,93 @@ struct trace_entry {
 	uint64_t time_avg;
 	uint64_t time_min;
 	uint64_t time_max;
+	uint64_t timestamp;	/* to find the symbol in other process */
 	unsigned long nr_called;
+	struct uftrace_hist *hist;
+	uint64_t *time_pct;	/* time at each percentile */
 	struct trace_entry *pair;
 	struct rb_node link;
 };
 
-static void insert_entry(struct rb_root *root, struct trace_entry *te, bool thread)
+/* percentiles to show (or sort) and whether to keep histograms */
+static double *percentiles;
+static int nr_percentiles;
+static bool use_hist;
+
+/* time interval to show function statistics (--interval) */
+static uint64_t report_interval;
+static uint64_t interval_base;	/* time of the first record */
+static uint64_t interval_start;	/* elapsed time of the current interval */
+
+/* histogram has total time by default, or self time for --avg-self */
+static uint64_t entry_hist_time(struct trace_entry *te)
+{
+	if (avg_mode == AVG_SELF)
+		return te->time_self;
+	return te->time_total;
+}
+
+static void add_entry_hist(struct trace_entry *entry, struct trace_entry *te)
+{
+	if (te->hist)
+		hist_merge(entry->hist, te->hist);
+	else
+		hist_add(entry->hist, entry_hist_time(te), te->nr_called);
+}
+
+/* set min/max time of a single call */
+static void set_entry_time(struct trace_entry *te)
+{
+	uint64_t entry_time = 0;
+
+	if (avg_mode == AVG_TOTAL)
+		entry_time = te->time_total;
+	else if (avg_mode == AVG_SELF)
+		entry_time = te->time_self;
+
+	te->time_min = entry_time;
+	te->time_max = entry_time;
+}
+
+static void merge_entry(struct trace_entry *entry, struct trace_entry *te)
+{
+	entry->time_total += te->time_total;
+	entry->time_self  += te->time_self;
+	entry->nr_called  += te->nr_called;
+
+	if (entry->time_min > te->time_min)
+		entry->time_min = te->time_min;
+	if (entry->time_max < te->time_max)
+		entry->time_max = te->time_max;
+
+	entry->time_recursive += te->time_recursive;
+
+	if (entry->hist)
+		add_entry_hist(entry, te);
+
+	if (entry->sym == NULL && te->sym)
+		entry->sym = te->sym;
+}
+
+/* functions are identified by symbol id, or address if unknown */
+static int cmp_entry_key(struct trace_entry *a, struct trace_entry *b)
+{
+	unsigned a_id = a->sym ? a->sym->id : 0;
+	unsigned b_id = b->sym ? b->sym->id : 0;
+
+	if (a_id != b_id)
+		return a_id < b_id ? -1 : 1;
+	if (a_id || a->addr == b->addr)
+		return 0;
+	return a->addr < b->addr ? -1 : 1;
+}
+
+static struct trace_entry *insert_entry(struct rb_root *root,
+					struct trace_entry *te, bool thread)
 {
 	struct trace_entry *entry;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &root->rb_node;
-	uint64_t entry_time = 0;
 
 	pr_dbg3("%s: [%5d] %"PRIu64"/%"PRIu64" (%lu) %-s\n",
 		__func__, te->pid, te->time_total, te->time_self, te->nr_called,
@@ -52,29 +139,11 @@ static void insert_entry(struct rb_root *root, struct trace_entry *te, bool thre
 		if (thread)
 			cmp = te->pid - entry->pid;
 		else
-			cmp = te->addr - entry->addr;
+			cmp = cmp_entry_key(te, entry);
 
 		if (cmp == 0) {
-			entry->time_total += te->time_total;
-			entry->time_self  += te->time_self;
-			entry->nr_called  += te->nr_called;
-
-			if (avg_mode == AVG_TOTAL)
-				entry_time = te->time_total;
-			else if (avg_mode == AVG_SELF)
-				entry_time = te->time_self;
-
-			if (entry->time_min > entry_time)
-				entry->time_min = entry_time;
-			if (entry->time_max < entry_time)
-				entry->time_max = entry_time;
-
-			entry->time_recursive += te->time_recursive;
-
-			if (entry->sym == NULL && te->sym)
-				entry->sym = te->sym;
-
-			return;
+			merge_entry(entry, te);
+			return entry;
 		}
 
 		if (cmp < 0)
@@ -92,17 +161,205 @@ static void insert_entry(struct rb_root *root, struct trace_entry *te, bool thre
 	entry->nr_called  = te->nr_called;
 	entry->pair = NULL;
 
-	if (avg_mode == AVG_TOTAL)
-		entry_time = te->time_total;
-	else if (avg_mode == AVG_SELF)
-		entry_time = te->time_self;
-
-	entry->time_min = entry_time;
-	entry->time_max = entry_time;
+	entry->time_min = te->time_min;
+	entry->time_max = te->time_max;
 	entry->time_recursive = te->time_recursive;
+	entry->timestamp = te->timestamp;
+
+	entry->hist = NULL;
+	entry->time_pct = NULL;
+	if (use_hist && !thread) {
+		entry->hist = xzalloc(sizeof(*entry->hist));
+		add_entry_hist(entry, te);
+	}
 
 	rb_link_node(&entry->link, parent, p);
 	rb_insert_color(&entry->link, root);
+
+	return entry;
+}
+
+/* function entries indexed by symbol id to skip the tree search */
+static struct trace_entry **entry_table;
+static unsigned entry_table_size;
+
+static void add_function_entry(struct rb_root *root, struct trace_entry *te)
+{
+	unsigned id = te->sym ? te->sym->id : 0;
+
+	if (id == 0) {
+		insert_entry(root, te, false);
+		return;
+	}
+
+	if (id >= entry_table_size) {
+		unsigned new_size = symbol_nr_ids() + 1;
+
+		entry_table = xrealloc(entry_table,
+				       new_size * sizeof(*entry_table));
+		memset(entry_table + entry_table_size, 0,
+		       (new_size - entry_table_size) * sizeof(*entry_table));
+		entry_table_size = new_size;
+	}
+
+	if (entry_table[id])
+		merge_entry(entry_table[id], te);
+	else
+		entry_table[id] = insert_entry(root, te, false);
+}
+
+/*
+ * Calling context (call path) of functions: each node is a function
+ * called from the parent node so a path from the root is the call
+ * stack.  Nodes are found by a hash table keyed by the parent and the
+ * address so that the same path always gets the same node.
+ */
+struct call_path {
+	struct call_path *parent;
+	uint64_t addr;
+	int depth;
+	struct trace_entry entry;
+};
+
+#define CALL_PATH_HASH_INIT  1024
+
+static struct call_path_tree {
+	struct call_path root;
+	struct call_path **hash;
+	unsigned hash_size;
+	unsigned nr_paths;
+	/* last path of each task to skip the hash lookup */
+	struct ftrace_task_handle *tasks;
+	struct call_path ***task_paths;
+	int max_stack;
+} cpt;
+
+static struct call_path **find_call_path(struct call_path *parent,
+					 uint64_t addr)
+{
+	unsigned long mask = cpt.hash_size - 1;
+	unsigned long key = (unsigned long)parent ^ (addr * 0x9e3779b97f4a7c15UL);
+	unsigned long pos = (key ^ (key >> 29)) & mask;
+	struct call_path **slot;
+
+	while (true) {
+		slot = &cpt.hash[pos];
+
+		if (*slot == NULL)
+			return slot;
+
+		if ((*slot)->parent == parent && (*slot)->addr == addr)
+			return slot;
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static void grow_call_path_hash(void)
+{
+	struct call_path **old = cpt.hash;
+	unsigned old_size = cpt.hash_size;
+	unsigned i;
+
+	cpt.hash_size = old_size ? old_size * 2 : CALL_PATH_HASH_INIT;
+	cpt.hash = xcalloc(cpt.hash_size, sizeof(*cpt.hash));
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i])
+			*find_call_path(old[i]->parent, old[i]->addr) = old[i];
+	}
+	free(old);
+}
+
+static struct call_path *get_call_path(struct ftrace_task_handle *task,
+				       struct call_path *parent, uint64_t addr,
+				       uint64_t time)
+{
+	struct call_path **slot;
+	struct call_path *path;
+	struct ftrace_session *sess;
+
+	/* keep the load factor under 1/2 */
+	if ((cpt.nr_paths + 1) * 2 > cpt.hash_size)
+		grow_call_path_hash();
+
+	slot = find_call_path(parent, addr);
+	if (*slot)
+		return *slot;
+
+	sess = get_task_session(task, time);
+
+	path = xzalloc(sizeof(*path));
+	path->parent = parent;
+	path->addr = addr;
+	path->depth = parent->depth + 1;
+	path->entry.pid = task->tid;
+	path->entry.addr = addr;
+	path->entry.sym = session_find_sym(sess, time, addr);
+	path->entry.timestamp = time;
+
+	*slot = path;
+	cpt.nr_paths++;
+
+	return path;
+}
+
+static void add_call_path_entry(struct ftrace_task_handle *task,
+				struct trace_entry *te)
+{
+	int idx = task - cpt.tasks;
+	struct call_path **paths = cpt.task_paths[idx];
+	struct call_path *parent = &cpt.root;
+	struct call_path *path;
+	struct trace_entry *entry;
+	int i;
+
+	if (paths == NULL) {
+		paths = xcalloc(cpt.max_stack + 1, sizeof(*paths));
+		cpt.task_paths[idx] = paths;
+	}
+
+	/* the current function is at the top of the stack */
+	for (i = 0; i <= task->stack_count; i++) {
+		uint64_t addr = task->func_stack[i].addr;
+
+		path = paths[i];
+		if (path == NULL || path->parent != parent || path->addr != addr) {
+			path = get_call_path(task, parent, addr, te->timestamp);
+			paths[i] = path;
+		}
+		parent = path;
+	}
+
+	/* recursion is a different path */
+	te->time_recursive = 0;
+
+	/* the last one is the current function */
+	entry = &parent->entry;
+	if (entry->nr_called) {
+		merge_entry(entry, te);
+		return;
+	}
+
+	entry->time_total = te->time_total;
+	entry->time_self  = te->time_self;
+	entry->time_min   = te->time_min;
+	entry->time_max   = te->time_max;
+	entry->nr_called  = te->nr_called;
+
+	if (use_hist) {
+		entry->hist = xzalloc(sizeof(*entry->hist));
+		add_entry_hist(entry, te);
+	}
+}
+
+static void add_report_entry(struct ftrace_task_handle *task,
+			     struct rb_root *root, struct trace_entry *te)
+{
+	if (cpt.task_paths)
+		add_call_path_entry(task, te);
+	else
+		add_function_entry(root, te);
 }
 
 static bool fill_entry(struct trace_entry *te, struct ftrace_task_handle *task,
@@ -124,13 +381,11 @@ static bool fill_entry(struct trace_entry *te, struct ftrace_task_handle *task,
 			return false;
 	}
 
-	sess = find_task_session(task->tid, time);
+	sess = get_task_session(task, time);
 	if (sess == NULL && !is_kernel_address(addr))
 		return false;
 
-	sym = find_symtabs(&sess->symtabs, addr);
-	if (sym == NULL)
-		sym = session_find_dlsym(sess, time, addr);
+	sym = session_find_sym(sess, time, addr);
 
 	fstack = &task->func_stack[task->stack_count];
 
@@ -140,11 +395,15 @@ static bool fill_entry(struct trace_entry *te, struct ftrace_task_handle *task,
 	te->time_total = fstack->total_time;
 	te->time_self  = te->time_total - fstack->child_time;
 	te->nr_called  = 1;
+	te->timestamp  = time;
+	te->hist       = NULL;
 
 	/* some LOST entries make invalid self tiem */
 	if (te->time_self > te->time_total)
 		te->time_self = te->time_total;
 
+	set_entry_time(te);
+
 	te->time_recursive = 0;
 	for (i = 0; i < task->stack_count; i++) {
 		if (addr == task->func_stack[i].addr) {
@@ -156,6 +415,29 @@ static bool fill_entry(struct trace_entry *te, struct ftrace_task_handle *task,
 	return true;
 }
 
+static int follow_report(struct ftrace_file_handle *handle,
+			 struct rb_root *root, struct opts *opts, bool thread);
+static void print_interval_report(struct rb_root *root, struct opts *opts);
+
+/* print the entries of the last interval if the time is in a new one */
+static void check_report_interval(struct rb_root *root, uint64_t time,
+				  struct opts *opts)
+{
+	uint64_t start;
+
+	if (interval_base == 0)
+		interval_base = time;
+
+	/* functions are accounted when they return */
+	if (time < interval_base + interval_start + report_interval)
+		return;
+
+	start = (time - interval_base) / report_interval * report_interval;
+
+	print_interval_report(root, opts);
+	interval_start = start;
+}
+
 static void build_function_tree(struct ftrace_file_handle *handle,
 				struct rb_root *root, struct opts *opts)
 {
@@ -165,12 +447,25 @@ static void build_function_tree(struct ftrace_file_handle *handle,
 	struct fstack *fstack;
 	int i;
 
-	while (read_rstack(handle, &task) >= 0 && !uftrace_done) {
+	/* entries in the table belong to the previous tree (for diff) */
+	memset(entry_table, 0, entry_table_size * sizeof(*entry_table));
+
+	while (!uftrace_done) {
+		if (read_rstack(handle, &task) < 0) {
+			if (follow_report(handle, root, opts, false) == 0)
+				continue;
+			break;
+		}
+
 		rstack = task->rstack;
 
-		if (rstack->type != FTRACE_LOST)
+		if (rstack->type != FTRACE_LOST) {
 			task->timestamp_last = rstack->time;
 
+			if (report_interval)
+				check_report_interval(root, rstack->time, opts);
+		}
+
 		if (!fstack_check_filter(task))
 			continue;
 
@@ -186,7 +481,7 @@ static void build_function_tree(struct ftrace_file_handle *handle,
 				    !(fstack->flags & FSTACK_FL_NORECORD) &&
 				    fill_entry(&te, task, task->timestamp_last,
 					       fstack->addr, opts)) {
-					insert_entry(root, &te, false);
+					add_report_entry(task, root, &te);
 				}
 
 				fstack_exit(task);
@@ -197,7 +492,7 @@ static void build_function_tree(struct ftrace_file_handle *handle,
 
 		/* rstack->type == FTRACE_EXIT */
 		if (fill_entry(&te, task, rstack->time, rstack->addr, opts))
-			insert_entry(root, &te, false);
+			add_report_entry(task, root, &te);
 	}
 
 	if (uftrace_done)
@@ -212,6 +507,10 @@ static void build_function_tree(struct ftrace_file_handle *handle,
 		if (task->stack_count == 0)
 			continue;
 
+		/* they will return in the next time slice */
+		if (task->stop_offset)
+			continue;
+
 		last_time = task->rstack->time;
 
 		if (handle->time_range.stop)
@@ -234,9 +533,264 @@ static void build_function_tree(struct ftrace_file_handle *handle,
 				fstack[-1].child_time += fstack->total_time;
 
 			if (fill_entry(&te, task, last_time, fstack->addr, opts))
-				insert_entry(root, &te, false);
+				add_report_entry(task, root, &te);
+		}
+	}
+}
+
+/*
+ * function (or thread) entry sent from a worker process of a time slice
+ * or saved in the report cache, followed by hist_nr bucket counts of
+ * the histogram (if any).
+ */
+struct slice_entry {
+	int pid;
+	unsigned hist_nr;
+	uint64_t addr;
+	uint64_t timestamp;
+	uint64_t time_total;
+	uint64_t time_self;
+	uint64_t time_recursive;
+	uint64_t time_min;
+	uint64_t time_max;
+	uint64_t nr_called;
+	uint64_t hist_min;
+	uint64_t hist_max;
+	unsigned hist_start;
+	unsigned unused;
+};
+
+static int send_slice_entry(int fd, struct trace_entry *entry, bool thread)
+{
+	struct slice_entry se = {};
+
+	se.pid            = entry->pid;
+	se.addr           = entry->addr;
+	/* thread entry has the start function of the thread */
+	if (thread && entry->sym)
+		se.addr       = entry->sym->addr;
+	se.timestamp      = entry->timestamp;
+	se.time_total     = entry->time_total;
+	se.time_self      = entry->time_self;
+	se.time_recursive = entry->time_recursive;
+	se.time_min       = entry->time_min;
+	se.time_max       = entry->time_max;
+	se.nr_called      = entry->nr_called;
+
+	if (entry->hist) {
+		se.hist_start = entry->hist->start;
+		se.hist_nr    = entry->hist->nr;
+		se.hist_min   = entry->hist->min;
+		se.hist_max   = entry->hist->max;
+	}
+
+	if (write_all(fd, &se, sizeof(se)) < 0)
+		return -1;
+
+	if (se.hist_nr && write_all(fd, entry->hist->counts,
+				    se.hist_nr * sizeof(uint64_t)) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int send_slice_entries(int fd, struct rb_root *root, bool thread)
+{
+	struct rb_node *node;
+	struct trace_entry *entry;
+
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		entry = rb_entry(node, struct trace_entry, link);
+
+		if (send_slice_entry(fd, entry, thread) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* read the rest of a slice entry and set @te except the symbol */
+static int recv_slice_entry(int fd, struct slice_entry *se,
+			    struct trace_entry *te, struct uftrace_hist *hist)
+{
+	unsigned i;
+
+	te->hist = NULL;
+	if (se->hist_nr) {
+		hist->counts = xrealloc(hist->counts,
+					se->hist_nr * sizeof(*hist->counts));
+		if (read_all(fd, hist->counts,
+			     se->hist_nr * sizeof(*hist->counts)) < 0)
+			return -1;
+
+		hist->start = se->hist_start;
+		hist->nr    = se->hist_nr;
+		hist->min   = se->hist_min;
+		hist->max   = se->hist_max;
+		hist->total = 0;
+		for (i = 0; i < hist->nr; i++)
+			hist->total += hist->counts[i];
+
+		te->hist = hist;
+	}
+
+	te->pid            = se->pid;
+	te->sym            = NULL;
+	te->addr           = se->addr;
+	te->timestamp      = se->timestamp;
+	te->time_total     = se->time_total;
+	te->time_self      = se->time_self;
+	te->time_recursive = se->time_recursive;
+	te->time_min       = se->time_min;
+	te->time_max       = se->time_max;
+	te->nr_called      = se->nr_called;
+
+	return 0;
+}
+
+/*
+ * read the next record: returns 0 if it's read, 1 at the end of file
+ * and -1 if only a part of it is read (or on error).
+ */
+static int read_next(int fd, void *buf, size_t size)
+{
+	ssize_t ret;
+
+	do {
+		ret = read(fd, buf, size);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0)
+		return 1;
+	if (ret < 0)
+		return -1;
+	if ((size_t)ret == size)
+		return 0;
+
+	return read_all(fd, buf + ret, size - ret);
+}
+
+/* returns the number of entries received or -1 if it's broken */
+static int recv_slice_entries(struct ftrace_file_handle *handle, int fd,
+			      struct rb_root *root, bool thread)
+{
+	int ret;
+	int nr = 0;
+
+	struct slice_entry se;
+	struct trace_entry te;
+	struct ftrace_task_handle *task;
+	struct ftrace_session *sess;
+	struct uftrace_hist hist = {};
+
+	/* symbols are not shared so find them again */
+	while ((ret = read_next(fd, &se, sizeof(se))) == 0) {
+		if (recv_slice_entry(fd, &se, &te, &hist) < 0) {
+			ret = -1;
+			break;
+		}
+		nr++;
+
+		task = get_task_handle(handle, se.pid);
+		if (task == NULL)
+			continue;
+
+		sess = get_task_session(task, se.timestamp);
+		if (sess || is_kernel_address(se.addr))
+			te.sym = session_find_sym(sess, se.timestamp, se.addr);
+
+		if (thread)
+			insert_entry(root, &te, true);
+		else
+			add_function_entry(root, &te);
+	}
+
+	free(hist.counts);
+	return ret < 0 ? -1 : nr;
+}
+
+/*
+ * Split the data into time slices and build the function tree of each
+ * slice in a separate process.  The processes start from the checkpoints
+ * in the function index and send the result back to be merged.
+ */
+static int build_function_tree_jobs(struct ftrace_file_handle *handle,
+				    struct rb_root *root, struct opts *opts)
+{
+	uint64_t *bounds;
+	pid_t *pids;
+	int *fds;
+	int nr_jobs;
+	int status;
+	int i;
+
+	/* filters depend on the state before the checkpoints */
+	if (opts->filter || opts->trigger || opts->threshold ||
+	    handle->time_range.start || handle->time_range.stop)
+		return -1;
+
+	if (fstack_setup_checkpoints(handle) < 0)
+		return -1;
+
+	bounds = xcalloc(opts->nr_jobs + 1, sizeof(*bounds));
+	nr_jobs = fstack_split_time(handle, opts->nr_jobs, bounds);
+	if (nr_jobs < 2) {
+		free(bounds);
+		return -1;
+	}
+
+	pr_dbg("build function tree using %d jobs\n", nr_jobs);
+
+	pids = xcalloc(nr_jobs, sizeof(*pids));
+	fds = xcalloc(nr_jobs, sizeof(*fds));
+
+	/* do not duplicate pending output in the workers */
+	fflush(NULL);
+
+	for (i = 0; i < nr_jobs; i++) {
+		int pfd[2];
+
+		if (pipe(pfd) < 0)
+			pr_err("cannot create report pipe");
+
+		pids[i] = fork();
+		if (pids[i] < 0)
+			pr_err("cannot fork report job");
+
+		if (pids[i] == 0) {
+			struct rb_root tree = RB_ROOT;
+
+			close(pfd[0]);
+
+			fstack_set_time_slice(handle, bounds[i], bounds[i + 1]);
+			build_function_tree(handle, &tree, opts);
+			if (send_slice_entries(pfd[1], &tree, false) < 0)
+				pr_err("write to report pipe failed");
+
+			close(pfd[1]);
+			_exit(0);
 		}
+
+		close(pfd[1]);
+		fds[i] = pfd[0];
+	}
+
+	/* entries in the table belong to the previous tree (for diff) */
+	memset(entry_table, 0, entry_table_size * sizeof(*entry_table));
+
+	for (i = 0; i < nr_jobs; i++) {
+		if (recv_slice_entries(handle, fds[i], root, false) < 0)
+			pr_err("read from report pipe failed");
+		close(fds[i]);
+
+		waitpid(pids[i], &status, 0);
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			pr_err_ns("report job %d failed\n", i);
 	}
+
+	free(fds);
+	free(pids);
+	free(bounds);
+	return 0;
 }
 
 struct sort_item {
@@ -244,6 +798,7 @@ struct sort_item {
 	int (*cmp)(struct trace_entry *a, struct trace_entry *b);
 	int avg_mode;
 	struct list_head list;
+	int pct_idx;	/* index of percentile if cmp is NULL */
 };
 
 #define SORT_ITEM_BASE(_name, _field, _mode)				\
@@ -374,216 +929,1135 @@ struct sort_item *diff_sort_items[] = {
 static LIST_HEAD(sort_list);
 static LIST_HEAD(diff_sort_list);
 
-static int cmp_entry(struct trace_entry *a, struct trace_entry *b)
+static int cmp_percentile(struct trace_entry *a, struct trace_entry *b, int idx)
+{
+	if (a->time_pct[idx] == b->time_pct[idx])
+		return 0;
+	return a->time_pct[idx] > b->time_pct[idx] ? 1 : -1;
+}
+
+static int cmp_entry(struct trace_entry *a, struct trace_entry *b)
+{
+	int ret;
+	struct sort_item *item;
+
+	list_for_each_entry(item, &sort_list, list) {
+		if (item->cmp)
+			ret = item->cmp(a, b);
+		else
+			ret = cmp_percentile(a, b, item->pct_idx);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int cmp_diff_entry(struct trace_entry *a, struct trace_entry *b,
+			  int sort_column)
+{
+	int ret;
+	struct sort_item *item;
+	struct list_head *sort_list_head = &sort_list;
+	struct trace_entry *entry_a = a;
+	struct trace_entry *entry_b = b;
+
+	switch (sort_column) {
+	case 0:
+		sort_list_head = &sort_list;
+		entry_a = a;
+		entry_b = b;
+		break;
+	case 1:
+		sort_list_head = &sort_list;
+		entry_a = a->pair;
+		entry_b = b->pair;
+		break;
+	case 2:
+		sort_list_head = &diff_sort_list;
+		entry_a = a;
+		entry_b = b;
+		break;
+	default:
+		/* this should not happend */
+		assert(0);
+		break;
+	}
+
+	list_for_each_entry(item, sort_list_head, list) {
+		ret = item->cmp(entry_a, entry_b);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static void sort_entries(struct rb_root *root, struct trace_entry *te)
+{
+	struct trace_entry *entry;
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &root->rb_node;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct trace_entry, link);
+
+		if (cmp_entry(entry, te) < 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&te->link, parent, p);
+	rb_insert_color(&te->link, root);
+}
+
+static void sort_diff_entries(struct rb_root *root, struct trace_entry *te,
+			      int sort_column)
+{
+	struct trace_entry *entry;
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &root->rb_node;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct trace_entry, link);
+
+		if (cmp_diff_entry(entry, te, sort_column) < 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&te->link, parent, p);
+	rb_insert_color(&te->link, root);
+}
+
+static int add_percentile(double pct)
+{
+	int i;
+
+	if (pct < 0 || pct > 100) {
+		pr_out("uftrace: invalid percentile: %g\n", pct);
+		exit(1);
+	}
+
+	for (i = 0; i < nr_percentiles; i++) {
+		if (percentiles[i] == pct)
+			return i;
+	}
+
+	percentiles = xrealloc(percentiles, (i + 1) * sizeof(*percentiles));
+	percentiles[i] = pct;
+	nr_percentiles++;
+
+	return i;
+}
+
+static void setup_percentiles(char *pct_str)
+{
+	char *str = xstrdup(pct_str);
+	char *k, *end, *p = str;
+
+	while ((k = strtok(p, ",;")) != NULL) {
+		double pct = strtod(k, &end);
+
+		if (end == k || *end) {
+			pr_out("uftrace: invalid percentile: %s\n", k);
+			exit(1);
+		}
+
+		add_percentile(pct);
+		p = NULL;
+	}
+	free(str);
+}
+
+/* sort key 'pNN' sorts by NNth percentile and shows it too */
+static bool setup_sort_percentile(char *key, struct opts *opts)
+{
+	struct sort_item *item;
+	char *end;
+	double pct;
+
+	if (key[0] != 'p' || !isdigit(key[1]))
+		return false;
+
+	pct = strtod(key + 1, &end);
+	if (*end)
+		return false;
+
+	if (opts->diff || opts->report_thread) {
+		pr_out("uftrace: '%s' sort key cannot be used with %s.\n",
+		       key, opts->diff ? "--diff" : "--threads");
+		exit(1);
+	}
+
+	item = xzalloc(sizeof(*item));
+	item->name = xstrdup(key);
+	item->pct_idx = add_percentile(pct);
+
+	list_add_tail(&item->list, &sort_list);
+	return true;
+}
+
+static void setup_sort(char *sort_keys, struct opts *opts)
+{
+	char *keys = xstrdup(sort_keys);
+	char *k, *p = keys;
+	unsigned i;
+
+	while ((k = strtok(p, ",")) != NULL) {
+		p = NULL;
+
+		if (setup_sort_percentile(k, opts))
+			continue;
+
+		for (i = 0; i < ARRAY_SIZE(all_sort_items); i++) {
+			if (strcmp(k, all_sort_items[i]->name))
+				continue;
+
+			if (all_sort_items[i]->avg_mode != (avg_mode != AVG_NONE)) {
+				pr_out("uftrace: '%s' sort key %s be used with %s or %s.\n",
+				       all_sort_items[i]->name,
+				       avg_mode == AVG_NONE ? "should" : "cannot",
+				       "--avg-total", "--avg-self");
+				exit(1);
+			}
+
+			list_add_tail(&all_sort_items[i]->list, &sort_list);
+			list_add_tail(&diff_sort_items[i]->list, &diff_sort_list);
+			break;
+		}
+
+		if (i == ARRAY_SIZE(all_sort_items)) {
+			pr_out("uftrace: Unknown sort key '%s'\n", k);
+			pr_out("uftrace:   Possible keys:");
+			for (i = 0; i < ARRAY_SIZE(all_sort_items); i++)
+				pr_out(" %s", all_sort_items[i]->name);
+			pr_out(" pNN\n");
+			exit(1);
+		}
+	}
+	free(keys);
+}
+
+static void print_and_delete(struct rb_root *root,
+			     void (*print_func)(struct trace_entry *))
+{
+	while (!RB_EMPTY_ROOT(root)) {
+		struct rb_node *node;
+		struct trace_entry *entry;
+
+		node = rb_first(root);
+		rb_erase(node, root);
+
+		entry = rb_entry(node, struct trace_entry, link);
+		if (print_func)
+			print_func(entry);
+
+		if (entry->pair)
+			free(entry->pair);
+		if (entry->hist) {
+			hist_free(entry->hist);
+			free(entry->hist);
+		}
+		free(entry->time_pct);
+		free(entry);
+	}
+}
+
+static void print_entry_time(struct trace_entry *entry)
+{
+	int i;
+
+	if (avg_mode == AVG_NONE) {
+		pr_out("  ");
+		print_time_unit(entry->time_total - entry->time_recursive);
+		pr_out("  ");
+		print_time_unit(entry->time_self);
+		pr_out("  %10lu", entry->nr_called);
+	} else {
+		pr_out("  ");
+		print_time_unit(entry->time_avg);
+		pr_out("  ");
+		print_time_unit(entry->time_min);
+		pr_out("  ");
+		print_time_unit(entry->time_max);
+	}
+
+	for (i = 0; i < nr_percentiles; i++) {
+		pr_out("  ");
+		print_time_unit(entry->time_pct[i]);
+	}
+}
+
+static void print_function(struct trace_entry *entry)
+{
+	char *symname = symbol_getname(entry->sym, entry->addr);
+
+	if (report_interval)
+		pr_out("  %10.6f", (double)interval_start / NSEC_PER_SEC);
+
+	print_entry_time(entry);
+	pr_out("  %-s\n", symname);
+
+	symbol_putname(entry->sym, symname);
+}
+
+static void print_function_header(const char *title)
+{
+	const char line[] = "====================================";
+	const char *cols[][3] = {
+		[AVG_NONE]  = { "Total time", "Self time", "Calls" },
+		[AVG_TOTAL] = { "Avg total", "Min total", "Max total" },
+		[AVG_SELF]  = { "Avg self", "Min self", "Max self" },
+	};
+	char name[16];
+	int i;
+
+	if (report_interval)
+		pr_out("  %10.10s", "Time (s)");
+
+	pr_out("  %10.10s  %10.10s  %10.10s", cols[avg_mode][0],
+	       cols[avg_mode][1], cols[avg_mode][2]);
+	for (i = 0; i < nr_percentiles; i++) {
+		snprintf(name, sizeof(name), "p%g", percentiles[i]);
+		pr_out("  %10.10s", name);
+	}
+	pr_out("  %-s\n", title);
+
+	if (report_interval)
+		pr_out("  %10.10s", line);
+
+	pr_out("  %10.10s  %10.10s  %10.10s", line, line, line);
+	for (i = 0; i < nr_percentiles; i++)
+		pr_out("  %10.10s", line);
+	pr_out("  %-s\n", line);
+}
+
+#define HIST_BAR_WIDTH  40
+
+/* print the histogram in power of 2 ranges */
+static void print_histogram(struct trace_entry *entry)
+{
+	char *symname = symbol_getname(entry->sym, entry->addr);
+	struct uftrace_hist *hist = entry->hist;
+	const char bar[] = "########################################";
+	uint64_t counts[65] = {};
+	uint64_t max_count = 0;
+	int first = -1, last = -1;
+	unsigned i;
+	int k;
+
+	for (i = 0; i < hist->nr; i++) {
+		uint64_t start = hist_bucket_start(hist->start + i);
+
+		/* range k has [2^(k-1), 2^k) and range 0 has zero */
+		k = start ? 64 - __builtin_clzll(start) : 0;
+		counts[k] += hist->counts[i];
+	}
+
+	for (k = 0; k < 65; k++) {
+		if (counts[k] == 0)
+			continue;
+
+		if (first < 0)
+			first = k;
+		last = k;
+
+		if (max_count < counts[k])
+			max_count = counts[k];
+	}
+
+	pr_out("\n  %s time histogram of %s (%"PRIu64" calls)\n",
+	       avg_mode == AVG_SELF ? "Self" : "Total", symname, hist->total);
+
+	for (k = first; k >= 0 && k <= last; k++) {
+		int len = counts[k] * HIST_BAR_WIDTH / max_count;
+
+		pr_out("  ");
+		print_time_unit(k ? 1ULL << (k - 1) : 0);
+		pr_out(" - ");
+		print_time_unit(1ULL << k);
+		pr_out("  %10"PRIu64" |%-*.*s|\n", counts[k],
+		       HIST_BAR_WIDTH, len, bar);
+	}
+
+	symbol_putname(entry->sym, symname);
+}
+
+/*
+ * Aggregated entries are saved in the data directory so that later
+ * reports with other sort keys or output options don't need to read
+ * the whole data again.  The cache has a key of the options affecting
+ * the aggregation and a signature of the data files to check whether
+ * it's still valid.  It's followed by the entries in slice_entry.
+ */
+#define REPORT_CACHE_MAGIC  "Rcache2"
+
+struct report_cache_header {
+	char magic[8];
+	uint64_t data_sig;	/* to check the data was changed */
+	uint32_t key_len;	/* length of the key string following */
+	uint32_t nr_entries;	/* to check the cache is complete */
+};
+
+struct report_cache {
+	const char *dirname;
+	const char *name;
+	char *key;
+	uint64_t data_sig;
+};
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+	size_t len = strlen(name);
+	size_t slen = strlen(suffix);
+
+	return len > slen && !strcmp(name + len - slen, suffix);
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	/* FNV-1a */
+	while (len--) {
+		hash ^= *p++;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* combine name, size and mtime of the data files */
+static uint64_t report_data_signature(const char *dirname)
+{
+	DIR *dp;
+	struct dirent *ent;
+	struct stat st;
+	char *filename;
+	uint64_t sig = 0;
+
+	dp = opendir(dirname);
+	if (dp == NULL)
+		return 0;
+
+	while ((ent = readdir(dp)) != NULL) {
+		uint64_t hash = 14695981039346656037ULL;
+		uint64_t vals[3];
+
+		/* skip files written by analysis commands */
+		if (ent->d_name[0] == '.' || has_suffix(ent->d_name, ".fidx") ||
+		    has_suffix(ent->d_name, ".cache"))
+			continue;
+
+		xasprintf(&filename, "%s/%s", dirname, ent->d_name);
+		if (stat(filename, &st) < 0 || !S_ISREG(st.st_mode)) {
+			free(filename);
+			continue;
+		}
+		free(filename);
+
+		vals[0] = st.st_size;
+		vals[1] = st.st_mtim.tv_sec;
+		vals[2] = st.st_mtim.tv_nsec;
+
+		hash = hash_bytes(hash, ent->d_name, strlen(ent->d_name));
+		hash = hash_bytes(hash, vals, sizeof(vals));
+
+		/* the order of files is not fixed */
+		sig += hash;
+	}
+	closedir(dp);
+
+	return sig;
+}
+
+static void setup_report_cache(struct report_cache *rc,
+			       struct ftrace_file_handle *handle,
+			       struct opts *opts, bool thread)
+{
+	rc->dirname = handle->dirname;
+	rc->name = thread ? "report-thread.cache" : "report-func.cache";
+	rc->data_sig = report_data_signature(handle->dirname);
+
+	xasprintf(&rc->key, "%s avg=%d hist=%d filter=%s trigger=%s tid=%s "
+		  "depth=%d threshold=%"PRIu64" range=%"PRIu64"~%"PRIu64" "
+		  "disabled=%d kernel=%d kernel_only=%d kernel_skip_out=%d "
+		  "max_stack=%d", thread ? "thread" : "function",
+		  avg_mode, use_hist, opts->filter ?: "", opts->trigger ?: "",
+		  opts->tid ?: "", opts->depth, opts->threshold,
+		  handle->time_range.start, handle->time_range.stop,
+		  opts->disabled, handle->kern != NULL, opts->kernel_only,
+		  opts->kernel_skip_out, opts->max_stack);
+}
+
+static int load_report_cache(struct report_cache *rc,
+			     struct ftrace_file_handle *handle,
+			     struct rb_root *root, bool thread)
+{
+	struct report_cache_header hdr;
+	char *filename;
+	char *key = NULL;
+	int ret = -1;
+	int fd;
+
+	xasprintf(&filename, "%s/%s", rc->dirname, rc->name);
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		goto out;
+
+	if (read_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    memcmp(hdr.magic, REPORT_CACHE_MAGIC, sizeof(hdr.magic)) ||
+	    hdr.data_sig != rc->data_sig || hdr.key_len != strlen(rc->key))
+		goto out;
+
+	key = xmalloc(hdr.key_len);
+	if (read_all(fd, key, hdr.key_len) < 0 ||
+	    memcmp(key, rc->key, hdr.key_len))
+		goto out;
+
+	/* entries in the table belong to the previous tree (for diff) */
+	memset(entry_table, 0, entry_table_size * sizeof(*entry_table));
+
+	if (recv_slice_entries(handle, fd, root, thread) != (int)hdr.nr_entries) {
+		pr_dbg("broken report cache: %s\n", filename);
+		print_and_delete(root, NULL);
+		goto out;
+	}
+
+	pr_dbg("use report cache: %s\n", filename);
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(key);
+	free(filename);
+	return ret;
+}
+
+static void save_report_cache(struct report_cache *rc, struct rb_root *root,
+			      bool thread)
+{
+	struct report_cache_header hdr = {
+		.magic    = REPORT_CACHE_MAGIC,
+		.data_sig = rc->data_sig,
+		.key_len  = strlen(rc->key),
+	};
+	struct rb_node *node;
+	char *filename;
+	char *tmpname;
+	int fd;
+
+	/* do not leave a file in a read-only data directory */
+	if (access(rc->dirname, W_OK) < 0)
+		return;
+
+	for (node = rb_first(root); node; node = rb_next(node))
+		hdr.nr_entries++;
+
+	xasprintf(&filename, "%s/%s", rc->dirname, rc->name);
+	/* write to a hidden file and rename it to replace the old one */
+	xasprintf(&tmpname, "%s/.%s", rc->dirname, rc->name);
+
+	/* it's ok to fail, it'll be built again next time */
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_dbg("cannot create report cache: %s: %m\n", tmpname);
+		goto out;
+	}
+
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_all(fd, rc->key, hdr.key_len) < 0 ||
+	    send_slice_entries(fd, root, thread) < 0) {
+		pr_dbg("cannot write report cache: %s: %m\n", tmpname);
+		close(fd);
+		unlink(tmpname);
+		goto out;
+	}
+	close(fd);
+
+	if (rename(tmpname, filename) < 0) {
+		pr_dbg("cannot rename report cache: %s: %m\n", filename);
+		unlink(tmpname);
+	}
+
+out:
+	free(tmpname);
+	free(filename);
+}
+
+static void setup_report_kernel(struct opts *opts,
+				struct ftrace_file_handle *handle,
+				struct ftrace_kernel *kern)
+{
+	/* kernel data is not followed */
+	if (opts->kernel && (handle->hdr.feat_mask & KERNEL) && !handle->follow) {
+		kern->output_dir = opts->dirname;
+		kern->skip_out = opts->kernel_skip_out;
+		if (setup_kernel_data(kern) == 0) {
+			handle->kern = kern;
+			load_kernel_symbol(opts->dirname);
+		}
+	}
+}
+
+static void build_thread_tree(struct ftrace_file_handle *handle,
+			      struct rb_root *root, struct opts *opts);
+
+/* build the tree of function (or thread) entries using the cache */
+static void build_report_tree(struct ftrace_file_handle *handle,
+			      struct rb_root *root, struct opts *opts,
+			      bool thread)
+{
+	struct report_cache rc = {};
+
+	/* the data is not complete, and the time slices are unknown */
+	if (handle->follow) {
+		if (thread)
+			build_thread_tree(handle, root, opts);
+		else
+			build_function_tree(handle, root, opts);
+		return;
+	}
+
+	if (!opts->no_cache) {
+		setup_report_cache(&rc, handle, opts, thread);
+
+		if (load_report_cache(&rc, handle, root, thread) == 0)
+			goto out;
+	}
+
+	if (thread)
+		build_thread_tree(handle, root, opts);
+	else if (opts->nr_jobs < 2 ||
+		 build_function_tree_jobs(handle, root, opts) < 0)
+		build_function_tree(handle, root, opts);
+
+	/* do not save partial result */
+	if (!opts->no_cache && !uftrace_done)
+		save_report_cache(&rc, root, thread);
+
+out:
+	free(rc.key);
+}
+
+/* set average and percentile time before sorting */
+static void set_entry_stat(struct trace_entry *entry)
+{
+	int i;
+
+	if (avg_mode == AVG_TOTAL)
+		entry->time_avg = entry->time_total / entry->nr_called;
+	else if (avg_mode == AVG_SELF)
+		entry->time_avg = entry->time_self / entry->nr_called;
+
+	if (nr_percentiles == 0)
+		return;
+
+	entry->time_pct = xcalloc(nr_percentiles, sizeof(*entry->time_pct));
+	for (i = 0; i < nr_percentiles; i++)
+		entry->time_pct[i] = hist_percentile(entry->hist, percentiles[i]);
+}
+
+static void print_function_report(struct rb_root *name_tree,
+				  struct opts *opts)
+{
+	struct rb_root sort_tree = RB_ROOT;
+	struct rb_node *node;
+
+	while (!RB_EMPTY_ROOT(name_tree) && !uftrace_done) {
+		struct rb_node *node;
+		struct trace_entry *entry;
+
+		node = rb_first(name_tree);
+		rb_erase(node, name_tree);
+
+		entry = rb_entry(node, struct trace_entry, link);
+		set_entry_stat(entry);
+		sort_entries(&sort_tree, entry);
+	}
+
+	if (uftrace_done)
+		return;
+
+	print_function_header("Function");
+
+	if (!opts->histogram) {
+		print_and_delete(&sort_tree, print_function);
+		return;
+	}
+
+	for (node = rb_first(&sort_tree); node; node = rb_next(node))
+		print_function(rb_entry(node, struct trace_entry, link));
+
+	print_and_delete(&sort_tree, print_histogram);
+}
+
+static void report_functions(struct ftrace_file_handle *handle, struct opts *opts)
+{
+	struct rb_root name_tree = RB_ROOT;
+
+	build_report_tree(handle, &name_tree, opts, false);
+	print_function_report(&name_tree, opts);
+}
+
+/*
+ * Functions in different data (i.e. from many hosts) are matched by
+ * name.  Each name gets a symbol with a unique id so that the entries
+ * can be merged in the usual way.
+ */
+struct merge_sym {
+	struct rb_node node;
+	struct sym sym;
+};
+
+static struct rb_root merge_syms = RB_ROOT;
+static unsigned nr_merge_syms;
+
+/* it takes the ownership of @name */
+static struct sym *get_merge_sym(char *name)
+{
+	struct merge_sym *ms;
+	struct rb_node *parent = NULL;
+	struct rb_node **p = &merge_syms.rb_node;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		ms = rb_entry(parent, struct merge_sym, node);
+
+		cmp = strcmp(name, ms->sym.name);
+		if (cmp == 0) {
+			free(name);
+			return &ms->sym;
+		}
+
+		if (cmp < 0)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	ms = xzalloc(sizeof(*ms));
+	ms->sym.name = name;
+	ms->sym.id = ++nr_merge_syms;
+
+	rb_link_node(&ms->node, parent, p);
+	rb_insert_color(&ms->node, &merge_syms);
+
+	return &ms->sym;
+}
+
+/*
+ * Unknown functions are identified by the build-id (of the executable)
+ * or the library name, and the offset in the binary since the load
+ * address can be different.
+ */
+static char *get_merge_name(struct ftrace_file_handle *handle,
+			    struct trace_entry *entry)
+{
+	struct ftrace_task_handle *task;
+	struct ftrace_session *sess = NULL;
+	struct ftrace_proc_maps *map = NULL;
+	char build_id[sizeof(handle->info.build_id) * 2 + 1];
+	char *libname;
+	char *name;
+	int i;
+
+	if (entry->sym)
+		return xstrdup(entry->sym->name);
+
+	task = get_task_handle(handle, entry->pid);
+	if (task)
+		sess = get_task_session(task, entry->timestamp);
+	if (sess)
+		map = sess->symtabs.maps;
+
+	while (map) {
+		if (map->start <= entry->addr && entry->addr < map->end)
+			break;
+		map = map->next;
+	}
+
+	if (map == NULL) {
+		xasprintf(&name, "<%"PRIx64">", entry->addr);
+		return name;
+	}
+
+	if ((handle->hdr.info_mask & (1UL << EXE_BUILD_ID)) &&
+	    !strcmp(map->libname, sess->exename)) {
+		for (i = 0; i < (int)sizeof(handle->info.build_id); i++)
+			sprintf(&build_id[i * 2], "%02x", handle->info.build_id[i]);
+		libname = build_id;
+	}
+	else {
+		libname = strrchr(map->libname, '/');
+		libname = libname ? libname + 1 : map->libname;
+	}
+
+	xasprintf(&name, "<%s+%#"PRIx64">", libname, entry->addr - map->start);
+	return name;
+}
+
+/* send function entries with their names instead of addresses */
+static int send_merge_entries(struct ftrace_file_handle *handle, int fd,
+			      struct rb_root *root)
+{
+	struct rb_node *node;
+	struct trace_entry *entry;
+	char *name;
+	unsigned len;
+	int ret = 0;
+
+	for (node = rb_first(root); node && ret == 0; node = rb_next(node)) {
+		entry = rb_entry(node, struct trace_entry, link);
+
+		name = get_merge_name(handle, entry);
+		len = strlen(name);
+
+		if (write_all(fd, &len, sizeof(len)) < 0 ||
+		    write_all(fd, name, len) < 0 ||
+		    send_slice_entry(fd, entry, false) < 0)
+			ret = -1;
+
+		free(name);
+	}
+	return ret;
+}
+
+static int recv_merge_entries(int fd, struct rb_root *root)
 {
+	struct slice_entry se;
+	struct trace_entry te;
+	struct uftrace_hist hist = {};
+	char *name;
+	unsigned len;
 	int ret;
-	struct sort_item *item;
 
-	list_for_each_entry(item, &sort_list, list) {
-		ret = item->cmp(a, b);
-		if (ret)
-			return ret;
+	while ((ret = read_next(fd, &len, sizeof(len))) == 0) {
+		name = xmalloc(len + 1);
+		if (read_all(fd, name, len) < 0 ||
+		    read_all(fd, &se, sizeof(se)) < 0 ||
+		    recv_slice_entry(fd, &se, &te, &hist) < 0) {
+			free(name);
+			ret = -1;
+			break;
+		}
+		name[len] = '\0';
+
+		te.sym = get_merge_sym(name);
+		insert_entry(root, &te, false);
 	}
-	return 0;
+
+	free(hist.counts);
+	return ret < 0 ? -1 : 0;
 }
 
-static int cmp_diff_entry(struct trace_entry *a, struct trace_entry *b,
-			  int sort_column)
+/* build the function tree of a data directory in a worker process */
+static int merge_worker(int fd, char *dirname, struct opts *opts)
 {
-	int ret;
-	struct sort_item *item;
-	struct list_head *sort_list_head = &sort_list;
-	struct trace_entry *entry_a = a;
-	struct trace_entry *entry_b = b;
+	struct opts worker_opts = *opts;
+	struct ftrace_file_handle handle;
+	struct ftrace_kernel kern;
+	struct rb_root tree = RB_ROOT;
+	int ret = 0;
 
-	switch (sort_column) {
-	case 0:
-		sort_list_head = &sort_list;
-		entry_a = a;
-		entry_b = b;
-		break;
-	case 1:
-		sort_list_head = &sort_list;
-		entry_a = a->pair;
-		entry_b = b->pair;
-		break;
-	case 2:
-		sort_list_head = &diff_sort_list;
-		entry_a = a;
-		entry_b = b;
-		break;
-	default:
-		/* this should not happend */
-		assert(0);
-		break;
-	}
+	worker_opts.dirname = dirname;
+	worker_opts.exename = NULL;
+	/* the jobs are used to run the workers */
+	worker_opts.nr_jobs = 0;
 
-	list_for_each_entry(item, sort_list_head, list) {
-		ret = item->cmp(entry_a, entry_b);
-		if (ret)
-			return ret;
-	}
-	return 0;
+	if (open_data_file(&worker_opts, &handle) < 0)
+		return 1;
+
+	setup_report_kernel(&worker_opts, &handle, &kern);
+	fstack_setup_filters(&worker_opts, &handle);
+
+	build_report_tree(&handle, &tree, &worker_opts, false);
+	if (send_merge_entries(&handle, fd, &tree) < 0)
+		ret = 1;
+
+	if (handle.kern)
+		finish_kernel_data(handle.kern);
+	close_data_file(&worker_opts, &handle);
+
+	return ret;
 }
 
-static void sort_entries(struct rb_root *root, struct trace_entry *te)
+struct merge_job {
+	pid_t pid;
+	int fd;
+	char *dirname;
+};
+
+static void start_merge_job(struct merge_job *job, char *dirname,
+			    struct opts *opts)
 {
-	struct trace_entry *entry;
-	struct rb_node *parent = NULL;
-	struct rb_node **p = &root->rb_node;
+	int pfd[2];
 
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct trace_entry, link);
+	if (pipe(pfd) < 0)
+		pr_err("cannot create report pipe");
 
-		if (cmp_entry(entry, te) < 0)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
+	job->dirname = dirname;
+	job->pid = fork();
+	if (job->pid < 0)
+		pr_err("cannot fork report job");
+
+	if (job->pid == 0) {
+		close(pfd[0]);
+		_exit(merge_worker(pfd[1], dirname, opts));
 	}
 
-	rb_link_node(&te->link, parent, p);
-	rb_insert_color(&te->link, root);
+	close(pfd[1]);
+	job->fd = pfd[0];
 }
 
-static void sort_diff_entries(struct rb_root *root, struct trace_entry *te,
-			      int sort_column)
+static int finish_merge_job(struct merge_job *job, struct rb_root *root)
 {
-	struct trace_entry *entry;
-	struct rb_node *parent = NULL;
-	struct rb_node **p = &root->rb_node;
+	struct rb_root tree = RB_ROOT;
+	struct rb_node *node;
+	int status;
+	int ret;
 
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct trace_entry, link);
+	/* do not merge a partial result of a failed worker */
+	ret = recv_merge_entries(job->fd, &tree);
+	close(job->fd);
 
-		if (cmp_diff_entry(entry, te, sort_column) < 0)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
+	waitpid(job->pid, &status, 0);
+	if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+		pr_warn("cannot merge data: %s\n", job->dirname);
+		print_and_delete(&tree, NULL);
+		return -1;
 	}
 
-	rb_link_node(&te->link, parent, p);
-	rb_insert_color(&te->link, root);
+	for (node = rb_first(&tree); node; node = rb_next(node))
+		insert_entry(root, rb_entry(node, struct trace_entry, link), false);
+
+	print_and_delete(&tree, NULL);
+	return 0;
 }
 
-static void setup_sort(char *sort_keys)
+/*
+ * Merge reports of the data directories given as arguments.  Sessions
+ * and symbols are global so each directory is analyzed in a separate
+ * process, and up to --jobs (or the number of cpus) of them run at the
+ * same time.  Functions are matched by name and sorted as usual.
+ */
+static int report_merge(int argc, char *argv[], struct opts *opts)
 {
-	char *keys = xstrdup(sort_keys);
-	char *k, *p = keys;
-	unsigned i;
+	struct rb_root name_tree = RB_ROOT;
+	struct merge_job *jobs;
+	struct pollfd *pfds;
+	char **dirs = &argv[opts->idx];
+	int nr_dirs = argc - opts->idx;
+	int nr_jobs = opts->nr_jobs;
+	int nr_merged = 0;
+	int running = 0;
+	int next = 0;
+	int i;
 
-	while ((k = strtok(p, ",")) != NULL) {
-		for (i = 0; i < ARRAY_SIZE(all_sort_items); i++) {
-			if (strcmp(k, all_sort_items[i]->name))
-				continue;
+	if (opts->idx == 0 || nr_dirs <= 0) {
+		pr_use("--merge needs data directories to merge\n");
+		return -1;
+	}
 
-			if (all_sort_items[i]->avg_mode != (avg_mode != AVG_NONE)) {
-				pr_out("uftrace: '%s' sort key %s be used with %s or %s.\n",
-				       all_sort_items[i]->name,
-				       avg_mode == AVG_NONE ? "should" : "cannot",
-				       "--avg-total", "--avg-self");
-				exit(1);
-			}
+	if (nr_jobs <= 0)
+		nr_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_jobs > nr_dirs)
+		nr_jobs = nr_dirs;
 
-			list_add_tail(&all_sort_items[i]->list, &sort_list);
-			list_add_tail(&diff_sort_items[i]->list, &diff_sort_list);
-			break;
+	pr_dbg("merge %d data using %d jobs\n", nr_dirs, nr_jobs);
+
+	jobs = xcalloc(nr_jobs, sizeof(*jobs));
+	pfds = xcalloc(nr_jobs, sizeof(*pfds));
+
+	/* do not duplicate pending output in the workers */
+	fflush(NULL);
+
+	while ((next < nr_dirs || running) && !uftrace_done) {
+		while (running < nr_jobs && next < nr_dirs)
+			start_merge_job(&jobs[running++], dirs[next++], opts);
+
+		for (i = 0; i < running; i++) {
+			pfds[i].fd = jobs[i].fd;
+			pfds[i].events = POLLIN;
 		}
 
-		if (i == ARRAY_SIZE(all_sort_items)) {
-			pr_out("uftrace: Unknown sort key '%s'\n", k);
-			pr_out("uftrace:   Possible keys:");
-			for (i = 0; i < ARRAY_SIZE(all_sort_items); i++)
-				pr_out(" %s", all_sort_items[i]->name);
-			pr_out("\n");
-			exit(1);
+		if (poll(pfds, running, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			pr_err("cannot wait for report jobs");
 		}
-		p = NULL;
+
+		/* workers send the result at once after analyzing the data */
+		for (i = 0; i < running; i++) {
+			if (pfds[i].revents)
+				break;
+		}
+		if (i == running)
+			continue;
+
+		if (finish_merge_job(&jobs[i], &name_tree) == 0)
+			nr_merged++;
+
+		jobs[i] = jobs[--running];
 	}
-	free(keys);
+
+	/* interrupted */
+	for (i = 0; i < running; i++) {
+		kill(jobs[i].pid, SIGTERM);
+		close(jobs[i].fd);
+		waitpid(jobs[i].pid, NULL, 0);
+	}
+
+	free(pfds);
+	free(jobs);
+
+	pr_dbg("merged %d of %d data\n", nr_merged, nr_dirs);
+
+	if (uftrace_done) {
+		print_and_delete(&name_tree, NULL);
+		return 0;
+	}
+
+	print_function_report(&name_tree, opts);
+	return nr_merged ? 0 : -1;
 }
 
-static void print_and_delete(struct rb_root *root,
-			     void (*print_func)(struct trace_entry *))
+/* print the top entries of the current interval and delete all */
+static void print_interval_report(struct rb_root *root, struct opts *opts)
 {
+	struct rb_root sort_tree = RB_ROOT;
+	struct rb_node *node;
+	int top = opts->top ?: 10;
+	int i;
+
+	/* entries in the table will be freed */
+	memset(entry_table, 0, entry_table_size * sizeof(*entry_table));
+
 	while (!RB_EMPTY_ROOT(root)) {
-		struct rb_node *node;
 		struct trace_entry *entry;
 
 		node = rb_first(root);
 		rb_erase(node, root);
 
 		entry = rb_entry(node, struct trace_entry, link);
-		print_func(entry);
+		set_entry_stat(entry);
+		sort_entries(&sort_tree, entry);
+	}
 
-		if (entry->pair)
-			free(entry->pair);
-		free(entry);
+	node = rb_first(&sort_tree);
+	for (i = 0; i < top && node && !uftrace_done; i++) {
+		print_function(rb_entry(node, struct trace_entry, link));
+		node = rb_next(node);
 	}
+
+	print_and_delete(&sort_tree, NULL);
 }
 
-static void print_function(struct trace_entry *entry)
+/*
+ * Show function statistics in each time interval to see how they change
+ * over time.  Entries are printed and freed at the end of each interval
+ * so the memory usage doesn't grow with the data size.
+ */
+static void report_intervals(struct ftrace_file_handle *handle,
+			     struct opts *opts)
 {
-	char *symname = symbol_getname(entry->sym, entry->addr);
+	struct rb_root name_tree = RB_ROOT;
 
-	if (avg_mode == AVG_NONE) {
-		pr_out("  ");
-		print_time_unit(entry->time_total - entry->time_recursive);
-		pr_out("  ");
-		print_time_unit(entry->time_self);
-		pr_out("  %10lu  %-s\n", entry->nr_called, symname);
-	} else {
-		pr_out("  ");
-		print_time_unit(entry->time_avg);
-		pr_out("  ");
-		print_time_unit(entry->time_min);
-		pr_out("  ");
-		print_time_unit(entry->time_max);
-		pr_out("  %-s\n", symname);
+	report_interval = opts->interval;
+
+	print_function_header("Function");
+	build_function_tree(handle, &name_tree, opts);
+	print_interval_report(&name_tree, opts);
+}
+
+static void print_call_path(struct call_path *path)
+{
+	int depth = path->depth;
+	struct call_path *paths[depth];
+	char *symname;
+	int i;
+
+	print_entry_time(&path->entry);
+	pr_out("  ");
+
+	for (i = depth - 1; i >= 0; i--) {
+		paths[i] = path;
+		path = path->parent;
 	}
 
-	symbol_putname(entry->sym, symname);
+	for (i = 0; i < depth; i++) {
+		struct trace_entry *entry = &paths[i]->entry;
+
+		symname = symbol_getname(entry->sym, entry->addr);
+		pr_out("%s%s", i ? " > " : "", symname);
+		symbol_putname(entry->sym, symname);
+	}
+	pr_out("\n");
 }
 
-static void report_functions(struct ftrace_file_handle *handle, struct opts *opts)
+static void report_call_paths(struct ftrace_file_handle *handle,
+			      struct opts *opts)
 {
-	struct rb_root name_tree = RB_ROOT;
 	struct rb_root sort_tree = RB_ROOT;
-	const char f_format[] = "  %10.10s  %10.10s  %10.10s  %-s\n";
-	const char line[] = "====================================";
+	struct rb_node *node;
+	struct call_path *path;
+	unsigned i;
+	int n = 0;
 
-	build_function_tree(handle, &name_tree, opts);
+	cpt.tasks = handle->tasks;
+	cpt.task_paths = xcalloc(handle->nr_tasks, sizeof(*cpt.task_paths));
+	cpt.max_stack = opts->max_stack;
 
-	while (!RB_EMPTY_ROOT(&name_tree) && !uftrace_done) {
-		struct rb_node *node;
-		struct trace_entry *entry;
+	/* paths are not sent from other processes, so no --jobs */
+	build_function_tree(handle, NULL, opts);
 
-		node = rb_first(&name_tree);
-		rb_erase(node, &name_tree);
+	for (i = 0; i < cpt.hash_size; i++) {
+		path = cpt.hash[i];
 
-		entry = rb_entry(node, struct trace_entry, link);
-		if (avg_mode == AVG_TOTAL)
-			entry->time_avg = entry->time_total / entry->nr_called;
-		else if (avg_mode == AVG_SELF)
-			entry->time_avg = entry->time_self / entry->nr_called;
+		/* it might not return yet */
+		if (path == NULL || path->entry.nr_called == 0)
+			continue;
 
-		sort_entries(&sort_tree, entry);
+		set_entry_stat(&path->entry);
+		sort_entries(&sort_tree, &path->entry);
 	}
 
-	if (uftrace_done)
-		return;
+	if (!uftrace_done) {
+		print_function_header("Call path");
 
-	if (avg_mode == AVG_NONE)
-		pr_out(f_format, "Total time", "Self time", "Calls", "Function");
-	else if (avg_mode == AVG_TOTAL)
-		pr_out(f_format, "Avg total", "Min total", "Max total", "Function");
-	else if (avg_mode == AVG_SELF)
-		pr_out(f_format, "Avg self", "Min self", "Max self", "Function");
+		for (node = rb_first(&sort_tree); node && n < opts->call_path;
+		     node = rb_next(node), n++) {
+			struct trace_entry *entry;
+
+			entry = rb_entry(node, struct trace_entry, link);
+			print_call_path(container_of(entry, struct call_path, entry));
+		}
+	}
+
+	for (i = 0; i < cpt.hash_size; i++) {
+		path = cpt.hash[i];
+		if (path == NULL)
+			continue;
 
-	pr_out(f_format, line, line, line, line);
+		if (path->entry.hist) {
+			hist_free(path->entry.hist);
+			free(path->entry.hist);
+		}
+		free(path->entry.time_pct);
+		free(path);
+	}
+	free(cpt.hash);
 
-	print_and_delete(&sort_tree, print_function);
+	for (i = 0; i < (unsigned)handle->nr_tasks; i++)
+		free(cpt.task_paths[i]);
+	free(cpt.task_paths);
+
+	memset(&cpt, 0, sizeof(cpt));
 }
 
 static struct sym * find_task_sym(struct ftrace_file_handle *handle,
@@ -592,7 +2066,7 @@ static struct sym * find_task_sym(struct ftrace_file_handle *handle,
 {
 	struct sym *sym;
 	struct ftrace_task_handle *main_task = &handle->tasks[0];
-	struct ftrace_session *sess = find_task_session(task->tid, rstack->time);
+	struct ftrace_session *sess = get_task_session(task, rstack->time);
 	struct symtabs *symtabs = &sess->symtabs;
 
 	if (task->func)
@@ -631,17 +2105,21 @@ static void print_thread(struct trace_entry *entry)
 	symbol_putname(entry->sym, symname);
 }
 
-static void report_threads(struct ftrace_file_handle *handle, struct opts *opts)
+static void build_thread_tree(struct ftrace_file_handle *handle,
+			      struct rb_root *root, struct opts *opts)
 {
 	struct trace_entry te;
 	struct ftrace_ret_stack *rstack;
-	struct rb_root name_tree = RB_ROOT;
 	struct ftrace_task_handle *task;
 	struct fstack *fstack;
-	const char t_format[] = "  %5.5s  %10.10s  %10.10s  %-s\n";
-	const char line[] = "====================================";
 
-	while (read_rstack(handle, &task) >= 0 && !uftrace_done) {
+	while (!uftrace_done) {
+		if (read_rstack(handle, &task) < 0) {
+			if (follow_report(handle, root, opts, true) == 0)
+				continue;
+			break;
+		}
+
 		rstack = task->rstack;
 		if (rstack->type == FTRACE_ENTRY && task->func)
 			continue;
@@ -674,9 +2152,17 @@ static void report_threads(struct ftrace_file_handle *handle, struct opts *opts)
 			te.time_self = te.time_total - fstack->child_time;
 			te.nr_called = 1;
 		}
+		te.timestamp = rstack->time;
+		set_entry_time(&te);
 
-		insert_entry(&name_tree, &te, true);
+		insert_entry(root, &te, true);
 	}
+}
+
+static void print_thread_report(struct rb_root *name_tree)
+{
+	const char t_format[] = "  %5.5s  %10.10s  %10.10s  %-s\n";
+	const char line[] = "====================================";
 
 	if (uftrace_done)
 		return;
@@ -684,7 +2170,61 @@ static void report_threads(struct ftrace_file_handle *handle, struct opts *opts)
 	pr_out(t_format, "TID", "Run time", "Num funcs", "Start function");
 	pr_out(t_format, line, line, line, line);
 
-	print_and_delete(&name_tree, print_thread);
+	print_and_delete(name_tree, print_thread);
+}
+
+static void report_threads(struct ftrace_file_handle *handle, struct opts *opts)
+{
+	struct rb_root name_tree = RB_ROOT;
+
+	build_report_tree(handle, &name_tree, opts, true);
+	print_thread_report(&name_tree);
+}
+
+/*
+ * When following data being recorded, print the report of the data
+ * read so far (at most once a second) and wait for new data.  The
+ * entries are copied as printing the report deletes them.
+ */
+static int follow_report(struct ftrace_file_handle *handle,
+			 struct rb_root *root, struct opts *opts, bool thread)
+{
+	static time_t last_time;
+	static unsigned long last_count;
+	struct rb_root copy = RB_ROOT;
+	struct rb_node *node;
+	unsigned long count = 0;
+	time_t now = time(NULL);
+
+	if (!handle->follow)
+		return -1;
+
+	/* the final report will be printed after the recording */
+	if (root == NULL || now == last_time)
+		return follow_data_file(handle);
+
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		struct trace_entry *entry;
+
+		entry = rb_entry(node, struct trace_entry, link);
+		insert_entry(&copy, entry, thread);
+		count += entry->nr_called + 1;
+	}
+
+	/* skip if nothing has changed */
+	if (count != last_count) {
+		if (thread)
+			print_thread_report(&copy);
+		else
+			print_function_report(&copy, opts);
+		pr_out("\n");
+
+		last_time = now;
+		last_count = count;
+	}
+	print_and_delete(&copy, NULL);
+
+	return follow_data_file(handle);
 }
 
 struct diff_data {
@@ -983,7 +2523,7 @@ static void report_diff(struct ftrace_file_handle *handle, struct opts *opts)
 	const char format[] = "  %32.32s   %32.32s   %32.32s   %-s\n";
 	const char line[] = "====================================";
 
-	build_function_tree(handle, &tmp, opts);
+	build_report_tree(handle, &tmp, opts, false);
 	sort_function_name(&tmp, &name_tree);
 
 	remaining = tmp;
@@ -991,7 +2531,7 @@ static void report_diff(struct ftrace_file_handle *handle, struct opts *opts)
 
 	open_data_file(&dummy_opts, &data.handle);
 	fstack_setup_filters(&dummy_opts, &data.handle);
-	build_function_tree(&data.handle, &tmp, &dummy_opts);
+	build_report_tree(&data.handle, &tmp, &dummy_opts, false);
 	sort_function_name(&tmp, &data.root);
 
 	calculate_diff(&name_tree, &data.root, &diff_tree, &remaining, opts->sort_column);
@@ -1039,23 +2579,35 @@ int command_report(int argc, char *argv[], struct opts *opts)
 	else if (opts->avg_self)
 		avg_mode = AVG_SELF;
 
-	ret = open_data_file(opts, &handle);
-	if (ret < 0)
+	if (opts->follow && (opts->diff || opts->call_path)) {
+		pr_use("--follow cannot be used with --diff or --call-path\n");
 		return -1;
+	}
 
-	if (opts->kernel && (handle.hdr.feat_mask & KERNEL)) {
-		kern.output_dir = opts->dirname;
-		kern.skip_out = opts->kernel_skip_out;
-		if (setup_kernel_data(&kern) == 0) {
-			handle.kern = &kern;
-			load_kernel_symbol(opts->dirname);
-		}
+	if (opts->merge && (opts->report_thread || opts->diff ||
+			    opts->call_path || opts->follow)) {
+		pr_use("--merge cannot be used with --threads, --diff, --call-path or --follow\n");
+		return -1;
 	}
 
-	fstack_setup_filters(opts, &handle);
+	if (opts->interval && (opts->report_thread || opts->diff ||
+			       opts->call_path || opts->follow || opts->merge)) {
+		pr_use("--interval cannot be used with --threads, --diff, --call-path, --follow or --merge\n");
+		return -1;
+	}
+
+	/* percentiles are only for the function report */
+	if (opts->percentile && !opts->diff && !opts->report_thread)
+		setup_percentiles(opts->percentile);
 
 	if (opts->sort_keys)
-		setup_sort(opts->sort_keys);
+		setup_sort(opts->sort_keys, opts);
+
+	use_hist = nr_percentiles || (opts->histogram && !opts->diff &&
+				      !opts->report_thread && !opts->call_path &&
+				      !opts->interval);
+	if (!use_hist)
+		opts->histogram = false;
 
 	/* default: sort by total time */
 	if (list_empty(&sort_list)) {
@@ -1069,10 +2621,24 @@ int command_report(int argc, char *argv[], struct opts *opts)
 		}
 	}
 
+	if (opts->merge)
+		return report_merge(argc, argv, opts);
+
+	ret = open_data_file(opts, &handle);
+	if (ret < 0)
+		return -1;
+
+	setup_report_kernel(opts, &handle, &kern);
+	fstack_setup_filters(opts, &handle);
+
 	if (opts->report_thread)
 		report_threads(&handle, opts);
 	else if (opts->diff)
 		report_diff(&handle, opts);
+	else if (opts->call_path)
+		report_call_paths(&handle, opts);
+	else if (opts->interval)
+		report_intervals(&handle, opts);
 	else
 		report_functions(&handle, opts);
 
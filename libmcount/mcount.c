@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <errno.h>
@@ -19,6 +20,7 @@
 #include <sys/syscall.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
 #include <gelf.h>
 #include <dlfcn.h>
 #include <link.h>
@@ -40,6 +42,7 @@ struct symtabs symtabs = {
 		 SYMTAB_FL_SKIP_NORMAL | SYMTAB_FL_SKIP_DYNAMIC,
 };
 int shmem_bufsize = SHMEM_BUFFER_SIZE;
+size_t shmem_limit = SHMEM_BUFFER_LIMIT;
 bool mcount_setup_done;
 bool mcount_finished;
 
@@ -50,12 +53,58 @@ static int pfd = -1;
 static int mcount_rstack_max = MCOUNT_RSTACK_MAX;
 static char *mcount_exename;
 
+/*
+ * The mcount_entry() and mcount_exit() have specialised versions for the
+ * features in use so that it doesn't pay for unused filters.  The FULL
+ * version handles filters, triggers, arguments and so on.  The others
+ * only deal with the depth and/or time threshold.  See mcount_setup_variant().
+ */
+#define MCOUNT_VAR_DEPTH      (1U << 0)
+#define MCOUNT_VAR_THRESHOLD  (1U << 1)
+#define MCOUNT_VAR_FULL       (1U << 2)
+
 #ifndef DISABLE_MCOUNT_FILTER
-static int mcount_depth = MCOUNT_DEFAULT_DEPTH;
 static bool mcount_enabled = true;
-static enum filter_mode mcount_filter_mode = FILTER_MODE_NONE;
 
-static struct rb_root mcount_triggers = RB_ROOT;
+/*
+ * Filter settings can be changed at runtime by 'uftrace control'.
+ * A new setting is built aside and published by changing the pointer
+ * so that readers in the function entry don't need to take a lock.
+ * Old settings are kept in the 'prev' list until the end since some
+ * threads might still use it (and rstack->pargs points to it).
+ */
+struct mcount_filter_setting {
+	struct rb_root			triggers;
+	enum filter_mode		mode;
+	int				depth;
+	uint64_t			threshold;
+	struct mcount_filter_setting	*prev;
+};
+
+static struct mcount_filter_setting mcount_initial_setting = {
+	.triggers	= RB_ROOT,
+	.mode		= FILTER_MODE_NONE,
+	.depth		= MCOUNT_DEFAULT_DEPTH,
+};
+static struct mcount_filter_setting *mcount_setting = &mcount_initial_setting;
+
+/* filter strings used to rebuild the setting */
+static char *mcount_filter_str;
+static char *mcount_trigger_str;
+static char *mcount_argument_str;
+static char *mcount_retval_str;
+
+/*
+ * The control block is checked by a separate thread so that the
+ * function entry never has to parse the symbols.  It has its own
+ * symbol tables since normal symbols might be skipped at startup.
+ */
+static struct mcount_control *mcount_ctrl;
+static unsigned mcount_ctrl_seqnum;
+static pthread_t mcount_ctrl_thread;
+static bool mcount_ctrl_running;
+static bool mcount_ctrl_stop;
+static struct symtabs mcount_ctrl_symtabs;
 #endif /* DISABLE_MCOUNT_FILTER */
 
 uint64_t mcount_gettime(void)
@@ -94,6 +143,44 @@ const char *session_name(void)
 	return session;
 }
 
+/*
+ * Messages for a new thread are not urgent so they are kept in the batch
+ * and sent together with the next message (or before exec).  A single
+ * write should be smaller than PIPE_BUF to be written atomically.
+ */
+#define MSG_BATCH_SIZE  2048
+
+static char msg_batch[MSG_BATCH_SIZE];
+static size_t msg_batch_len;
+static pthread_mutex_t msg_batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* write the message after the batched ones, iov[0] is reserved */
+static int write_message(struct iovec *iov, int iovcnt, size_t len)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&msg_batch_lock);
+
+	/* send the batch separately if they don't fit in a single write */
+	if (msg_batch_len + len > PIPE_BUF) {
+		if (write(pfd, msg_batch, msg_batch_len) != (ssize_t)msg_batch_len)
+			ret = -1;
+		msg_batch_len = 0;
+	}
+
+	iov[0].iov_base = msg_batch;
+	iov[0].iov_len  = msg_batch_len;
+	len += msg_batch_len;
+
+	if (writev(pfd, iov, iovcnt) != (ssize_t)len)
+		ret = -1;
+
+	msg_batch_len = 0;
+	pthread_mutex_unlock(&msg_batch_lock);
+
+	return ret;
+}
+
 void ftrace_send_message(int type, void *data, size_t len)
 {
 	struct ftrace_msg msg = {
@@ -101,7 +188,8 @@ void ftrace_send_message(int type, void *data, size_t len)
 		.type = type,
 		.len = len,
 	};
-	struct iovec iov[2] = {
+	struct iovec iov[3] = {
+		{ /* for batched messages */ },
 		{ .iov_base = &msg, .iov_len = sizeof(msg), },
 		{ .iov_base = data, .iov_len = len, },
 	};
@@ -110,10 +198,67 @@ void ftrace_send_message(int type, void *data, size_t len)
 		return;
 
 	len += sizeof(msg);
-	if (writev(pfd, iov, 2) != (ssize_t)len)
+	if (write_message(iov, 3, len) < 0)
 		pr_err("writing shmem name to pipe");
 }
 
+void ftrace_queue_message(int type, void *data, size_t len)
+{
+	struct ftrace_msg msg = {
+		.magic = FTRACE_MSG_MAGIC,
+		.type = type,
+		.len = len,
+	};
+
+	if (pfd < 0)
+		return;
+
+	pthread_mutex_lock(&msg_batch_lock);
+
+	if (msg_batch_len + sizeof(msg) + len > sizeof(msg_batch)) {
+		if (write(pfd, msg_batch, msg_batch_len) != (ssize_t)msg_batch_len)
+			pr_err("writing messages to pipe");
+		msg_batch_len = 0;
+	}
+
+	memcpy(msg_batch + msg_batch_len, &msg, sizeof(msg));
+	memcpy(msg_batch + msg_batch_len + sizeof(msg), data, len);
+	msg_batch_len += sizeof(msg) + len;
+
+	pthread_mutex_unlock(&msg_batch_lock);
+}
+
+static void __flush_message(void)
+{
+	if (write(pfd, msg_batch, msg_batch_len) != (ssize_t)msg_batch_len)
+		pr_dbg("writing messages to pipe failed\n");
+
+	msg_batch_len = 0;
+}
+
+void ftrace_flush_message(void)
+{
+	if (pfd < 0 || msg_batch_len == 0)
+		return;
+
+	pthread_mutex_lock(&msg_batch_lock);
+	__flush_message();
+	pthread_mutex_unlock(&msg_batch_lock);
+}
+
+/* it can be called from a signal handler */
+static void ftrace_flush_message_nowait(void)
+{
+	if (pfd < 0 || msg_batch_len == 0)
+		return;
+
+	if (pthread_mutex_trylock(&msg_batch_lock))
+		return;
+
+	__flush_message();
+	pthread_mutex_unlock(&msg_batch_lock);
+}
+
 static void send_session_msg(struct mcount_thread_data *mtdp, const char *sess_id)
 {
 	struct ftrace_msg_sess sess = {
@@ -129,7 +274,8 @@ static void send_session_msg(struct mcount_thread_data *mtdp, const char *sess_i
 		.type = FTRACE_MSG_SESSION,
 		.len = sizeof(sess) + sess.namelen,
 	};
-	struct iovec iov[3] = {
+	struct iovec iov[4] = {
+		{ /* for batched messages */ },
 		{ .iov_base = &msg, .iov_len = sizeof(msg), },
 		{ .iov_base = &sess, .iov_len = sizeof(sess), },
 		{ .iov_base = mcount_exename, .iov_len = sess.namelen, },
@@ -141,7 +287,7 @@ static void send_session_msg(struct mcount_thread_data *mtdp, const char *sess_i
 
 	memcpy(sess.sid, sess_id, sizeof(sess.sid));
 
-	if (writev(pfd, iov, 3) != len)
+	if (write_message(iov, 4, len) < 0)
 		pr_err("write tid info failed");
 }
 
@@ -163,7 +309,8 @@ static void send_dlopen_msg(struct mcount_thread_data *mtdp, const char *sess_id
 		.type = FTRACE_MSG_DLOPEN,
 		.len = sizeof(dlop) + dlop.namelen,
 	};
-	struct iovec iov[3] = {
+	struct iovec iov[4] = {
+		{ /* for batched messages */ },
 		{ .iov_base = &msg, .iov_len = sizeof(msg), },
 		{ .iov_base = &dlop, .iov_len = sizeof(dlop), },
 		{ .iov_base = (void *)libname, .iov_len = dlop.namelen, },
@@ -175,7 +322,7 @@ static void send_dlopen_msg(struct mcount_thread_data *mtdp, const char *sess_id
 
 	memcpy(dlop.sid, sess_id, sizeof(dlop.sid));
 
-	if (writev(pfd, iov, 3) != len)
+	if (write_message(iov, 4, len) < 0)
 		pr_err("write tid info failed");
 }
 
@@ -221,7 +368,8 @@ struct mcount_thread_data * mcount_prepare(void)
 	compiler_barrier();
 
 #ifndef DISABLE_MCOUNT_FILTER
-	mtdp->filter.depth  = mcount_depth;
+	mtdp->filter.setting = mcount_setting;
+	mtdp->filter.depth  = mtdp->filter.setting->depth;
 	mtdp->filter.time   = mcount_threshold;
 	mtdp->enable_cached = mcount_enabled;
 	mtdp->argbuf = xmalloc(mcount_rstack_max * ARGBUF_SIZE);
@@ -229,16 +377,23 @@ struct mcount_thread_data * mcount_prepare(void)
 	mtdp->rstack = xmalloc(mcount_rstack_max * sizeof(*mtd.rstack));
 
 	pthread_once(&once_control, mcount_init_file);
-	prepare_shmem_buffer(mtdp);
-
-	pthread_setspecific(mtd_key, mtdp);
 
 	/* time should be get after session message sent */
 	tmsg.pid = getpid(),
 	tmsg.tid = gettid(mtdp),
 	tmsg.time = mcount_gettime();
 
-	ftrace_send_message(FTRACE_MSG_TID, &tmsg, sizeof(tmsg));
+	/*
+	 * It'll be sent with the next message (e.g. buffer switch).
+	 * Note that it should come before the REC_START message of
+	 * the new buffer since the recorder might flush old buffers
+	 * of the same pid (due to exec) when it receives this.
+	 */
+	ftrace_queue_message(FTRACE_MSG_TID, &tmsg, sizeof(tmsg));
+
+	prepare_shmem_buffer(mtdp);
+
+	pthread_setspecific(mtd_key, mtdp);
 
 	return mtdp;
 }
@@ -258,16 +413,271 @@ bool mcount_check_rstack(struct mcount_thread_data *mtdp)
 }
 
 #ifndef DISABLE_MCOUNT_FILTER
+static void *mcount_control_thread(void *arg);
+static void mcount_use_full_variant(void);
+
+static void mcount_start_control_thread(void)
+{
+	sigset_t set, old;
+
+	/* signals (and triggers) should be handled by the program threads */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	if (pthread_create(&mcount_ctrl_thread, NULL,
+			   mcount_control_thread, NULL) != 0)
+		pr_dbg("failed to create control thread\n");
+	else
+		mcount_ctrl_running = true;
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static void mcount_setup_control(void)
+{
+	char buf[128];
+	int fd;
+
+	snprintf(buf, sizeof(buf), MCOUNT_CONTROL_FMT, session_name());
+
+	fd = shm_open(buf, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		pr_dbg("failed to open control block: %s\n", buf);
+		return;
+	}
+
+	if (ftruncate(fd, MCOUNT_CONTROL_SIZE) < 0) {
+		pr_dbg("failed to resize control block: %s\n", buf);
+		goto out;
+	}
+
+	mcount_ctrl = mmap(NULL, MCOUNT_CONTROL_SIZE, PROT_READ | PROT_WRITE,
+			   MAP_SHARED, fd, 0);
+	if (mcount_ctrl == MAP_FAILED) {
+		pr_dbg("failed to mmap control block: %s\n", buf);
+		mcount_ctrl = NULL;
+		goto out;
+	}
+
+	mcount_start_control_thread();
+
+out:
+	close(fd);
+}
+
+static void mcount_finish_control(void)
+{
+	char buf[128];
+	struct mcount_filter_setting *setting;
+	struct ftrace_proc_maps *map, *tmp;
+	size_t i;
+
+	if (mcount_ctrl_running) {
+		mcount_ctrl_stop = true;
+
+		/* it might miss a wakeup right before going to sleep */
+		while (pthread_tryjoin_np(mcount_ctrl_thread, NULL) == EBUSY) {
+			wake_control(mcount_ctrl);
+			usleep(1000);
+		}
+		mcount_ctrl_running = false;
+	}
+
+	if (mcount_ctrl) {
+		snprintf(buf, sizeof(buf), MCOUNT_CONTROL_FMT, session_name());
+
+		munmap(mcount_ctrl, MCOUNT_CONTROL_SIZE);
+		mcount_ctrl = NULL;
+		shm_unlink(buf);
+	}
+
+	while (mcount_setting != &mcount_initial_setting) {
+		setting = mcount_setting;
+		mcount_setting = setting->prev;
+
+		ftrace_cleanup_filter(&setting->triggers);
+		free(setting);
+	}
+	ftrace_cleanup_filter(&mcount_initial_setting.triggers);
+
+	/* the filters above refer to the symbol names */
+	unload_symtabs(&mcount_ctrl_symtabs);
+
+	map = mcount_ctrl_symtabs.maps;
+	while (map) {
+		tmp = map;
+		map = map->next;
+
+		for (i = 0; i < tmp->symtab.nr_sym; i++)
+			free(tmp->symtab.sym[i].name);
+		free(tmp->symtab.sym);
+		free(tmp->symtab.sym_names);
+		free(tmp);
+	}
+	mcount_ctrl_symtabs.maps = NULL;
+}
+
+static void mcount_setup_triggers(struct mcount_filter_setting *setting,
+				  struct symtabs *stabs)
+{
+	LIST_HEAD(modules);
+
+	ftrace_setup_filter_module(mcount_filter_str, &modules, mcount_exename);
+	ftrace_setup_filter_module(mcount_trigger_str, &modules, mcount_exename);
+	ftrace_setup_filter_module(mcount_argument_str, &modules, mcount_exename);
+	ftrace_setup_filter_module(mcount_retval_str, &modules, mcount_exename);
+
+	load_module_symtabs(stabs, &modules);
+
+	ftrace_setup_filter(mcount_filter_str, stabs, &setting->triggers,
+			    &setting->mode);
+	ftrace_setup_trigger(mcount_trigger_str, stabs, &setting->triggers);
+	ftrace_setup_argument(mcount_argument_str, stabs, &setting->triggers);
+	ftrace_setup_retval(mcount_retval_str, stabs, &setting->triggers);
+
+	ftrace_cleanup_filter_module(&modules);
+}
+
+/* load all symbols aside as the shared symtabs can be used by others */
+static struct symtabs *mcount_load_ctrl_symtabs(void)
+{
+	struct symtabs *stabs = &mcount_ctrl_symtabs;
+	struct ftrace_proc_maps *map, *new, **link;
+	size_t size;
+
+	if (stabs->loaded)
+		return stabs;
+
+	stabs->flags = symtabs.flags & ~(SYMTAB_FL_SKIP_NORMAL |
+					 SYMTAB_FL_SKIP_DYNAMIC);
+
+	link = &stabs->maps;
+	for (map = symtabs.maps; map; map = map->next) {
+		size = sizeof(*map) + map->len;
+		new = xmalloc(size);
+		memcpy(new, map, size);
+		memset(&new->symtab, 0, sizeof(new->symtab));
+		new->next = NULL;
+
+		*link = new;
+		link = &new->next;
+	}
+
+	load_symtabs(stabs, NULL, mcount_exename);
+	return stabs;
+}
+
+/* read new settings from the control block and publish it */
+static void mcount_apply_control(void)
+{
+	struct control_setting cs;
+	struct mcount_filter_setting *setting;
+	int ret;
+
+	ret = read_control(mcount_ctrl, &mcount_ctrl_seqnum, &cs);
+	if (ret == 0)
+		return;
+
+	/* keep the current setting */
+	if (ret < 0) {
+		pr_dbg("invalid control data: ignoring..\n");
+		return;
+	}
+
+	if (cs.flags & MCOUNT_CTRL_FILTER) {
+		free(mcount_filter_str);
+		mcount_filter_str = cs.filter;
+		cs.filter = NULL;
+	}
+	if (cs.flags & MCOUNT_CTRL_TRIGGER) {
+		free(mcount_trigger_str);
+		mcount_trigger_str = cs.trigger;
+		cs.trigger = NULL;
+	}
+	free_control_setting(&cs);
+
+	setting = xmalloc(sizeof(*setting));
+	setting->triggers  = RB_ROOT;
+	setting->mode      = FILTER_MODE_NONE;
+	setting->depth     = mcount_setting->depth;
+	setting->threshold = mcount_setting->threshold;
+	setting->prev      = mcount_setting;
+
+	if (cs.flags & MCOUNT_CTRL_DEPTH)
+		setting->depth = cs.depth;
+	if (cs.flags & MCOUNT_CTRL_THRESHOLD)
+		setting->threshold = cs.threshold;
+
+	mcount_setup_triggers(setting, mcount_load_ctrl_symtabs());
+
+	/* make sure the setting is visible before publishing it */
+	__sync_synchronize();
+	mcount_setting = setting;
+	mcount_threshold = setting->threshold;
+
+	mcount_use_full_variant();
+
+	/* XRay sleds are patched only for the functions passing the filters */
+	if (cs.flags & (MCOUNT_CTRL_FILTER | MCOUNT_CTRL_TRIGGER) &&
+	    mcount_xray_update() < 0)
+		pr_dbg("cannot update xray sleds\n");
+
+	pr_dbg("filter setting updated: depth = %d, threshold = %"PRIu64"\n",
+	       setting->depth, setting->threshold);
+}
+
+static void *mcount_control_thread(void *arg)
+{
+	while (!mcount_ctrl_stop) {
+		if (mcount_ctrl->seqnum != mcount_ctrl_seqnum)
+			mcount_apply_control();
+
+		/* sleep until 'uftrace control' updates the control block */
+		wait_control(mcount_ctrl, mcount_ctrl_seqnum);
+	}
+	return NULL;
+}
+
+/* apply the difference of the settings to the current thread */
+static void mcount_sync_setting(struct mcount_thread_data *mtdp,
+				struct mcount_filter_setting *setting)
+{
+	struct mcount_filter_setting *old = mtdp->filter.setting;
+	int delta = setting->depth - old->depth;
+	int idx;
+
+	mtdp->filter.depth += delta;
+	if (mtdp->filter.time == old->threshold)
+		mtdp->filter.time = setting->threshold;
+
+	/* saved values will be restored at exit */
+	for (idx = 0; idx < mtdp->idx; idx++) {
+		struct mcount_ret_stack *rstack = &mtdp->rstack[idx];
+
+		rstack->filter_depth += delta;
+		if (rstack->filter_time == old->threshold)
+			rstack->filter_time = setting->threshold;
+	}
+
+	mtdp->filter.setting = setting;
+}
+
 /* update filter state from trigger result */
 enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 					     unsigned long child,
 					     struct ftrace_trigger *tr)
 {
+	struct mcount_filter_setting *setting;
+
 	pr_dbg3("<%d> enter %lx\n", mtdp->idx, child);
 
 	if (mcount_check_rstack(mtdp))
 		return FILTER_RSTACK;
 
+	setting = mcount_setting;
+	if (unlikely(mtdp->filter.setting != setting))
+		mcount_sync_setting(mtdp, setting);
+
 	/* save original depth and time to restore at exit time */
 	mtdp->filter.saved_depth = mtdp->filter.depth;
 	mtdp->filter.saved_time  = mtdp->filter.time;
@@ -276,10 +686,10 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 	if (mtdp->filter.out_count > 0)
 		return FILTER_OUT;
 
-	ftrace_match_filter(&mcount_triggers, child, tr);
+	ftrace_match_filter(&setting->triggers, child, tr);
 
 	pr_dbg3(" tr->flags: %lx, filter mode, count: [%d] %d/%d\n",
-		tr->flags, mcount_filter_mode, mtdp->filter.in_count,
+		tr->flags, setting->mode, mtdp->filter.in_count,
 		mtdp->filter.out_count);
 
 	if (tr->flags & TRIGGER_FL_FILTER) {
@@ -289,11 +699,11 @@ enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 			mtdp->filter.out_count++;
 
 		/* apply default filter depth when match */
-		mtdp->filter.depth = mcount_depth;
+		mtdp->filter.depth = setting->depth;
 	}
 	else {
 		/* not matched by filter */
-		if (mcount_filter_mode == FILTER_MODE_IN &&
+		if (setting->mode == FILTER_MODE_IN &&
 		    mtdp->filter.in_count == 0)
 			return FILTER_OUT;
 	}
@@ -334,7 +744,8 @@ void mcount_entry_filter_record(struct mcount_thread_data *mtdp,
 				struct mcount_regs *regs)
 {
 	if (mtdp->filter.out_count > 0 ||
-	    (mtdp->filter.in_count == 0 && mcount_filter_mode == FILTER_MODE_IN))
+	    (mtdp->filter.in_count == 0 &&
+	     mtdp->filter.setting->mode == FILTER_MODE_IN))
 		rstack->flags |= MCOUNT_FL_NORECORD;
 
 	rstack->filter_depth = mtdp->filter.saved_depth;
@@ -437,7 +848,95 @@ void mcount_exit_filter_record(struct mcount_thread_data *mtdp,
 	}
 }
 
+
+/*
+ * Light versions of the above for the specialised mcount_entry/exit.
+ * They keep the filter state in rstack as the full version does, so
+ * that it can switch to the full version at runtime.
+ */
+static __always_inline
+enum filter_result mcount_entry_light_check(struct mcount_thread_data *mtdp,
+					    const unsigned variant)
+{
+	if (mcount_check_rstack(mtdp))
+		return FILTER_RSTACK;
+
+	mtdp->filter.saved_depth = mtdp->filter.depth;
+
+	if (variant & MCOUNT_VAR_DEPTH) {
+		if (mtdp->filter.depth <= 0)
+			return FILTER_OUT;
+
+		mtdp->filter.depth--;
+	}
+	return FILTER_IN;
+}
+
+static __always_inline
+void mcount_entry_light_record(struct mcount_thread_data *mtdp,
+			       struct mcount_ret_stack *rstack)
+{
+	rstack->filter_depth = mtdp->filter.saved_depth;
+	rstack->filter_time  = mtdp->filter.time;
+
+	mtdp->record_idx++;
+}
+
+static __always_inline
+void mcount_exit_light_record(struct mcount_thread_data *mtdp,
+			      struct mcount_ret_stack *rstack,
+			      const unsigned variant)
+{
+	uint64_t time_filter = 0;
+
+	if (variant & MCOUNT_VAR_THRESHOLD)
+		time_filter = mtdp->filter.time;
+
+	mtdp->filter.depth = rstack->filter_depth;
+	mtdp->record_idx--;
+
+	if (rstack->end_time - rstack->start_time > time_filter ||
+	    rstack->flags & MCOUNT_FL_WRITTEN) {
+		if (record_trace_data(mtdp, rstack, NULL) < 0)
+			pr_err("error during record");
+	}
+}
+
+/* whether the function itself passes the filters (for XRay sleds) */
+bool mcount_check_filter(unsigned long addr)
+{
+	struct mcount_filter_setting *setting = mcount_setting;
+	struct ftrace_trigger tr = {};
+
+	ftrace_match_filter(&setting->triggers, addr, &tr);
+
+	if (tr.flags & TRIGGER_FL_FILTER)
+		return tr.fmode == FILTER_MODE_IN;
+
+	return setting->mode != FILTER_MODE_IN;
+}
+
 #else /* DISABLE_MCOUNT_FILTER */
+static inline
+enum filter_result mcount_entry_light_check(struct mcount_thread_data *mtdp,
+					    const unsigned variant)
+{
+	return FILTER_IN;
+}
+
+static inline
+void mcount_entry_light_record(struct mcount_thread_data *mtdp,
+			       struct mcount_ret_stack *rstack)
+{
+}
+
+static inline
+void mcount_exit_light_record(struct mcount_thread_data *mtdp,
+			      struct mcount_ret_stack *rstack,
+			      const unsigned variant)
+{
+}
+
 enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 					     unsigned long child,
 					     struct ftrace_trigger *tr)
@@ -456,6 +955,11 @@ void mcount_entry_filter_record(struct mcount_thread_data *mtdp,
 	mtdp->record_idx++;
 }
 
+bool mcount_check_filter(unsigned long addr)
+{
+	return true;
+}
+
 void mcount_exit_filter_record(struct mcount_thread_data *mtdp,
 			       struct mcount_ret_stack *rstack,
 			       long *retval)
@@ -478,8 +982,9 @@ __weak unsigned long *mcount_arch_parent_location(struct symtabs *symtabs,
 	return parent_loc;
 }
 
-int mcount_entry(unsigned long *parent_loc, unsigned long child,
-		 struct mcount_regs *regs)
+static __always_inline
+int __mcount_entry(unsigned long *parent_loc, unsigned long child,
+		   struct mcount_regs *regs, const unsigned variant)
 {
 	enum filter_result filtered;
 	struct mcount_thread_data *mtdp;
@@ -505,7 +1010,11 @@ int mcount_entry(unsigned long *parent_loc, unsigned long child,
 		mtdp->recursion_guard = true;
 	}
 
-	filtered = mcount_entry_filter_check(mtdp, child, &tr);
+	if (variant & MCOUNT_VAR_FULL)
+		filtered = mcount_entry_filter_check(mtdp, child, &tr);
+	else
+		filtered = mcount_entry_light_check(mtdp, variant);
+
 	if (filtered != FILTER_IN) {
 		mtdp->recursion_guard = false;
 		return -1;
@@ -528,12 +1037,17 @@ int mcount_entry(unsigned long *parent_loc, unsigned long child,
 	/* hijack the return address */
 	*parent_loc = (unsigned long)mcount_return;
 
-	mcount_entry_filter_record(mtdp, rstack, &tr, regs);
+	if (variant & MCOUNT_VAR_FULL)
+		mcount_entry_filter_record(mtdp, rstack, &tr, regs);
+	else
+		mcount_entry_light_record(mtdp, rstack);
+
 	mtdp->recursion_guard = false;
 	return 0;
 }
 
-unsigned long mcount_exit(long *retval)
+static __always_inline
+unsigned long __mcount_exit(long *retval, const unsigned variant)
 {
 	struct mcount_thread_data *mtdp;
 	struct mcount_ret_stack *rstack;
@@ -547,7 +1061,11 @@ unsigned long mcount_exit(long *retval)
 	rstack = &mtdp->rstack[mtdp->idx - 1];
 
 	rstack->end_time = mcount_gettime();
-	mcount_exit_filter_record(mtdp, rstack, retval);
+
+	if (variant & MCOUNT_VAR_FULL)
+		mcount_exit_filter_record(mtdp, rstack, retval);
+	else
+		mcount_exit_light_record(mtdp, rstack, variant);
 
 	retaddr = rstack->parent_ip;
 
@@ -559,6 +1077,109 @@ unsigned long mcount_exit(long *retval)
 	return retaddr;
 }
 
+#ifndef DISABLE_MCOUNT_FILTER
+
+#define MCOUNT_VARIANT(_name, _var)					\
+static int mcount_entry_##_name(unsigned long *parent_loc,		\
+				unsigned long child,			\
+				struct mcount_regs *regs)		\
+{									\
+	return __mcount_entry(parent_loc, child, regs, _var);		\
+}									\
+static unsigned long mcount_exit_##_name(long *retval)			\
+{									\
+	return __mcount_exit(retval, _var);				\
+}
+
+MCOUNT_VARIANT(plain,     0)
+MCOUNT_VARIANT(depth,     MCOUNT_VAR_DEPTH)
+MCOUNT_VARIANT(threshold, MCOUNT_VAR_THRESHOLD)
+MCOUNT_VARIANT(depth_thr, MCOUNT_VAR_DEPTH | MCOUNT_VAR_THRESHOLD)
+MCOUNT_VARIANT(full,      MCOUNT_VAR_FULL)
+
+#undef MCOUNT_VARIANT
+
+static const struct mcount_variant {
+	const char *name;
+	int (*entry)(unsigned long *parent_loc, unsigned long child,
+		     struct mcount_regs *regs);
+	unsigned long (*exit)(long *retval);
+} mcount_variants[] = {
+	[0] = {
+		"plain", mcount_entry_plain, mcount_exit_plain,
+	},
+	[MCOUNT_VAR_DEPTH] = {
+		"depth", mcount_entry_depth, mcount_exit_depth,
+	},
+	[MCOUNT_VAR_THRESHOLD] = {
+		"threshold", mcount_entry_threshold, mcount_exit_threshold,
+	},
+	[MCOUNT_VAR_DEPTH | MCOUNT_VAR_THRESHOLD] = {
+		"depth+threshold", mcount_entry_depth_thr, mcount_exit_depth_thr,
+	},
+	[MCOUNT_VAR_FULL] = {
+		"full", mcount_entry_full, mcount_exit_full,
+	},
+};
+
+static const struct mcount_variant *mcount_variant = &mcount_variants[MCOUNT_VAR_FULL];
+
+static void mcount_setup_variant(void)
+{
+	struct mcount_filter_setting *setting = &mcount_initial_setting;
+	unsigned variant = 0;
+
+	if (!RB_EMPTY_ROOT(&setting->triggers) ||
+	    setting->mode != FILTER_MODE_NONE || !mcount_enabled)
+		variant = MCOUNT_VAR_FULL;
+	else {
+		if (setting->depth < mcount_rstack_max)
+			variant |= MCOUNT_VAR_DEPTH;
+		if (mcount_threshold)
+			variant |= MCOUNT_VAR_THRESHOLD;
+	}
+
+	mcount_variant = &mcount_variants[variant];
+	pr_dbg("using %s version of mcount entry/exit\n", mcount_variant->name);
+}
+
+/*
+ * Filter settings can be changed by 'uftrace control' so the control
+ * thread switches to the full version.  It never goes back so threads
+ * can exit functions in the full version even if they entered in the
+ * other (but not vice versa).
+ */
+static void mcount_use_full_variant(void)
+{
+	mcount_variant = &mcount_variants[MCOUNT_VAR_FULL];
+}
+
+int mcount_entry(unsigned long *parent_loc, unsigned long child,
+		 struct mcount_regs *regs)
+{
+	return mcount_variant->entry(parent_loc, child, regs);
+}
+
+unsigned long mcount_exit(long *retval)
+{
+	return mcount_variant->exit(retval);
+}
+
+#else /* DISABLE_MCOUNT_FILTER */
+
+int mcount_entry(unsigned long *parent_loc, unsigned long child,
+		 struct mcount_regs *regs)
+{
+	return __mcount_entry(parent_loc, child, regs, MCOUNT_VAR_FULL);
+}
+
+unsigned long mcount_exit(long *retval)
+{
+	return __mcount_exit(retval, MCOUNT_VAR_FULL);
+}
+
+#endif /* DISABLE_MCOUNT_FILTER */
+
 static void mcount_finish(void)
 {
 	if (mcount_finished)
@@ -568,6 +1189,7 @@ static void mcount_finish(void)
 	pthread_key_delete(mtd_key);
 
 	if (pfd != -1) {
+		ftrace_flush_message();
 		close(pfd);
 		pfd = -1;
 	}
@@ -716,8 +1338,17 @@ static void atfork_child_handler(void)
 
 	mtdp->recursion_guard = true;
 
-	clear_shmem_buffer(mtdp);
-	prepare_shmem_buffer(mtdp);
+	/* messages in the batch belong to the parent */
+	pthread_mutex_init(&msg_batch_lock, NULL);
+	msg_batch_len = 0;
+
+	reset_shmem_buffer(mtdp);
+
+#ifndef DISABLE_MCOUNT_FILTER
+	/* the control thread is not copied */
+	if (mcount_ctrl_running)
+		mcount_start_control_thread();
+#endif
 
 	ftrace_send_message(FTRACE_MSG_FORK_END, &tmsg, sizeof(tmsg));
 
@@ -777,6 +1408,7 @@ static void (*old_segfault_handler)(int);
 static void segfault_handler(int sig)
 {
 	mcount_rstack_restore();
+	ftrace_flush_message_nowait();
 
 	signal(sig, old_segfault_handler);
 	raise(sig);
@@ -823,6 +1455,7 @@ static void mcount_startup(void)
 	char *logfd_str;
 	char *debug_str;
 	char *bufsize_str;
+	char *buflimit_str;
 	char *maxstack_str;
 	char *threshold_str;
 	char *color_str;
@@ -834,7 +1467,6 @@ static void mcount_startup(void)
 	char *plthook_str;
 	char *dirname;
 	struct stat statbuf;
-	LIST_HEAD(modules);
 
 	if (mcount_setup_done || mtd.recursion_guard)
 		return;
@@ -851,6 +1483,7 @@ static void mcount_startup(void)
 	logfd_str = getenv("UFTRACE_LOGFD");
 	debug_str = getenv("UFTRACE_DEBUG");
 	bufsize_str = getenv("UFTRACE_BUFFER");
+	buflimit_str = getenv("UFTRACE_BUFFER_LIMIT");
 	maxstack_str = getenv("UFTRACE_MAX_STACK");
 	color_str = getenv("UFTRACE_COLOR");
 	threshold_str = getenv("UFTRACE_THRESHOLD");
@@ -898,6 +1531,12 @@ static void mcount_startup(void)
 
 	if (bufsize_str)
 		shmem_bufsize = strtol(bufsize_str, NULL, 0);
+	if (buflimit_str)
+		shmem_limit = strtoul(buflimit_str, NULL, 0);
+
+	/* pre-allocate buffers so that new threads can start quickly */
+	if (pfd >= 0)
+		setup_shmem_pool();
 
 	dirname = getenv("UFTRACE_DIR");
 	if (dirname == NULL)
@@ -912,32 +1551,37 @@ static void mcount_startup(void)
 	record_proc_maps(dirname, session_name(), &symtabs);
 	load_symtabs(&symtabs, NULL, mcount_exename);
 
-#ifndef DISABLE_MCOUNT_FILTER
-	ftrace_setup_filter_module(filter_str, &modules, mcount_exename);
-	ftrace_setup_filter_module(trigger_str, &modules, mcount_exename);
-	ftrace_setup_filter_module(argument_str, &modules, mcount_exename);
-	ftrace_setup_filter_module(retval_str, &modules, mcount_exename);
+	if (maxstack_str)
+		mcount_rstack_max = strtol(maxstack_str, NULL, 0);
 
-	load_module_symtabs(&symtabs, &modules);
+	if (threshold_str)
+		mcount_threshold = strtoull(threshold_str, NULL, 0);
 
-	ftrace_setup_filter(filter_str, &symtabs, &mcount_triggers,
-			    &mcount_filter_mode);
-	ftrace_setup_trigger(trigger_str, &symtabs, &mcount_triggers);
-	ftrace_setup_argument(argument_str, &symtabs, &mcount_triggers);
-	ftrace_setup_retval(retval_str, &symtabs, &mcount_triggers);
+#ifndef DISABLE_MCOUNT_FILTER
+	if (filter_str)
+		mcount_filter_str = xstrdup(filter_str);
+	if (trigger_str)
+		mcount_trigger_str = xstrdup(trigger_str);
+	if (argument_str)
+		mcount_argument_str = xstrdup(argument_str);
+	if (retval_str)
+		mcount_retval_str = xstrdup(retval_str);
+
+	mcount_setup_triggers(&mcount_initial_setting, &symtabs);
 
 	if (getenv("UFTRACE_DEPTH"))
-		mcount_depth = strtol(getenv("UFTRACE_DEPTH"), NULL, 0);
+		mcount_initial_setting.depth = strtol(getenv("UFTRACE_DEPTH"), NULL, 0);
+	mcount_initial_setting.threshold = mcount_threshold;
 
 	if (getenv("UFTRACE_DISABLED"))
 		mcount_enabled = false;
-#endif /* DISABLE_MCOUNT_FILTER */
 
-	if (maxstack_str)
-		mcount_rstack_max = strtol(maxstack_str, NULL, 0);
+	mcount_setup_variant();
 
-	if (threshold_str)
-		mcount_threshold = strtoull(threshold_str, NULL, 0);
+	/* only makes sense when it's recorded by uftrace */
+	if (pfd >= 0)
+		mcount_setup_control();
+#endif /* DISABLE_MCOUNT_FILTER */
 
 	if (plthook_str) {
 		if (symtabs.dsymtab.nr_sym == 0) {
@@ -954,14 +1598,14 @@ static void mcount_startup(void)
 	}
 
 out:
+	/* binaries built with clang -fxray-instrument have no mcount */
+	if (symtabs.maps)
+		mcount_setup_xray(mcount_exename, symtabs.maps->start);
+
 	pthread_atfork(atfork_prepare_handler, NULL, atfork_child_handler);
 
 	mcount_hook_functions();
 
-#ifndef DISABLE_MCOUNT_FILTER
-	ftrace_cleanup_filter_module(&modules);
-#endif /* DISABLE_MCOUNT_FILTER */
-
 	compiler_barrier();
 	pr_dbg("mcount setup done\n");
 
@@ -971,11 +1615,12 @@ out:
 
 static void mcount_cleanup(void)
 {
+	mcount_finish_xray();
 	mcount_finish();
 	destroy_dynsym_indexes();
 
 #ifndef DISABLE_MCOUNT_FILTER
-	ftrace_cleanup_filter(&mcount_triggers);
+	mcount_finish_control();
 #endif
 }
 
@@ -17,6 +17,7 @@
 #include "uftrace.h"
 #include "utils/rbtree.h"
 #include "utils/symbol.h"
+#include "utils/control.h"
 
 #define FTRACE_DIR_NAME   "uftrace.data"
 
@@ -63,7 +64,10 @@ void _mcleanup(void);
 void mcount_restore(void);
 void mcount_reset(void);
 
-#define SHMEM_BUFFER_SIZE  (128 * 1024)
+#define SHMEM_BUFFER_SIZE      (128 * 1024)
+#define SHMEM_BUFFER_MAX_SIZE  (4 * 1024 * 1024)
+#define SHMEM_BUFFER_LIMIT     (256 * 1024 * 1024)  /* for all threads */
+#define SHMEM_HUGEPAGE_SIZE    (2 * 1024 * 1024)
 
 enum shmem_buffer_flags {
 	SHMEM_FL_NEW		= (1U << 0),
@@ -74,7 +78,10 @@ enum shmem_buffer_flags {
 struct mcount_shmem_buffer {
 	unsigned size;
 	unsigned flag;
-	unsigned unused[2];
+	unsigned alloc_size;	/* mmap size including this header */
+	int tid;		/* owner of the buffer (it can be reused) */
+	unsigned seq;		/* to make the (unique) name */
+	unsigned unused;
 	char data[];
 };
 
@@ -88,6 +95,8 @@ enum filter_result {
 };
 
 #ifndef DISABLE_MCOUNT_FILTER
+struct mcount_filter_setting;
+
 struct filter_control {
 	int in_count;
 	int out_count;
@@ -95,6 +104,8 @@ struct filter_control {
 	int saved_depth;
 	uint64_t time;
 	uint64_t saved_time;
+	/* global setting which this thread is synced with */
+	struct mcount_filter_setting *setting;
 };
 #else
 struct filter_control {};
@@ -107,6 +118,9 @@ struct mcount_shmem {
 	int				nr_buf;
 	int				max_buf;
 	bool				done;
+	/* size of new buffers: adjusted by the event rate */
+	unsigned			bufsize;
+	uint64_t			switch_time;
 	struct mcount_shmem_buffer	**buffer;
 };
 
@@ -153,6 +167,7 @@ extern TLS struct mcount_thread_data mtd;
 extern uint64_t mcount_threshold;  /* nsec */
 extern pthread_key_t mtd_key;
 extern int shmem_bufsize;
+extern size_t shmem_limit;
 extern bool mcount_setup_done;
 extern bool mcount_finished;
 
@@ -164,6 +179,8 @@ extern struct mcount_thread_data * mcount_prepare(void);
 extern uint64_t mcount_gettime(void);
 extern bool mcount_check_rstack(struct mcount_thread_data *mtdp);
 extern void ftrace_send_message(int type, void *data, size_t len);
+extern void ftrace_queue_message(int type, void *data, size_t len);
+extern void ftrace_flush_message(void);
 extern const char *session_name(void);
 extern int gettid(struct mcount_thread_data *mtdp);
 
@@ -175,6 +192,32 @@ extern void get_new_shmem_buffer(struct mcount_thread_data *mtdp);
 extern void finish_shmem_buffer(struct mcount_thread_data *mtdp, int idx);
 extern void clear_shmem_buffer(struct mcount_thread_data *mtdp);
 extern void shmem_finish(struct mcount_thread_data *mtdp);
+extern void reset_shmem_buffer(struct mcount_thread_data *mtdp);
+extern void setup_shmem_pool(void);
+
+/* sled kinds in the xray_instr_map section (see LLVM XRaySledEntry) */
+enum xray_sled_kind {
+	XRAY_SLED_ENTRY		= 0,
+	XRAY_SLED_EXIT,
+	XRAY_SLED_TAIL,
+	XRAY_SLED_LOG_ARGS_ENTRY,
+	XRAY_SLED_CUSTOM_EVENT,
+	XRAY_SLED_TYPED_EVENT,
+};
+
+struct xray_sled {
+	unsigned long addr;	/* runtime address of the sled */
+	unsigned long func;	/* runtime address of the function */
+	int id;			/* function id (starts from 1) */
+	int kind;
+	bool patched;
+};
+
+extern int mcount_setup_xray(char *exename, unsigned long offset);
+extern int mcount_xray_patch(unsigned long func, bool enable);
+extern int mcount_xray_update(void);
+extern void mcount_finish_xray(void);
+extern int mcount_arch_xray_patch(struct xray_sled *sled, bool enable);
 
 extern int hook_pltgot(char *exename, unsigned long offset);
 extern void plthook_setup(struct symtabs *symtabs);
@@ -212,6 +255,7 @@ extern void mcount_arch_get_arg(struct mcount_arg_context *ctx,
 extern void mcount_arch_get_retval(struct mcount_arg_context *ctx,
 				   struct ftrace_arg_spec *spec);
 
+extern bool mcount_check_filter(unsigned long addr);
 extern enum filter_result mcount_entry_filter_check(struct mcount_thread_data *mtdp,
 						    unsigned long child,
 						    struct ftrace_trigger *tr);
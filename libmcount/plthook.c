@@ -514,6 +514,8 @@ unsigned long plthook_entry(unsigned long *ret_addr, unsigned long child_idx,
 		/* force flush rstack on some special functions */
 		if (special_flag & PLT_FL_FLUSH) {
 			record_trace_data(mtdp, rstack, NULL);
+			/* batched messages will be lost after exec */
+			ftrace_flush_message();
 		}
 	}
 
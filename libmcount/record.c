@@ -5,6 +5,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 /* This should be defined before #include "utils.h" */
 #define PR_FMT     "mcount"
@@ -15,15 +16,47 @@
 #include "utils/utils.h"
 #include "utils/filter.h"
 
-#define SHMEM_SESSION_FMT  "/uftrace-%s-%d-%03d" /* session-id, tid, seq */
+#define SHMEM_SESSION_FMT  "/uftrace-%s-%d-%03d" /* session-id, pid, seq */
+
+/* time to fill a buffer which makes the buffer size grow or shrink */
+#define SHMEM_BUSY_TIME  (10 * NSEC_PER_MSEC)
+#define SHMEM_IDLE_TIME  (1 * NSEC_PER_SEC)
+
+/* number of (free) buffers kept in the pool */
+#define SHMEM_POOL_MAX       64
+#define SHMEM_POOL_PREALLOC  4
+
+/* total size of shmem buffers in all threads */
+static size_t shmem_total;
+
+/*
+ * Buffers are shared by all threads in the process so that a new thread
+ * can borrow existing buffers rather than creating new ones.  The owner
+ * thread is saved in the buffer header for the recorder.
+ */
+static struct mcount_shmem_buffer *shmem_pool[SHMEM_POOL_MAX];
+static int shmem_pool_nr;
+static unsigned shmem_pool_seq;
+static pthread_mutex_t shmem_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int shmem_pid;
+
+static void shmem_buffer_name(char *buf, size_t size, unsigned seq)
+{
+	if (!shmem_pid)
+		shmem_pid = getpid();
+
+	snprintf(buf, size, SHMEM_SESSION_FMT, session_name(), shmem_pid, seq);
+}
 
 static struct mcount_shmem_buffer *allocate_shmem_buffer(char *buf, size_t size,
-							 int tid, int idx)
+							 unsigned seq,
+							 unsigned bufsize)
 {
 	int fd;
 	struct mcount_shmem_buffer *buffer = NULL;
 
-	snprintf(buf, size, SHMEM_SESSION_FMT, session_name(), tid, idx);
+	shmem_buffer_name(buf, size, seq);
 
 	fd = shm_open(buf, O_RDWR | O_CREAT | O_TRUNC, 0600);
 	if (fd < 0) {
@@ -31,12 +64,12 @@ static struct mcount_shmem_buffer *allocate_shmem_buffer(char *buf, size_t size,
 		goto out;
 	}
 
-	if (ftruncate(fd, shmem_bufsize) < 0) {
+	if (ftruncate(fd, bufsize) < 0) {
 		pr_dbg("failed to resizing shmem buffer: %s\n", buf);
 		goto out;
 	}
 
-	buffer = mmap(NULL, shmem_bufsize, PROT_READ | PROT_WRITE,
+	buffer = mmap(NULL, bufsize, PROT_READ | PROT_WRITE,
 		      MAP_SHARED, fd, 0);
 	if (buffer == MAP_FAILED) {
 		pr_dbg("failed to mmap shmem buffer: %s\n", buf);
@@ -44,12 +77,156 @@ static struct mcount_shmem_buffer *allocate_shmem_buffer(char *buf, size_t size,
 		goto out;
 	}
 
-	close(fd);
+#ifdef MADV_HUGEPAGE
+	/* it needs shmem_enabled=advise in /sys/kernel/mm/transparent_hugepage */
+	if (bufsize >= SHMEM_HUGEPAGE_SIZE)
+		madvise(buffer, bufsize, MADV_HUGEPAGE);
+#endif
+
+	buffer->alloc_size = bufsize;
+	buffer->seq = seq;
+	__sync_fetch_and_add(&shmem_total, bufsize);
 
 out:
+	if (fd >= 0)
+		close(fd);
 	return buffer;
 }
 
+static void unmap_shmem_buffer(struct mcount_shmem_buffer *buffer,
+			       unsigned bufsize)
+{
+	__sync_fetch_and_sub(&shmem_total, bufsize);
+	munmap(buffer, bufsize);
+}
+
+static void free_shmem_buffer(struct mcount_shmem_buffer *buffer)
+{
+	unmap_shmem_buffer(buffer, buffer->alloc_size);
+}
+
+/* the recorder is done with it (see SHMEM_FL_WRITTEN), change the size */
+static struct mcount_shmem_buffer *
+resize_shmem_buffer(struct mcount_shmem_buffer *buffer, unsigned bufsize)
+{
+	char buf[128];
+	struct mcount_shmem_buffer *new_buf;
+	unsigned old_size = buffer->alloc_size;
+
+	if (old_size == bufsize)
+		return buffer;
+
+	/* it reuses the same shmem (name) so the header is shared */
+	new_buf = allocate_shmem_buffer(buf, sizeof(buf), buffer->seq, bufsize);
+	if (new_buf == NULL)
+		return buffer;
+
+	unmap_shmem_buffer(buffer, old_size);
+	return new_buf;
+}
+
+/* get a free buffer from the pool or create a new one */
+static struct mcount_shmem_buffer *get_pool_buffer(unsigned bufsize)
+{
+	char buf[128];
+	struct mcount_shmem_buffer *buffer;
+	unsigned seq;
+	int i;
+
+	pthread_mutex_lock(&shmem_pool_lock);
+
+	/* the most recently used one is likely to be cache-hot */
+	for (i = shmem_pool_nr - 1; i >= 0; i--) {
+		buffer = shmem_pool[i];
+
+		/* the recorder might not finish writing yet */
+		if (buffer->flag & SHMEM_FL_RECORDING)
+			continue;
+
+		shmem_pool[i] = shmem_pool[--shmem_pool_nr];
+		pthread_mutex_unlock(&shmem_pool_lock);
+
+		return resize_shmem_buffer(buffer, bufsize);
+	}
+
+	seq = shmem_pool_seq++;
+	pthread_mutex_unlock(&shmem_pool_lock);
+
+	return allocate_shmem_buffer(buf, sizeof(buf), seq, bufsize);
+}
+
+static void put_pool_buffer(struct mcount_shmem_buffer *buffer)
+{
+	char buf[128];
+
+	pthread_mutex_lock(&shmem_pool_lock);
+	if (shmem_pool_nr < SHMEM_POOL_MAX) {
+		shmem_pool[shmem_pool_nr++] = buffer;
+		buffer = NULL;
+	}
+	pthread_mutex_unlock(&shmem_pool_lock);
+
+	if (buffer == NULL)
+		return;
+
+	/* too many buffers, release it (unless recorder needs it) */
+	if (!(buffer->flag & SHMEM_FL_RECORDING)) {
+		shmem_buffer_name(buf, sizeof(buf), buffer->seq);
+		shm_unlink(buf);
+	}
+	free_shmem_buffer(buffer);
+}
+
+void setup_shmem_pool(void)
+{
+	struct mcount_shmem_buffer *buffers[SHMEM_POOL_PREALLOC];
+	int i, n;
+
+	/* get all of them first, or it'd get the same buffer again */
+	for (n = 0; n < SHMEM_POOL_PREALLOC; n++) {
+		buffers[n] = get_pool_buffer(shmem_bufsize);
+		if (buffers[n] == NULL)
+			break;
+	}
+
+	for (i = 0; i < n; i++)
+		put_pool_buffer(buffers[i]);
+}
+
+/*
+ * Busy threads get larger buffers so that they can reduce the number of
+ * buffer switches (and messages to the recorder) while idle threads keep
+ * the default size.  The total size is limited by shmem_limit.
+ */
+static void update_shmem_bufsize(struct mcount_shmem *shmem)
+{
+	uint64_t now = mcount_gettime();
+	uint64_t elapsed = now - shmem->switch_time;
+	unsigned bufsize = shmem->bufsize;
+
+	shmem->switch_time = now;
+
+	if (elapsed < SHMEM_BUSY_TIME) {
+		if (bufsize * 2 > SHMEM_BUFFER_MAX_SIZE)
+			return;
+		if (shmem_total + bufsize * 2 > shmem_limit)
+			return;
+
+		bufsize *= 2;
+	}
+	else if (elapsed > SHMEM_IDLE_TIME) {
+		if (bufsize / 2 < (unsigned)shmem_bufsize)
+			return;
+
+		bufsize /= 2;
+	}
+
+	if (bufsize != shmem->bufsize) {
+		pr_dbg2("change buffer size: %u -> %u\n", shmem->bufsize, bufsize);
+		shmem->bufsize = bufsize;
+	}
+}
+
 void prepare_shmem_buffer(struct mcount_thread_data *mtdp)
 {
 	char buf[128];
@@ -62,20 +239,24 @@ void prepare_shmem_buffer(struct mcount_thread_data *mtdp)
 	shmem->nr_buf = 2;
 	shmem->max_buf = 2;
 	shmem->buffer = xcalloc(sizeof(*shmem->buffer), 2);
+	shmem->bufsize = shmem_bufsize;
+	shmem->switch_time = mcount_gettime();
 
 	for (idx = 0; idx < shmem->nr_buf; idx++) {
-		shmem->buffer[idx] = allocate_shmem_buffer(buf, sizeof(buf),
-							   tid, idx);
+		shmem->buffer[idx] = get_pool_buffer(shmem->bufsize);
 		if (shmem->buffer[idx] == NULL)
 			pr_err("mmap shmem buffer");
+
+		shmem->buffer[idx]->tid = tid;
 	}
 
 	/* set idx 0 as current buffer */
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT, session_name(), tid, 0);
-	ftrace_send_message(FTRACE_MSG_REC_START, buf, strlen(buf));
+	shmem_buffer_name(buf, sizeof(buf), shmem->buffer[0]->seq);
+	ftrace_queue_message(FTRACE_MSG_REC_START, buf, strlen(buf));
 
 	shmem->done = false;
 	shmem->curr = 0;
+	shmem->buffer[0]->size = 0;
 	shmem->buffer[0]->flag = SHMEM_FL_RECORDING | SHMEM_FL_NEW;
 }
 
@@ -87,11 +268,17 @@ void get_new_shmem_buffer(struct mcount_thread_data *mtdp)
 	struct mcount_shmem_buffer **new_buffer;
 	int idx;
 
+	update_shmem_bufsize(shmem);
+
 	/* always use first buffer available */
 	for (idx = 0; idx < shmem->nr_buf; idx++) {
 		curr_buf = shmem->buffer[idx];
-		if (!(curr_buf->flag & SHMEM_FL_RECORDING))
-			goto reuse;
+		if (curr_buf->flag & SHMEM_FL_RECORDING)
+			continue;
+
+		curr_buf = resize_shmem_buffer(curr_buf, shmem->bufsize);
+		shmem->buffer[idx] = curr_buf;
+		goto reuse;
 	}
 
 	new_buffer = realloc(shmem->buffer, sizeof(*new_buffer) * (idx + 1));
@@ -102,8 +289,7 @@ void get_new_shmem_buffer(struct mcount_thread_data *mtdp)
 		 */
 		shmem->buffer = new_buffer;
 
-		curr_buf = allocate_shmem_buffer(buf, sizeof(buf),
-						 gettid(mtdp), idx);
+		curr_buf = get_pool_buffer(shmem->bufsize);
 	}
 
 	if (new_buffer == NULL || curr_buf == NULL) {
@@ -118,6 +304,8 @@ void get_new_shmem_buffer(struct mcount_thread_data *mtdp)
 		shmem->max_buf = shmem->nr_buf;
 
 reuse:
+	curr_buf->tid = gettid(mtdp);
+
 	/*
 	 * Start a new buffer and mark it recording data.
 	 * See cmd-record.c::writer_thread().
@@ -140,15 +328,14 @@ reuse:
 				count++;
 		}
 
-		/* if 3 or more buffers are unused, free the last one */
+		/* if 3 or more buffers are unused, return the last one */
 		if (count >= 3 && b->flag == SHMEM_FL_WRITTEN) {
 			shmem->nr_buf--;
-			munmap(b, shmem_bufsize);
+			put_pool_buffer(b);
 		}
 	}
 
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT,
-		 session_name(), gettid(mtdp), idx);
+	shmem_buffer_name(buf, sizeof(buf), curr_buf->seq);
 
 	pr_dbg2("new buffer: [%d] %s\n", idx, buf);
 	ftrace_send_message(FTRACE_MSG_REC_START, buf, strlen(buf));
@@ -174,12 +361,11 @@ void finish_shmem_buffer(struct mcount_thread_data *mtdp, int idx)
 {
 	char buf[64];
 
-	snprintf(buf, sizeof(buf), SHMEM_SESSION_FMT,
-		 session_name(), gettid(mtdp), idx);
-
+	shmem_buffer_name(buf, sizeof(buf), mtdp->shmem.buffer[idx]->seq);
 	ftrace_send_message(FTRACE_MSG_REC_END, buf, strlen(buf));
 }
 
+/* return buffers to the pool */
 void clear_shmem_buffer(struct mcount_thread_data *mtdp)
 {
 	struct mcount_shmem *shmem = &mtdp->shmem;
@@ -188,11 +374,39 @@ void clear_shmem_buffer(struct mcount_thread_data *mtdp)
 	pr_dbg2("releasing all shmem buffers for task %d\n", gettid(mtdp));
 
 	for (i = 0; i < shmem->nr_buf; i++)
-		munmap(shmem->buffer[i], shmem_bufsize);
+		put_pool_buffer(shmem->buffer[i]);
+
+	free(shmem->buffer);
+	shmem->buffer = NULL;
+	shmem->nr_buf = 0;
+}
+
+/*
+ * The child process inherits buffers from the parent after fork.
+ * They are still used by the parent so just unmap them and make
+ * new buffers (with new names) for the child.
+ */
+void reset_shmem_buffer(struct mcount_thread_data *mtdp)
+{
+	struct mcount_shmem *shmem = &mtdp->shmem;
+	int i;
+
+	pthread_mutex_init(&shmem_pool_lock, NULL);
+
+	for (i = 0; i < shmem_pool_nr; i++)
+		free_shmem_buffer(shmem_pool[i]);
+	shmem_pool_nr = 0;
+	shmem_pool_seq = 0;
+	shmem_pid = 0;
+
+	for (i = 0; i < shmem->nr_buf; i++)
+		free_shmem_buffer(shmem->buffer[i]);
 
 	free(shmem->buffer);
 	shmem->buffer = NULL;
 	shmem->nr_buf = 0;
+
+	prepare_shmem_buffer(mtdp);
 }
 
 void shmem_finish(struct mcount_thread_data *mtdp)
@@ -352,8 +566,8 @@ static int record_ret_stack(struct mcount_thread_data *mtdp,
 	struct ftrace_ret_stack *frstack;
 	uint64_t timestamp = mrstack->start_time;
 	struct mcount_shmem *shmem = &mtdp->shmem;
-	const size_t maxsize = (size_t)shmem_bufsize - sizeof(**shmem->buffer);
 	struct mcount_shmem_buffer *curr_buf = shmem->buffer[shmem->curr];
+	size_t maxsize = 0;
 	size_t size = sizeof(*frstack);
 	void *argbuf = NULL;
 	uint64_t *buf;
@@ -366,6 +580,9 @@ static int record_ret_stack(struct mcount_thread_data *mtdp,
 			size += *(unsigned *)argbuf;
 	}
 
+	if (shmem->curr != -1)
+		maxsize = curr_buf->alloc_size - sizeof(*curr_buf);
+
 	if (unlikely(shmem->curr == -1 || curr_buf->size + size > maxsize)) {
 		if (shmem->done)
 			return 0;
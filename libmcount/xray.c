@@ -0,0 +1,271 @@
+/*
+ * clang XRay sled handling routines for uftrace
+ *
+ * Binaries built with 'clang -fxray-instrument' have no mcount call but
+ * NOP sleds at the entry and exit of (large enough) functions.  The sled
+ * addresses are kept in the 'xray_instr_map' section so we can patch the
+ * entry sleds to call mcount_xray_entry() which goes to mcount_entry().
+ * Only the functions passing the -F/-N filters are patched so the others
+ * have no overhead at all (and their children are not hidden by -N).
+ * The sleds are patched again when the filters are changed at runtime.
+ * Exit sleds are left untouched since mcount_entry() hijacks the return
+ * address and function exits are handled by mcount_return as usual.
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <gelf.h>
+#include <sys/mman.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "mcount"
+#define PR_DOMAIN  DBG_MCOUNT
+
+#include "libmcount/mcount.h"
+#include "utils/utils.h"
+#include "utils/compiler.h"
+
+#define XRAY_SECT_NAME  "xray_instr_map"
+
+/* on-disk (and in-memory) layout of the xray_instr_map entry */
+struct xray_sled_entry {
+	uint64_t	address;
+	uint64_t	function;
+	unsigned char	kind;
+	unsigned char	always_instrument;
+	unsigned char	version;
+	unsigned char	padding[13];
+};
+
+static struct xray_sled *xray_sleds;
+static int xray_nr_sleds;
+
+static int xray_patch_sleds(unsigned long func, bool enable, bool filtered);
+
+static unsigned long xray_sled_addr(struct xray_sled_entry *entry,
+				    uint64_t *field)
+{
+	/* version 2 uses PC-relative addresses */
+	if (entry->version >= 2)
+		return (unsigned long)field + *field;
+
+	/* otherwise it's already relocated by the dynamic linker */
+	return *field;
+}
+
+static int read_xray_sleds(unsigned long map_addr, size_t map_size)
+{
+	struct xray_sled_entry *entry = (void *)map_addr;
+	int nr_entry = map_size / sizeof(*entry);
+	unsigned long last_func = 0;
+	int id = 0;
+	int i;
+
+	xray_sleds = xcalloc(nr_entry, sizeof(*xray_sleds));
+
+	for (i = 0; i < nr_entry; i++, entry++) {
+		struct xray_sled *sled = &xray_sleds[xray_nr_sleds];
+
+		sled->addr = xray_sled_addr(entry, &entry->address);
+		sled->func = xray_sled_addr(entry, &entry->function);
+
+		/* function id is assigned in the order of appearance */
+		if (sled->func != last_func) {
+			last_func = sled->func;
+			id++;
+		}
+
+		sled->id = id;
+		sled->kind = entry->kind;
+
+		/* only entry sleds are needed */
+		if (sled->kind != XRAY_SLED_ENTRY &&
+		    sled->kind != XRAY_SLED_LOG_ARGS_ENTRY)
+			continue;
+
+		pr_dbg3("xray sled: id %d at %#lx (func %#lx)\n",
+			sled->id, sled->addr, sled->func);
+		xray_nr_sleds++;
+	}
+
+	return xray_nr_sleds;
+}
+
+int mcount_setup_xray(char *exename, unsigned long offset)
+{
+	int fd;
+	int ret = -1;
+	Elf *elf;
+	GElf_Ehdr ehdr;
+	Elf_Scn *sec = NULL;
+	GElf_Shdr shdr;
+	size_t shstr_idx;
+	size_t i;
+
+	fd = open(exename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	elf_version(EV_CURRENT);
+
+	elf = elf_begin(fd, ELF_C_READ_MMAP, NULL);
+
+	if (gelf_getehdr(elf, &ehdr) == NULL)
+		goto elf_error;
+
+	if (elf_getshdrstrndx(elf, &shstr_idx) < 0)
+		goto elf_error;
+
+	/* convert the map start address to the load offset */
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		GElf_Phdr phdr;
+
+		if (gelf_getphdr(elf, i, &phdr) == NULL)
+			goto elf_error;
+
+		if (phdr.p_type == PT_LOAD) {
+			offset -= phdr.p_vaddr;
+			break;
+		}
+	}
+
+	while ((sec = elf_nextscn(elf, sec)) != NULL) {
+		char *shstr;
+
+		if (gelf_getshdr(sec, &shdr) == NULL)
+			goto elf_error;
+
+		shstr = elf_strptr(elf, shstr_idx, shdr.sh_name);
+		if (shstr && !strcmp(shstr, XRAY_SECT_NAME))
+			break;
+	}
+
+	if (sec == NULL) {
+		pr_dbg2("no xray sleds found in %s\n", exename);
+		goto out;
+	}
+
+	/* read relocated entries from the memory, not the file */
+	if (read_xray_sleds(shdr.sh_addr + offset, shdr.sh_size) > 0)
+		ret = xray_patch_sleds(0, true, true);
+
+	pr_dbg("found %d xray entry sleds\n", xray_nr_sleds);
+
+out:
+	elf_end(elf);
+	close(fd);
+
+	return ret;
+
+elf_error:
+	pr_dbg("%s\n", elf_errmsg(elf_errno()));
+
+	goto out;
+}
+
+__weak int mcount_arch_xray_patch(struct xray_sled *sled, bool enable)
+{
+	return -1;
+}
+
+static int xray_set_prot(int prot)
+{
+	unsigned long page = getpagesize();
+	unsigned long start = xray_sleds[0].addr;
+	unsigned long end = xray_sleds[xray_nr_sleds - 1].addr;
+	int i;
+
+	/* sleds are usually sorted but make sure of it */
+	for (i = 0; i < xray_nr_sleds; i++) {
+		if (start > xray_sleds[i].addr)
+			start = xray_sleds[i].addr;
+		if (end < xray_sleds[i].addr)
+			end = xray_sleds[i].addr;
+	}
+
+	start &= ~(page - 1);
+	/* a sled can cross the page boundary */
+	end = ALIGN(end + 16, page);
+
+	if (mprotect((void *)start, end - start, prot) < 0) {
+		pr_dbg("cannot change protection of xray sleds: %m\n");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Patch (or unpatch) entry sleds of the given function.
+ * If @func is 0, all sleds are changed.  If @filtered, only the sleds
+ * passing the current filters are patched and the others are unpatched.
+ */
+static int xray_patch_sleds(unsigned long func, bool enable, bool filtered)
+{
+	unsigned long last_func = 0;
+	bool selected = true;
+	bool target;
+	int i;
+	int ret = 0;
+
+	if (xray_nr_sleds == 0)
+		return -1;
+
+	if (xray_set_prot(PROT_READ | PROT_WRITE | PROT_EXEC) < 0)
+		return -1;
+
+	for (i = 0; i < xray_nr_sleds; i++) {
+		struct xray_sled *sled = &xray_sleds[i];
+
+		if (func && sled->func != func)
+			continue;
+
+		/* sleds of a function are next to each other */
+		if (filtered && sled->func != last_func) {
+			selected = mcount_check_filter(sled->func);
+			last_func = sled->func;
+		}
+		target = enable && selected;
+		if (sled->patched == target)
+			continue;
+
+		if (mcount_arch_xray_patch(sled, target) < 0) {
+			pr_dbg("cannot patch xray sled at %#lx\n", sled->addr);
+			ret = -1;
+			break;
+		}
+		sled->patched = target;
+	}
+
+	xray_set_prot(PROT_READ | PROT_EXEC);
+	return ret;
+}
+
+int mcount_xray_patch(unsigned long func, bool enable)
+{
+	return xray_patch_sleds(func, enable, false);
+}
+
+/* re-patch the sleds after the filters are changed by 'uftrace control' */
+int mcount_xray_update(void)
+{
+	if (xray_nr_sleds == 0)
+		return 0;
+
+	return xray_patch_sleds(0, true, true);
+}
+
+void mcount_finish_xray(void)
+{
+	if (xray_nr_sleds == 0)
+		return;
+
+	mcount_xray_patch(0, false);
+
+	free(xray_sleds);
+	xray_sleds = NULL;
+	xray_nr_sleds = 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * This is test to change the filter of a running program.
+ * It calls a() and then waits for the given file before calling b().
+ */
+#include <unistd.h>
+
+volatile int count;
+
+void a(void)
+{
+	count++;
+}
+
+void b(void)
+{
+	count--;
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	a();
+
+	/* wait until the filter is changed (at most 5 sec) */
+	for (i = 0; i < 500; i++) {
+		if (argc < 2 || access(argv[1], F_OK) == 0)
+			break;
+		usleep(10000);
+	}
+
+	b();
+	return 0;
+}
@@ -0,0 +1,34 @@
+#!/usr/bin/env python
+
+import re
+import subprocess as sp
+from runtest import TestBase
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+# DURATION    TID     FUNCTION
+            [28141] | a() {
+            [28141] |   c() {
+   0.753 us [28141] |     getpid();
+   1.430 us [28141] |   } /* c */
+   2.405 us [28141] | } /* a */
+""", sort='simple')
+
+    def build(self, name, cflags='', ldflags=''):
+        # only the functions passing the filter are patched (b is not)
+        build_cflags = ' '.join(TestBase.default_cflags + re.findall('-O\w', cflags) +
+                                ['-fxray-instrument', '-fxray-instruction-threshold=1'])
+        build_cmd = 'clang -o t-xray-%s %s s-%s.c' % (name, build_cflags, name)
+
+        self.pr_debug("build command: %s" % build_cmd)
+        try:
+            if sp.call(build_cmd.split(), stdout=sp.PIPE, stderr=sp.PIPE) != 0:
+                return TestBase.TEST_SKIP
+            return TestBase.TEST_SUCCESS
+        except:
+            # clang is not available
+            return TestBase.TEST_SKIP
+
+    def runcmd(self):
+        return '%s -F a -F c %s' % (TestBase.ftrace, 't-xray-abc')
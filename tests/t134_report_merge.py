@@ -0,0 +1,43 @@
+#!/usr/bin/env python
+
+import re
+from runtest import TestBase
+import subprocess as sp
+
+TDIRS=['merge-1.data', 'merge-2.data']
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'abc', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================================
+    3.962 us    0.556 us           2  <build-id+offset>
+    3.406 us    0.412 us           2  <build-id+offset>
+    2.994 us    1.289 us           2  <build-id+offset>
+    1.705 us    0.872 us           2  <build-id+offset>
+""", sort='report')
+
+    def pre(self):
+        # functions in the stripped binary are matched by build-id and offset
+        if sp.call(['strip', '-o', 't-abc-strip', 't-abc']) != 0:
+            return TestBase.TEST_SKIP
+
+        for tdir in TDIRS:
+            record_cmd = '%s record -d %s %s' % (TestBase.ftrace, tdir, 't-abc-strip')
+            sp.call(record_cmd.split())
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s report --merge %s' % (TestBase.ftrace, ' '.join(TDIRS))
+
+    def post(self, ret):
+        olds = [tdir + '.old' for tdir in TDIRS]
+        sp.call(['rm', '-rf', 't-abc-strip'] + TDIRS + olds)
+        return ret
+
+    def sort(self, output, ignore_children=False):
+        # build-id is 40 hex digits, library functions are not checked
+        output = re.sub('<[0-9a-f]{40}\+0x[0-9a-f]+>', '<build-id+offset>', output)
+        output = '\n'.join([ln for ln in output.split('\n')
+                            if '<build-id+offset>' in ln])
+        return TestBase.sort(self, output, ignore_children)
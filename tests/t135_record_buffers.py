@@ -0,0 +1,44 @@
+#!/usr/bin/env python
+
+from runtest import TestBase
+import subprocess as sp
+
+TDIR='buffers.data'
+
+# fib(25) calls fib more than 70000 times (even with -O2) so the records
+# span several shmem buffers (a 128KB buffer can keep 4096 calls).
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'fibonacci', """
+  Total time   Self time       Calls  Function
+  ==========  ==========  ==========  ====================================
+   78.371 ms   78.371 ms      242785  fib
+""")
+
+    def pre(self):
+        record_cmd = '%s record -d %s %s 25' % (TestBase.ftrace, TDIR, 't-' + self.name)
+        if sp.call(record_cmd.split()) != 0:
+            return TestBase.TEST_NONZERO_RETURN
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s report -d %s' % (TestBase.ftrace, TDIR)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR, TDIR + '.old'])
+        return ret
+
+    def sort(self, output):
+        """ This function post-processes output of the test to be compared.
+            It checks the most called function spans several buffers. """
+        calls = 0
+        for ln in output.split('\n'):
+            line = ln.split()
+            if len(line) < 6 or not line[4].isdigit():
+                continue
+            # A report line consists of following data
+            # [0]         [1]   [2]        [3]   [4]    [5]
+            # total_time  unit  self_time  unit  calls  function
+            calls = max(calls, int(line[4]))
+
+        return 'many calls' if calls > 5 * 4096 else str(calls)
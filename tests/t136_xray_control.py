@@ -0,0 +1,66 @@
+#!/usr/bin/env python
+
+import os
+import re
+import time
+import subprocess as sp
+from runtest import TestBase
+
+TDIR='xray-control.data'
+DONE='xray-control.done'
+
+class TestCase(TestBase):
+    def __init__(self):
+        TestBase.__init__(self, 'control', """
+# DURATION    TID     FUNCTION
+   0.231 us [28141] | a();
+   0.186 us [28141] | b();
+""", sort='simple')
+
+    def build(self, name, cflags='', ldflags=''):
+        build_cflags = ' '.join(TestBase.default_cflags + re.findall('-O\w', cflags) +
+                                ['-fxray-instrument', '-fxray-instruction-threshold=1'])
+        build_cmd = 'clang -o t-xray-%s %s s-%s.c' % (name, build_cflags, name)
+
+        self.pr_debug("build command: %s" % build_cmd)
+        try:
+            if sp.call(build_cmd.split(), stdout=sp.PIPE, stderr=sp.PIPE) != 0:
+                return TestBase.TEST_SKIP
+            return TestBase.TEST_SUCCESS
+        except:
+            # clang is not available
+            return TestBase.TEST_SKIP
+
+    def pre(self):
+        sp.call(['rm', '-rf', TDIR, DONE])
+
+        # only a() is patched at first, and then only b() after the control
+        record_cmd = '%s record -d %s -F a %s %s' % \
+                     (TestBase.ftrace, TDIR, 't-xray-' + self.name, DONE)
+        p = sp.Popen(record_cmd.split())
+
+        # wait for the session to be ready
+        for i in range(50):
+            if os.path.isdir(TDIR) and \
+               any(f.startswith('sid-') for f in os.listdir(TDIR)):
+                break
+            time.sleep(0.1)
+        time.sleep(0.5)
+
+        control_cmd = '%s control -d %s -F b' % (TestBase.ftrace, TDIR)
+        sp.call(control_cmd.split())
+
+        # give the control thread a chance to apply it
+        time.sleep(0.5)
+        open(DONE, 'w').close()
+
+        if p.wait() != 0:
+            return TestBase.TEST_NONZERO_RETURN
+        return TestBase.TEST_SUCCESS
+
+    def runcmd(self):
+        return '%s replay -d %s' % (TestBase.ftrace, TDIR)
+
+    def post(self, ret):
+        sp.call(['rm', '-rf', TDIR, TDIR + '.old', DONE])
+        return ret
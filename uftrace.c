@@ -84,6 +84,18 @@ enum options {
 	OPT_kernel_skip_out,
 	OPT_kernel_full,
 	OPT_kernel_only,
+	OPT_buffer_limit,
+	OPT_jobs,
+	OPT_container,
+	OPT_perfetto,
+	OPT_percentile,
+	OPT_histogram,
+	OPT_call_path,
+	OPT_follow,
+	OPT_merge,
+	OPT_interval,
+	OPT_top,
+	OPT_no_cache,
 };
 
 static struct argp_option ftrace_options[] = {
@@ -99,6 +111,7 @@ static struct argp_option ftrace_options[] = {
 	{ "no-libcall", OPT_no_libcall, 0, 0, "Don't trace library function calls" },
 	{ "symbols", OPT_symbols, 0, 0, "Print symbol tables" },
 	{ "buffer", 'b', "SIZE", 0, "Size of tracing buffer" },
+	{ "buffer-limit", OPT_buffer_limit, "SIZE", 0, "Limit total size of tracing buffers" },
 	{ "logfile", OPT_logfile, "FILE", 0, "Save log messages to this file" },
 	{ "force", OPT_force, 0, 0, "Trace even if executable is not instrumented" },
 	{ "threads", OPT_threads, 0, 0, "Report thread stats instead" },
@@ -142,6 +155,17 @@ static struct argp_option ftrace_options[] = {
 	{ "sample-time", OPT_sample_time, "TIME", 0, "Show flame graph with this sampliing time" },
 	{ "output-fields", 'f', "FIELD", 0, "Show FIELDs in the replay output" },
 	{ "time-range", 'r', "TIME~TIME", 0, "Show output within the TIME(timestamp or elapsed time) range only" },
+	{ "jobs", OPT_jobs, "NUM", 0, "Analyze data with NUM processes in parallel" },
+	{ "container", OPT_container, 0, 0, "Save task data in a few segment files" },
+	{ "perfetto", OPT_perfetto, 0, 0, "Dump recorded data in perfetto (protobuf) format" },
+	{ "percentile", OPT_percentile, "PCT[,PCT,...]", 0, "Show function time at the PCTth percentiles" },
+	{ "histogram", OPT_histogram, 0, 0, "Show histogram of function time" },
+	{ "call-path", OPT_call_path, "NUM", OPTION_ARG_OPTIONAL, "Show NUM hottest call paths (default: 10)" },
+	{ "follow", OPT_follow, 0, 0, "Keep reading data being recorded" },
+	{ "merge", OPT_merge, 0, 0, "Merge reports of data directories given as arguments" },
+	{ "interval", OPT_interval, "TIME", 0, "Show function statistics in each TIME interval" },
+	{ "top", OPT_top, "NUM", 0, "Show NUM functions in each interval (default: 10)" },
+	{ "no-cache", OPT_no_cache, 0, 0, "Don't use report cache in the data directory" },
 	{ 0 }
 };
 
@@ -675,10 +699,72 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 		}
 		break;
 
+	case OPT_jobs:
+		opts->nr_jobs = strtol(arg, NULL, 0);
+		if (opts->nr_jobs < 0) {
+			pr_use("invalid job number: %s\n", arg);
+			opts->nr_jobs = 0;
+		}
+		break;
+
+	case OPT_container:
+		opts->container = true;
+		break;
+
+	case OPT_perfetto:
+		opts->perfetto = true;
+		/* binary output */
+		opts->use_pager = false;
+		break;
+
+	case OPT_percentile:
+		opts->percentile = opt_add_string(opts->percentile, arg);
+		break;
+
+	case OPT_histogram:
+		opts->histogram = true;
+		break;
+
+	case OPT_call_path:
+		opts->call_path = arg ? strtol(arg, NULL, 0) : 10;
+		if (opts->call_path <= 0) {
+			pr_use("invalid number of call paths: %s\n", arg);
+			opts->call_path = 10;
+		}
+		break;
+
+	case OPT_follow:
+		opts->follow = true;
+		/* output is shown as data comes */
+		opts->use_pager = false;
+		break;
+
+	case OPT_merge:
+		opts->merge = true;
+		break;
+
+	case OPT_interval:
+		opts->interval = parse_time(arg, 9);
+		if (opts->interval == 0)
+			pr_use("invalid interval: %s\n", arg);
+		break;
+
+	case OPT_top:
+		opts->top = strtol(arg, NULL, 0);
+		if (opts->top <= 0) {
+			pr_use("invalid number of functions: %s\n", arg);
+			opts->top = 0;
+		}
+		break;
+
 	case OPT_no_comment:
 		opts->comment = false;
 		break;
 
+	case OPT_no_cache:
+		opts->no_cache = true;
+		break;
+
 	case OPT_libmcount_single:
 		opts->libmcount_single = true;
 		break;
@@ -702,6 +788,10 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 		}
 		break;
 
+	case OPT_buffer_limit:
+		opts->buffer_limit = parse_size(arg);
+		break;
+
 	case OPT_kernel_skip_out:
 		opts->kernel = true;
 		opts->kernel_skip_out = true;
@@ -746,6 +836,8 @@ static error_t parse_option(int key, char *arg, struct argp_state *state)
 			opts->mode = UFTRACE_MODE_DUMP;
 		else if (!strcmp("graph", arg))
 			opts->mode = UFTRACE_MODE_GRAPH;
+		else if (!strcmp("control", arg))
+			opts->mode = UFTRACE_MODE_CONTROL;
 		else
 			return ARGP_ERR_UNKNOWN; /* almost same as fall through */
 		break;
@@ -806,7 +898,7 @@ int main(int argc, char *argv[])
 	struct argp argp = {
 		.options = ftrace_options,
 		.parser = parse_option,
-		.args_doc = "[record|replay|live|report|info|dump|recv|graph] [<program>]",
+		.args_doc = "[record|replay|live|report|info|dump|recv|graph|control] [<program>]",
 		.doc = "uftrace -- function (graph) tracer for userspace",
 	};
 	int ret = -1;
@@ -876,6 +968,9 @@ int main(int argc, char *argv[])
 	case UFTRACE_MODE_GRAPH:
 		ret = command_graph(argc, argv, &opts);
 		break;
+	case UFTRACE_MODE_CONTROL:
+		ret = command_control(argc, argv, &opts);
+		break;
 	case UFTRACE_MODE_INVALID:
 		ret = 1;
 		break;
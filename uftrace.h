@@ -49,6 +49,7 @@ enum ftrace_feat_bits {
 	RETVAL_BIT,
 	SYM_REL_ADDR_BIT,
 	MAX_STACK_BIT,
+	DATA_CONTAINER_BIT,
 
 	/* bit mask */
 	PLTHOOK			= (1U << PLTHOOK_BIT),
@@ -58,6 +59,7 @@ enum ftrace_feat_bits {
 	RETVAL			= (1U << RETVAL_BIT),
 	SYM_REL_ADDR		= (1U << SYM_REL_ADDR_BIT),
 	MAX_STACK		= (1U << MAX_STACK_BIT),
+	DATA_CONTAINER		= (1U << DATA_CONTAINER_BIT),
 };
 
 enum ftrace_info_bits {
@@ -112,6 +114,9 @@ enum {
 
 struct ftrace_kernel;
 
+struct uftrace_chunk_file;
+struct task_stream_pool;
+
 struct ftrace_file_handle {
 	FILE *fp;
 	int sock;
@@ -126,6 +131,12 @@ struct ftrace_file_handle {
 	bool needs_bit_swap;
 	uint64_t time_filter;
 	struct uftrace_time_range time_range;
+	struct uftrace_chunk_file *chunks;
+	/* shared fds and buffers to read task data */
+	struct task_stream_pool *streams;
+	/* data is still being recorded (--follow) */
+	bool follow;
+	long task_pos;		/* offset of task.txt read so far */
 };
 
 #define UFTRACE_MODE_INVALID 0
@@ -137,6 +148,7 @@ struct ftrace_file_handle {
 #define UFTRACE_MODE_RECV    6
 #define UFTRACE_MODE_DUMP    7
 #define UFTRACE_MODE_GRAPH   8
+#define UFTRACE_MODE_CONTROL 9
 
 #define UFTRACE_MODE_DEFAULT  UFTRACE_MODE_LIVE
 
@@ -154,6 +166,7 @@ struct opts {
 	char *retval;
 	char *diff;
 	char *fields;
+	char *percentile;
 	int mode;
 	int idx;
 	int depth;
@@ -164,11 +177,16 @@ struct opts {
 	int column_offset;
 	int sort_column;
 	int nr_thread;
+	int nr_jobs;
+	int call_path;
+	int top;
 	int rt_prio;
 	unsigned long bufsize;
+	unsigned long buffer_limit;
 	unsigned long kernel_bufsize;
 	uint64_t threshold;
 	uint64_t sample_time;
+	uint64_t interval;
 	bool flat;
 	bool libcall;
 	bool print_symtab;
@@ -193,6 +211,12 @@ struct opts {
 	bool kernel;
 	bool kernel_skip_out;
 	bool kernel_only;
+	bool container;
+	bool perfetto;
+	bool histogram;
+	bool follow;
+	bool merge;
+	bool no_cache;
 	struct uftrace_time_range range;
 };
 
@@ -210,6 +234,7 @@ int command_info(int argc, char *argv[], struct opts *opts);
 int command_recv(int argc, char *argv[], struct opts *opts);
 int command_dump(int argc, char *argv[], struct opts *opts);
 int command_graph(int argc, char *argv[], struct opts *opts);
+int command_control(int argc, char *argv[], struct opts *opts);
 
 extern volatile bool uftrace_done;
 extern struct ftrace_proc_maps *proc_maps;
@@ -218,6 +243,7 @@ int open_data_file(struct opts *opts, struct ftrace_file_handle *handle);
 void close_data_file(struct opts *opts, struct ftrace_file_handle *handle);
 int read_task_file(char *dirname, bool needs_session, bool sym_rel_addr);
 int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr);
+int follow_data_file(struct ftrace_file_handle *handle);
 
 struct ftrace_session {
 	struct rb_node		 node;
@@ -309,6 +335,8 @@ void create_session(struct ftrace_msg_sess *msg, char *dirname, char *exename,
 		    bool sym_rel_addr);
 struct ftrace_session *find_session(int pid, uint64_t timestamp);
 struct ftrace_session *find_task_session(int pid, uint64_t timestamp);
+struct ftrace_session *find_task_session_range(int pid, uint64_t timestamp,
+					       uint64_t *start, uint64_t *end);
 void create_task(struct ftrace_msg_task *msg, bool fork, bool needs_session);
 struct ftrace_task *find_task(int tid);
 void read_session_map(char *dirname, struct symtabs *symtabs, char *sid);
@@ -316,8 +344,8 @@ struct ftrace_session * get_session_from_sid(char sid[]);
 void session_add_dlopen(struct ftrace_session *sess, const char *dirname,
 			uint64_t timestamp, unsigned long base_addr,
 			const char *libname);
-struct sym * session_find_dlsym(struct ftrace_session *sess, uint64_t timestamp,
-				unsigned long addr);
+struct sym * session_find_sym(struct ftrace_session *sess, uint64_t timestamp,
+			      unsigned long addr);
 
 typedef int (*walk_sessions_cb_t)(struct ftrace_session *session, void *arg);
 void walk_sessions(walk_sessions_cb_t callback, void *arg);
@@ -342,6 +370,11 @@ void write_task_info(const char *dirname, struct ftrace_msg_task *tmsg);
 void write_fork_info(const char *dirname, struct ftrace_msg_task *tmsg);
 void write_session_info(const char *dirname, struct ftrace_msg_sess *smsg,
 			const char *exename);
+void write_task_index(const char *dirname, int tid, uint64_t offset,
+		      void *data, size_t len);
+void write_task_chunk(const char *dirname, int seg, int tid,
+		      void *data, size_t len);
+FILE *open_task_data(struct ftrace_file_handle *handle, int tid);
 void write_dlopen_info(const char *dirname, struct ftrace_msg_dlopen *dmsg,
 		       const char *libname);
 
@@ -365,6 +398,72 @@ struct ftrace_ret_stack {
 	uint64_t addr:   48;
 };
 
+/*
+ * Sparse index of the task data file (<tid>.idx) to find a record at
+ * the given time quickly.  The recorder adds an entry for each buffer
+ * written with the time of the first ENTRY or EXIT record in the buffer.
+ */
+struct uftrace_index_entry {
+	uint64_t time;
+	uint64_t offset;	/* file offset of the buffer */
+};
+
+/*
+ * Function index of the task data file (<tid>.fidx).  The data is split
+ * into segments of records and each segment keeps the call stack at the
+ * start and (sorted) addresses of functions called in the segment.
+ * The last segment is at the end of the data and has no functions.
+ * The saved call stack also serves as a checkpoint to start reading
+ * the data from the middle of the file.
+ */
+#define UFTRACE_FIDX_MAGIC  "Fidx-v2"
+
+struct uftrace_func_index_header {
+	char magic[8];
+	uint64_t data_size;	/* to check the data file was changed */
+	uint32_t nr_segs;
+	uint32_t unused;
+};
+
+struct uftrace_func_index_frame {
+	uint64_t addr;
+	uint64_t time;		/* function entry time */
+	uint64_t child_time;	/* time of returned children */
+};
+
+/* followed by frames and function addresses */
+struct uftrace_func_index_seg {
+	uint64_t offset;	/* file offset of the first record */
+	uint64_t time;		/* timestamp of the first record */
+	uint32_t nr_frames;
+	uint32_t nr_funcs;
+};
+
+/*
+ * Task data can be saved in a few segment files (data-<N>.seg) instead
+ * of a file per task (<tid>.dat).  Each chunk in a segment file has a
+ * header and the chunk index file (data-<N>.cidx) has an entry for
+ * each chunk to find chunks of a task without reading segment files.
+ * The sequence number is global so it keeps the order of chunks of a
+ * task even if they're written to different segments.
+ */
+#define UFTRACE_CHUNK_MAGIC  0x6b6e6863  /* "chnk" */
+
+struct uftrace_chunk_header {
+	uint32_t magic;
+	int32_t  tid;
+	uint64_t seq;
+	uint64_t len;		/* length of data after the header */
+};
+
+struct uftrace_chunk_index {
+	int32_t  tid;
+	uint32_t unused;
+	uint64_t seq;
+	uint64_t offset;	/* file offset of the data */
+	uint64_t len;
+};
+
 static inline bool is_v3_compat(struct ftrace_ret_stack *stack)
 {
 	/* (RECORD_MAGIC_V4 << 1 | more) == RECORD_MAGIC_V3 */
@@ -14,4 +14,8 @@
 #define __weak  __attribute__((weak))
 #define __visible_default  __attribute__((visibility("default")))
 
+#ifndef __always_inline
+# define __always_inline  inline __attribute__((always_inline))
+#endif
+
 #endif /* __FTRACE_COMPILER_H__ */
@@ -0,0 +1,217 @@
+/*
+ * control block routines for uftrace
+ *
+ * The control block is a shared memory between 'uftrace control' and
+ * libmcount in a running process.  The writer makes the seqnum odd
+ * during the update so that the reader can check whether it read a
+ * consistent copy.  The reader sleeps on the seqnum using futex and
+ * the writer wakes it up after the update.
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "control"
+#define PR_DOMAIN  DBG_MCOUNT
+
+#include "utils/utils.h"
+#include "utils/control.h"
+
+#define CONTROL_DATA_MAX  (MCOUNT_CONTROL_SIZE - sizeof(struct mcount_control))
+
+int write_control(struct mcount_control *ctrl, struct control_setting *cs)
+{
+	char *filter = cs->filter ?: "";
+	char *trigger = cs->trigger ?: "";
+	unsigned flen = strlen(filter) + 1;
+	unsigned tlen = strlen(trigger) + 1;
+
+	if (flen + tlen > CONTROL_DATA_MAX)
+		return -1;
+
+	/* make the seqnum odd during the update */
+	ctrl->seqnum++;
+	__sync_synchronize();
+
+	ctrl->flags = cs->flags;
+	ctrl->depth = cs->depth;
+	ctrl->threshold = cs->threshold;
+	ctrl->filter_len = flen;
+	ctrl->trigger_len = tlen;
+
+	memcpy(ctrl->data, filter, flen);
+	memcpy(ctrl->data + flen, trigger, tlen);
+
+	__sync_synchronize();
+	ctrl->seqnum++;
+
+	wake_control(ctrl);
+	return 0;
+}
+
+/**
+ * wait_control - wait for a new setting in the control block
+ * @ctrl: control block
+ * @seqnum: seqnum of the last setting read
+ *
+ * This function returns when the seqnum is changed from @seqnum and the
+ * update is done.  It might return early on a spurious wakeup so the
+ * caller should check the seqnum again.
+ */
+void wait_control(struct mcount_control *ctrl, unsigned seqnum)
+{
+	unsigned seq = ctrl->seqnum;
+
+	if (seq != seqnum && !(seq & 1))
+		return;
+
+	/* the control block is shared with other processes (not private) */
+	syscall(SYS_futex, &ctrl->seqnum, FUTEX_WAIT, seq, NULL, NULL, 0);
+}
+
+void wake_control(struct mcount_control *ctrl)
+{
+	syscall(SYS_futex, &ctrl->seqnum, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static bool check_control_str(char *str, unsigned len)
+{
+	return len > 0 && str[len - 1] == '\0';
+}
+
+/**
+ * read_control - read a new setting in the control block
+ * @ctrl: control block
+ * @seqnum: seqnum of the last setting read
+ * @cs: new setting
+ *
+ * This function returns 1 if a new setting is read into @cs, 0 if it's
+ * not changed or being updated, and -1 if the new data is invalid.
+ * @seqnum is updated unless it returns 0 so an invalid data is not read
+ * again.  The strings in @cs should be freed by free_control_setting().
+ */
+int read_control(struct mcount_control *ctrl, unsigned *seqnum,
+		 struct control_setting *cs)
+{
+	struct mcount_control copy;
+	char *data = NULL;
+	size_t len;
+	unsigned seq;
+	int ret = -1;
+
+	seq = ctrl->seqnum;
+	if (seq == *seqnum || (seq & 1))
+		return 0;
+
+	__sync_synchronize();
+	memcpy(&copy, ctrl, sizeof(copy));
+	len = (size_t)copy.filter_len + copy.trigger_len;
+	if (len <= CONTROL_DATA_MAX) {
+		data = xmalloc(len);
+		memcpy(data, ctrl->data, len);
+	}
+	__sync_synchronize();
+
+	/* it's changed during the copy, try again later */
+	if (ctrl->seqnum != seq) {
+		free(data);
+		return 0;
+	}
+
+	*seqnum = seq;
+	memset(cs, 0, sizeof(*cs));
+
+	if (data == NULL ||
+	    !check_control_str(data, copy.filter_len) ||
+	    !check_control_str(data + copy.filter_len, copy.trigger_len))
+		goto out;
+
+	cs->flags = copy.flags;
+	cs->depth = copy.depth;
+	cs->threshold = copy.threshold;
+
+	if (data[0])
+		cs->filter = xstrdup(data);
+	if (data[copy.filter_len])
+		cs->trigger = xstrdup(data + copy.filter_len);
+
+	ret = 1;
+
+out:
+	free(data);
+	return ret;
+}
+
+void free_control_setting(struct control_setting *cs)
+{
+	free(cs->filter);
+	free(cs->trigger);
+	cs->filter = NULL;
+	cs->trigger = NULL;
+}
+
+#ifdef UNIT_TEST
+TEST_CASE(control_block)
+{
+	struct mcount_control *ctrl = xzalloc(MCOUNT_CONTROL_SIZE);
+	struct control_setting in = {
+		.flags     = MCOUNT_CTRL_FILTER | MCOUNT_CTRL_DEPTH,
+		.depth     = 3,
+		.filter    = "foo;bar@libabc",
+	};
+	struct control_setting out;
+	unsigned seqnum = 0;
+
+	/* nothing written yet */
+	TEST_EQ(read_control(ctrl, &seqnum, &out), 0);
+
+	TEST_EQ(write_control(ctrl, &in), 0);
+	TEST_EQ(ctrl->seqnum, 2U);
+
+	TEST_EQ(read_control(ctrl, &seqnum, &out), 1);
+	TEST_EQ(seqnum, 2U);
+	TEST_EQ(out.flags, in.flags);
+	TEST_EQ(out.depth, 3);
+	TEST_STREQ(out.filter, "foo;bar@libabc");
+	TEST_EQ(out.trigger, NULL);
+	free_control_setting(&out);
+
+	/* read once */
+	TEST_EQ(read_control(ctrl, &seqnum, &out), 0);
+
+	/* should not block if there's a new setting */
+	wait_control(ctrl, 0);
+
+	/* being updated */
+	ctrl->seqnum++;
+	TEST_EQ(read_control(ctrl, &seqnum, &out), 0);
+	ctrl->seqnum++;
+
+	/* broken string should be ignored (only once) */
+	ctrl->data[ctrl->filter_len - 1] = 'x';
+	TEST_EQ(read_control(ctrl, &seqnum, &out), -1);
+	TEST_EQ(seqnum, 4U);
+	TEST_EQ(out.filter, NULL);
+	TEST_EQ(read_control(ctrl, &seqnum, &out), 0);
+
+	/* too long */
+	ctrl->seqnum += 2;
+	ctrl->filter_len = MCOUNT_CONTROL_SIZE;
+	TEST_EQ(read_control(ctrl, &seqnum, &out), -1);
+
+	in.filter = xzalloc(MCOUNT_CONTROL_SIZE);
+	memset(in.filter, 'a', MCOUNT_CONTROL_SIZE - 1);
+	TEST_EQ(write_control(ctrl, &in), -1);
+	free(in.filter);
+
+	free(ctrl);
+	return TEST_OK;
+}
+#endif /* UNIT_TEST */
@@ -0,0 +1,50 @@
+#ifndef __FTRACE_CONTROL_H__
+#define __FTRACE_CONTROL_H__
+
+#include <stdint.h>
+
+#define MCOUNT_CONTROL_FMT   "/uftrace-%s-control"  /* session-id */
+#define MCOUNT_CONTROL_SIZE  (16 * 1024)
+
+enum mcount_control_flags {
+	MCOUNT_CTRL_FILTER	= (1U << 0),
+	MCOUNT_CTRL_TRIGGER	= (1U << 1),
+	MCOUNT_CTRL_DEPTH	= (1U << 2),
+	MCOUNT_CTRL_THRESHOLD	= (1U << 3),
+};
+
+/*
+ * Control block to change filter settings of a running process.
+ * The 'uftrace control' command writes new settings and updates the
+ * seqnum (it's odd during the update) and wakes up a separate thread
+ * in libmcount waiting on the seqnum.  The data contains the filter and trigger strings
+ * (NUL-terminated) in a row.
+ */
+struct mcount_control {
+	unsigned	seqnum;
+	unsigned	flags;
+	int		depth;
+	unsigned	filter_len;
+	uint64_t	threshold;
+	unsigned	trigger_len;
+	unsigned	unused;
+	char		data[];
+};
+
+/* a setting in the control block (strings are NULL if empty) */
+struct control_setting {
+	unsigned	flags;
+	int		depth;
+	uint64_t	threshold;
+	char		*filter;
+	char		*trigger;
+};
+
+int write_control(struct mcount_control *ctrl, struct control_setting *cs);
+int read_control(struct mcount_control *ctrl, unsigned *seqnum,
+		 struct control_setting *cs);
+void free_control_setting(struct control_setting *cs);
+void wait_control(struct mcount_control *ctrl, unsigned seqnum);
+void wake_control(struct mcount_control *ctrl);
+
+#endif /* __FTRACE_CONTROL_H__ */
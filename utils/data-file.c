@@ -7,12 +7,18 @@
 #include <errno.h>
 #include <limits.h>
 #include <assert.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
 
 #include "uftrace.h"
 #include "utils/utils.h"
 #include "utils/fstack.h"
 #include "libmcount/mcount.h"
 
+/* time to wait for new data in --follow mode */
+#define FOLLOW_INTERVAL_USEC  (100 * 1000)
 
 /**
  * read_task_file - read 'task' file from data directory
@@ -84,44 +90,42 @@ int read_task_file(char *dirname, bool needs_session, bool sym_rel_addr)
 	return 0;
 }
 
-/**
- * read_task_txt_file - read 'task.txt' file from data directory
- * @dirname: name of the data directory
- * @needs_session: read session info too
- * @sym_rel_addr: whethere symbol address is relative
- *
- * This function read the task.txt file in the @dirname and build task
- * (and session when @needs_session is %true) information.
- *
- * It returns 0 for success, -1 for error.
+static void add_task_info(struct ftrace_info *info, int tid)
+{
+	info->tids = xrealloc(info->tids, (info->nr_tid + 1) * sizeof(*info->tids));
+	info->tids[info->nr_tid++] = tid;
+}
+
+/*
+ * read lines in the task.txt file and build task and session info.
+ * It adds new tasks to @info (if not NULL) and stops at an incomplete
+ * line since the file might be written at the same time.
  */
-int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr)
+static void read_task_txt(FILE *fp, char *dirname, bool needs_session,
+			  bool sym_rel_addr, struct ftrace_info *info)
 {
-	FILE *fp;
-	char *fname = NULL;
 	char *line = NULL;
 	size_t sz = 0;
+	ssize_t len;
 	long sec, nsec;
 	struct ftrace_msg_task task;
 	struct ftrace_msg_sess sess;
 	struct ftrace_msg_dlopen dlop;
 	char *exename, *pos;
 
-	xasprintf(&fname, "%s/%s", dirname, "task.txt");
-
-	fp = fopen(fname, "r");
-	if (fp == NULL) {
-		free(fname);
-		return -errno;
-	}
+	while ((len = getline(&line, &sz, fp)) >= 0) {
+		if (len == 0 || line[len - 1] != '\n') {
+			fseek(fp, -len, SEEK_CUR);
+			break;
+		}
 
-	pr_dbg("reading %s file\n", fname);
-	while (getline(&line, &sz, fp) >= 0) {
 		if (!strncmp(line, "TASK", 4)) {
 			sscanf(line + 5, "timestamp=%lu.%lu tid=%d pid=%d",
 			       &sec, &nsec, &task.tid, &task.pid);
 
 			task.time = (uint64_t)sec * NSEC_PER_SEC + nsec;
+			if (info && find_task(task.tid) == NULL)
+				add_task_info(info, task.tid);
 			create_task(&task, false, needs_session);
 		}
 		else if (!strncmp(line, "FORK", 4)) {
@@ -129,6 +133,8 @@ int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr)
 			       &sec, &nsec, &task.tid, &task.pid);
 
 			task.time = (uint64_t)sec * NSEC_PER_SEC + nsec;
+			if (info && find_task(task.tid) == NULL)
+				add_task_info(info, task.tid);
 			create_task(&task, true, needs_session);
 		}
 		else if (!strncmp(line, "SESS", 4)) {
@@ -182,11 +188,65 @@ int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr)
 		}
 	}
 
+	free(line);
+}
+
+/**
+ * read_task_txt_file - read 'task.txt' file from data directory
+ * @dirname: name of the data directory
+ * @needs_session: read session info too
+ * @sym_rel_addr: whethere symbol address is relative
+ *
+ * This function read the task.txt file in the @dirname and build task
+ * (and session when @needs_session is %true) information.
+ *
+ * It returns 0 for success, -1 for error.
+ */
+int read_task_txt_file(char *dirname, bool needs_session, bool sym_rel_addr)
+{
+	FILE *fp;
+	char *fname = NULL;
+
+	xasprintf(&fname, "%s/%s", dirname, "task.txt");
+
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		free(fname);
+		return -errno;
+	}
+
+	pr_dbg("reading %s file\n", fname);
+	read_task_txt(fp, dirname, needs_session, sym_rel_addr, NULL);
+
 	fclose(fp);
 	free(fname);
 	return 0;
 }
 
+/* read task.txt of a recording in progress from the last position */
+static void read_new_tasks(struct ftrace_file_handle *handle)
+{
+	FILE *fp;
+	char *fname = NULL;
+	bool sym_rel = handle->hdr.feat_mask & SYM_REL_ADDR;
+
+	xasprintf(&fname, "%s/%s", handle->dirname, "task.txt");
+
+	fp = fopen(fname, "r");
+	if (fp == NULL)
+		goto out;
+
+	if (fseek(fp, handle->task_pos, SEEK_SET) == 0) {
+		read_task_txt(fp, (char *)handle->dirname, true, sym_rel,
+			      &handle->info);
+		handle->task_pos = ftell(fp);
+	}
+	fclose(fp);
+
+out:
+	free(fname);
+}
+
 static void snprint_timestamp(char *buf, size_t sz, uint64_t timestamp)
 {
 	snprintf(buf, sz, "%"PRIu64".%09"PRIu64,  // sec.nsec
@@ -275,6 +335,677 @@ void write_dlopen_info(const char *dirname, struct ftrace_msg_dlopen *dmsg,
 	free(fname);
 }
 
+/**
+ * write_task_index - add an index entry for the task data
+ * @dirname: name of the data directory
+ * @tid: task id
+ * @offset: file offset of the @data in the task data file
+ * @data: task data (records) to be written
+ * @len: length of the @data
+ *
+ * This function adds an index entry using the first (ENTRY or EXIT)
+ * record in the @data to <tid>.idx file.  It's used to skip data out of
+ * time range.  LOST records have no timestamp so they're skipped.
+ */
+void write_task_index(const char *dirname, int tid, uint64_t offset,
+		      void *data, size_t len)
+{
+	struct ftrace_ret_stack *rstack = data;
+	struct uftrace_index_entry entry;
+	char *fname = NULL;
+	int fd;
+
+	/* LOST records (no arguments) can be at the start of a buffer */
+	while (len >= sizeof(*rstack) && rstack->magic == RECORD_MAGIC &&
+	       rstack->type == FTRACE_LOST) {
+		rstack++;
+		len -= sizeof(*rstack);
+	}
+
+	if (len < sizeof(*rstack) || rstack->magic != RECORD_MAGIC)
+		return;
+
+	/* the offset still points to the start of the buffer */
+	entry.time   = rstack->time;
+	entry.offset = offset;
+
+	xasprintf(&fname, "%s/%d.idx", dirname, tid);
+
+	fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		pr_err("cannot open %s", fname);
+
+	if (write_all(fd, &entry, sizeof(entry)) < 0)
+		pr_err("cannot write index entry");
+
+	close(fd);
+	free(fname);
+}
+
+/**
+ * write_task_chunk - append task data to a segment file
+ * @dirname: name of the data directory
+ * @seg: index of the segment file
+ * @tid: task id
+ * @data: task data (records) to be written
+ * @len: length of the @data
+ *
+ * This function appends the @data with a chunk header to the segment
+ * file and adds an entry to the chunk index.  Callers should not write
+ * to the same segment concurrently.
+ */
+void write_task_chunk(const char *dirname, int seg, int tid,
+		      void *data, size_t len)
+{
+	static uint64_t chunk_seq;
+	struct uftrace_chunk_header hdr = {
+		.magic = UFTRACE_CHUNK_MAGIC,
+		.tid   = tid,
+		.len   = len,
+	};
+	struct uftrace_chunk_index idx = {
+		.tid   = tid,
+		.len   = len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr), },
+		{ .iov_base = data, .iov_len = len, },
+	};
+	char *fname = NULL;
+	off_t offset;
+	int fd;
+
+	hdr.seq = idx.seq = __sync_fetch_and_add(&chunk_seq, 1);
+
+	xasprintf(&fname, "%s/data-%d.seg", dirname, seg);
+
+	fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		pr_err("cannot open %s", fname);
+
+	offset = lseek(fd, 0, SEEK_END);
+	if (offset < 0)
+		pr_err("cannot seek %s", fname);
+
+	if (writev_all(fd, iov, 2) < 0)
+		pr_err("cannot write task chunk");
+
+	close(fd);
+	free(fname);
+
+	idx.offset = offset + sizeof(hdr);
+
+	xasprintf(&fname, "%s/data-%d.cidx", dirname, seg);
+
+	fd = open(fname, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0)
+		pr_err("cannot open %s", fname);
+
+	if (write_all(fd, &idx, sizeof(idx)) < 0)
+		pr_err("cannot write chunk index");
+
+	close(fd);
+	free(fname);
+}
+
+struct uftrace_chunk {
+	int tid;
+	int seg;
+	uint64_t seq;
+	uint64_t offset;
+	uint64_t len;
+};
+
+struct uftrace_chunk_file {
+	int nr_segs;
+	int *fds;
+	size_t nr_chunks;
+	struct uftrace_chunk *chunks;
+};
+
+static int cmp_chunk(const void *a, const void *b)
+{
+	const struct uftrace_chunk *x = a;
+	const struct uftrace_chunk *y = b;
+
+	if (x->tid != y->tid)
+		return x->tid < y->tid ? -1 : 1;
+	if (x->seq != y->seq)
+		return x->seq < y->seq ? -1 : 1;
+	return 0;
+}
+
+static int read_chunk_index(struct uftrace_chunk_file *cf,
+			    const char *dirname, int seg)
+{
+	struct uftrace_chunk_index *idx;
+	struct stat stbuf;
+	char *fname = NULL;
+	size_t i, nr;
+	int fd;
+
+	xasprintf(&fname, "%s/data-%d.cidx", dirname, seg);
+	fd = open(fname, O_RDONLY);
+	free(fname);
+
+	if (fd < 0 || fstat(fd, &stbuf) < 0)
+		goto err;
+
+	nr = stbuf.st_size / sizeof(*idx);
+	idx = xmalloc(nr * sizeof(*idx) + 1);
+
+	if (read_all(fd, idx, nr * sizeof(*idx)) < 0) {
+		free(idx);
+		goto err;
+	}
+	close(fd);
+
+	xasprintf(&fname, "%s/data-%d.seg", dirname, seg);
+	fd = open(fname, O_RDONLY | O_CLOEXEC);
+	free(fname);
+
+	if (fd < 0) {
+		free(idx);
+		goto err;
+	}
+
+	cf->fds = xrealloc(cf->fds, (cf->nr_segs + 1) * sizeof(*cf->fds));
+	cf->fds[cf->nr_segs] = fd;
+
+	cf->chunks = xrealloc(cf->chunks, (cf->nr_chunks + nr) *
+			      sizeof(*cf->chunks));
+
+	for (i = 0; i < nr; i++) {
+		struct uftrace_chunk *ch = &cf->chunks[cf->nr_chunks++];
+
+		ch->tid    = idx[i].tid;
+		ch->seg    = cf->nr_segs;
+		ch->seq    = idx[i].seq;
+		ch->offset = idx[i].offset;
+		ch->len    = idx[i].len;
+	}
+	cf->nr_segs++;
+
+	free(idx);
+	return 0;
+
+err:
+	if (fd >= 0)
+		close(fd);
+	return -1;
+}
+
+static void close_chunk_file(struct uftrace_chunk_file *cf)
+{
+	int i;
+
+	if (cf == NULL)
+		return;
+
+	for (i = 0; i < cf->nr_segs; i++)
+		close(cf->fds[i]);
+
+	free(cf->fds);
+	free(cf->chunks);
+	free(cf);
+}
+
+static struct uftrace_chunk_file *open_chunk_file(const char *dirname)
+{
+	struct uftrace_chunk_file *cf;
+	struct dirent *ent;
+	DIR *dp;
+	int seg;
+
+	dp = opendir(dirname);
+	if (dp == NULL)
+		return NULL;
+
+	cf = xzalloc(sizeof(*cf));
+
+	/* some writers might not write any data */
+	while ((ent = readdir(dp)) != NULL) {
+		int len = 0;
+
+		if (sscanf(ent->d_name, "data-%d.cidx%n", &seg, &len) != 1 ||
+		    len == 0 || ent->d_name[len] != '\0')
+			continue;
+
+		if (read_chunk_index(cf, dirname, seg) < 0)
+			pr_warn("cannot read chunk index: %s\n", ent->d_name);
+	}
+	closedir(dp);
+
+	qsort(cf->chunks, cf->nr_chunks, sizeof(*cf->chunks), cmp_chunk);
+
+	pr_dbg("found %zd chunks in %d segments\n", cf->nr_chunks, cf->nr_segs);
+	return cf;
+}
+
+/*
+ * Task data is read through a stream which doesn't keep an fd and a
+ * buffer for itself.  Files are opened on demand and closed when too
+ * many of them are open (LRU), and read buffers are shared by all
+ * tasks of a file handle so only active tasks in the merge window hold
+ * the resources.
+ */
+#define TASK_BUF_SIZE  (64 * 1024)
+#define TASK_BUF_MAX   1024
+#define TASK_STDIO_BUF 256
+
+struct task_stream;
+
+struct task_buf {
+	struct list_head list;
+	struct task_stream *owner;
+	uint64_t off;
+	size_t len;
+	char data[];
+};
+
+/* recently used ones are at the head */
+struct task_stream_pool {
+	struct list_head buf_lru;
+	struct list_head fd_lru;
+	int nr_bufs;
+	int nr_fds;
+	int max_fds;
+};
+
+struct task_stream {
+	struct task_stream_pool *pool;
+	/* for chunks in segment files */
+	struct uftrace_chunk_file *cf;
+	struct uftrace_chunk *chunks;
+	int nr_chunks;
+	int curr;
+	/* for task data file */
+	char *filename;
+	int fd;
+	struct list_head fd_list;
+	struct task_buf *buf;
+	uint64_t pos;
+	char iobuf[TASK_STDIO_BUF];
+	/* start offset of each chunk in the stream */
+	uint64_t start[];
+};
+
+static struct task_stream_pool *get_stream_pool(struct ftrace_file_handle *handle)
+{
+	struct task_stream_pool *pool = handle->streams;
+	struct rlimit rlim;
+
+	if (pool)
+		return pool;
+
+	pool = xzalloc(sizeof(*pool));
+	INIT_LIST_HEAD(&pool->buf_lru);
+	INIT_LIST_HEAD(&pool->fd_lru);
+
+	/* leave enough fds for others */
+	pool->max_fds = 1024;
+	if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 &&
+	    rlim.rlim_cur / 2 < (rlim_t)pool->max_fds)
+		pool->max_fds = rlim.rlim_cur / 2 ?: 1;
+
+	handle->streams = pool;
+	return pool;
+}
+
+/* all streams should be closed before */
+static void put_stream_pool(struct ftrace_file_handle *handle)
+{
+	struct task_stream_pool *pool = handle->streams;
+
+	if (pool == NULL)
+		return;
+
+	assert(pool->nr_bufs == 0 && pool->nr_fds == 0);
+
+	free(pool);
+	handle->streams = NULL;
+}
+
+static int get_stream_fd(struct task_stream *ts)
+{
+	struct task_stream_pool *pool = ts->pool;
+	struct task_stream *old;
+
+	if (ts->fd >= 0) {
+		list_move(&ts->fd_list, &pool->fd_lru);
+		return ts->fd;
+	}
+
+	if (pool->nr_fds >= pool->max_fds) {
+		old = list_last_entry(&pool->fd_lru, struct task_stream,
+				      fd_list);
+		close(old->fd);
+		old->fd = -1;
+		list_del_init(&old->fd_list);
+		pool->nr_fds--;
+	}
+
+	ts->fd = open(ts->filename, O_RDONLY | O_CLOEXEC);
+	if (ts->fd < 0)
+		return -1;
+
+	list_add(&ts->fd_list, &pool->fd_lru);
+	pool->nr_fds++;
+
+	return ts->fd;
+}
+
+static struct task_buf *get_stream_buf(struct task_stream *ts)
+{
+	struct task_stream_pool *pool = ts->pool;
+	struct task_buf *buf = ts->buf;
+
+	if (buf) {
+		list_move(&buf->list, &pool->buf_lru);
+		return buf;
+	}
+
+	if (pool->nr_bufs < TASK_BUF_MAX) {
+		buf = xmalloc(sizeof(*buf) + TASK_BUF_SIZE);
+		pool->nr_bufs++;
+	}
+	else {
+		/* take the least recently used one */
+		buf = list_last_entry(&pool->buf_lru, struct task_buf, list);
+		list_del(&buf->list);
+		buf->owner->buf = NULL;
+	}
+
+	list_add(&buf->list, &pool->buf_lru);
+	buf->owner = ts;
+	buf->len = 0;
+	ts->buf = buf;
+
+	return buf;
+}
+
+static void put_stream_buf(struct task_stream *ts)
+{
+	if (ts->buf == NULL)
+		return;
+
+	list_del(&ts->buf->list);
+	free(ts->buf);
+	ts->buf = NULL;
+	ts->pool->nr_bufs--;
+}
+
+/* read data at @pos without changing the stream position */
+static ssize_t read_stream_data(struct task_stream *ts, char *buf,
+				size_t size, uint64_t pos)
+{
+	ssize_t total = 0;
+	ssize_t ret;
+	int fd;
+
+	if (ts->chunks == NULL) {
+		fd = get_stream_fd(ts);
+		if (fd < 0)
+			return -1;
+
+		while (size) {
+			ret = pread(fd, buf, size, pos);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				return total ?: ret;
+
+			buf   += ret;
+			size  -= ret;
+			pos   += ret;
+			total += ret;
+		}
+		return total;
+	}
+
+	while (size && ts->curr < ts->nr_chunks) {
+		struct uftrace_chunk *ch = &ts->chunks[ts->curr];
+		uint64_t off = pos - ts->start[ts->curr];
+		size_t len = ch->len - off;
+
+		if (off >= ch->len) {
+			ts->curr++;
+			continue;
+		}
+
+		if (len > size)
+			len = size;
+
+		ret = pread(ts->cf->fds[ch->seg], buf, len, ch->offset + off);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return total ?: ret;
+
+		buf   += ret;
+		size  -= ret;
+		pos   += ret;
+		total += ret;
+	}
+	return total;
+}
+
+static uint64_t stream_size(struct task_stream *ts)
+{
+	struct stat stbuf;
+
+	if (ts->chunks)
+		return ts->start[ts->nr_chunks];
+
+	/* the file might grow */
+	if (get_stream_fd(ts) < 0 || fstat(ts->fd, &stbuf) < 0)
+		return 0;
+
+	return stbuf.st_size;
+}
+
+static ssize_t stream_read(void *cookie, char *data, size_t size)
+{
+	struct task_stream *ts = cookie;
+	struct task_buf *buf;
+	ssize_t total = 0;
+
+	while (size) {
+		size_t len;
+		ssize_t ret;
+
+		buf = get_stream_buf(ts);
+
+		if (ts->pos < buf->off || ts->pos >= buf->off + buf->len) {
+			ret = read_stream_data(ts, buf->data, TASK_BUF_SIZE,
+					       ts->pos);
+			if (ret <= 0) {
+				buf->len = 0;
+				return total ?: ret;
+			}
+
+			buf->off = ts->pos;
+			buf->len = ret;
+		}
+
+		len = buf->off + buf->len - ts->pos;
+		if (len > size)
+			len = size;
+
+		memcpy(data, buf->data + (ts->pos - buf->off), len);
+
+		data    += len;
+		size    -= len;
+		total   += len;
+		ts->pos += len;
+	}
+	return total;
+}
+
+static int stream_seek(void *cookie, off64_t *offset, int whence)
+{
+	struct task_stream *ts = cookie;
+	int64_t pos;
+	int lo, hi, mid;
+
+	switch (whence) {
+	case SEEK_SET:
+		pos = *offset;
+		break;
+	case SEEK_CUR:
+		pos = ts->pos + *offset;
+		break;
+	case SEEK_END:
+		pos = stream_size(ts) + *offset;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* find the last chunk starts before the position */
+	lo = 0;
+	hi = ts->nr_chunks;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+
+		if (ts->start[mid] <= (uint64_t)pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	ts->curr = lo;
+	ts->pos = pos;
+
+	*offset = pos;
+	return 0;
+}
+
+static int stream_close(void *cookie)
+{
+	struct task_stream *ts = cookie;
+
+	put_stream_buf(ts);
+
+	if (ts->fd >= 0) {
+		close(ts->fd);
+		list_del(&ts->fd_list);
+		ts->pool->nr_fds--;
+	}
+
+	free(ts->filename);
+	free(ts);
+	return 0;
+}
+
+static FILE *open_task_stream(struct task_stream_pool *pool,
+			      struct task_stream *ts)
+{
+	cookie_io_functions_t stream_io = {
+		.read  = stream_read,
+		.seek  = stream_seek,
+		.close = stream_close,
+	};
+	FILE *fp;
+
+	ts->pool = pool;
+	ts->fd = -1;
+	INIT_LIST_HEAD(&ts->fd_list);
+
+	fp = fopencookie(ts, "rb", stream_io);
+	if (fp == NULL) {
+		free(ts->filename);
+		free(ts);
+		return NULL;
+	}
+
+	/*
+	 * Data is kept in the shared buffers, but unbuffered stdio calls
+	 * the cookie function for every small record.  Use a tiny private
+	 * buffer to amortize it.
+	 */
+	setvbuf(fp, ts->iobuf, _IOFBF, sizeof(ts->iobuf));
+	return fp;
+}
+
+static FILE *open_chunk_stream(struct ftrace_file_handle *handle, int tid)
+{
+	struct uftrace_chunk_file *cf = handle->chunks;
+	struct uftrace_chunk key = {
+		.tid = tid,
+	};
+	struct task_stream *ts;
+	size_t lo = 0, hi = cf->nr_chunks;
+	size_t first;
+	int i, n;
+
+	/* find the first chunk of the task */
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+
+		if (cmp_chunk(&cf->chunks[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	first = lo;
+	while (lo < cf->nr_chunks && cf->chunks[lo].tid == tid)
+		lo++;
+
+	n = lo - first;
+	if (n == 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	ts = xzalloc(sizeof(*ts) + (n + 1) * sizeof(*ts->start));
+	ts->cf = cf;
+	ts->chunks = &cf->chunks[first];
+	ts->nr_chunks = n;
+
+	for (i = 0; i < n; i++)
+		ts->start[i + 1] = ts->start[i] + ts->chunks[i].len;
+
+	return open_task_stream(get_stream_pool(handle), ts);
+}
+
+/**
+ * open_task_data - open data of the task to read
+ * @handle: file handle
+ * @tid: task id
+ *
+ * This function returns a stream to read the data of the task.  The
+ * stream opens the file only when it reads data and it can be closed
+ * when other tasks need to read.  If the data was saved in segment
+ * files, the stream reads the chunks of the task in the segments.
+ */
+FILE *open_task_data(struct ftrace_file_handle *handle, int tid)
+{
+	struct task_stream *ts;
+
+	if (handle->chunks)
+		return open_chunk_stream(handle, tid);
+
+	ts = xzalloc(sizeof(*ts) + sizeof(*ts->start));
+	xasprintf(&ts->filename, "%s/%d.dat", handle->dirname, tid);
+
+	/* check the file exists */
+	if (access(ts->filename, R_OK) < 0) {
+		free(ts->filename);
+		free(ts);
+		return NULL;
+	}
+
+	return open_task_stream(get_stream_pool(handle), ts);
+}
+
 static void check_data_order(struct ftrace_file_handle *handle)
 {
 	union {
@@ -347,6 +1078,10 @@ retry:
 	handle->tasks = NULL;
 	handle->time_filter = opts->threshold;
 	handle->time_range = opts->range;
+	handle->chunks = NULL;
+	handle->streams = NULL;
+	handle->follow = false;
+	handle->task_pos = 0;
 
 	if (fread(&handle->hdr, sizeof(handle->hdr), 1, fp) != 1)
 		pr_err("cannot read header data");
@@ -368,7 +1103,14 @@ retry:
 	if (opts->exename == NULL)
 		opts->exename = handle->info.exename;
 
-	if (handle->hdr.feat_mask & TASK_SESSION) {
+	if (opts->follow && !(handle->hdr.info_mask & (1UL << EXIT_STATUS))) {
+		/* it's being recorded: get the tasks from task.txt */
+		pr_dbg("data is not finished yet\n");
+		handle->follow = true;
+
+		read_new_tasks(handle);
+	}
+	else if (handle->hdr.feat_mask & TASK_SESSION) {
 		bool sym_rel = false;
 
 		if (handle->hdr.feat_mask & SYM_REL_ADDR)
@@ -386,12 +1128,81 @@ retry:
 	if (!(handle->hdr.feat_mask & MAX_STACK))
 		handle->hdr.max_stack = MCOUNT_RSTACK_MAX;
 
+	if (handle->hdr.feat_mask & DATA_CONTAINER) {
+		handle->chunks = open_chunk_file(opts->dirname);
+		if (handle->chunks == NULL)
+			pr_err("cannot open data segments");
+
+		/* the chunk index is read only once */
+		if (handle->follow) {
+			pr_warn("cannot follow data in segment files\n");
+			handle->follow = false;
+		}
+	}
+
 	ret = 0;
 
 out:
 	return ret;
 }
 
+/*
+ * The recorder writes the info file again with the exit status after
+ * all the data is written.  Only the header is checked as the rest can
+ * be written at the same time.
+ */
+static bool check_data_finished(struct ftrace_file_handle *handle)
+{
+	struct ftrace_file_header hdr;
+	char *fname = NULL;
+	bool finished = false;
+	int fd;
+
+	xasprintf(&fname, "%s/info", handle->dirname);
+
+	fd = open(fname, O_RDONLY);
+	if (fd >= 0) {
+		if (read_all(fd, &hdr, sizeof(hdr)) == 0 &&
+		    (hdr.info_mask & (1UL << EXIT_STATUS)))
+			finished = true;
+		close(fd);
+	}
+
+	free(fname);
+	return finished;
+}
+
+/**
+ * follow_data_file - wait for more data being recorded
+ * @handle: file handle
+ *
+ * This function should be called when there's no more data to read.
+ * If the data is still being recorded (--follow), it waits for a while
+ * and checks new tasks in the task.txt file.  Tasks keep their file
+ * position so callers can read the new data after that.
+ *
+ * It returns 0 if callers can read again, -1 otherwise.
+ */
+int follow_data_file(struct ftrace_file_handle *handle)
+{
+	if (!handle->follow || uftrace_done)
+		return -1;
+
+	/* show the output so far */
+	fflush(outfp);
+	usleep(FOLLOW_INTERVAL_USEC);
+
+	/* read the rest of data after the recording is finished */
+	if (check_data_finished(handle)) {
+		pr_dbg("recording finished\n");
+		handle->follow = false;
+	}
+
+	read_new_tasks(handle);
+	update_task_handle(handle);
+	return 0;
+}
+
 void close_data_file(struct opts *opts, struct ftrace_file_handle *handle)
 {
 	if (opts->exename == handle->info.exename)
@@ -399,4 +1210,94 @@ void close_data_file(struct opts *opts, struct ftrace_file_handle *handle)
 
 	clear_ftrace_info(&handle->info);
 	reset_task_handle(handle);
+	put_stream_pool(handle);
+
+	close_chunk_file(handle->chunks);
+	handle->chunks = NULL;
+}
+
+#ifdef UNIT_TEST
+TEST_CASE(data_file_chunk)
+{
+	struct ftrace_file_handle handle = {
+		.dirname = "chunk.dir",
+	};
+	char buf[16] = {};
+	FILE *fp;
+
+	TEST_EQ(mkdir(handle.dirname, 0755), 0);
+
+	/* chunks of a task are in different segments */
+	write_task_chunk(handle.dirname, 0, 1, "abc", 3);
+	write_task_chunk(handle.dirname, 2, 2, "xyz", 3);
+	write_task_chunk(handle.dirname, 2, 1, "def", 3);
+	write_task_chunk(handle.dirname, 0, 1, "gh", 2);
+
+	handle.chunks = open_chunk_file(handle.dirname);
+	TEST_NE(handle.chunks, NULL);
+	TEST_EQ(handle.chunks->nr_segs, 2);
+
+	fp = open_task_data(&handle, 1);
+	TEST_NE(fp, NULL);
+	TEST_EQ(fread(buf, 1, sizeof(buf), fp), 8U);
+	TEST_STREQ(buf, "abcdefgh");
+
+	TEST_EQ(fseek(fp, 4, SEEK_SET), 0);
+	TEST_EQ(fgetc(fp), 'e');
+	TEST_EQ(fseek(fp, 0, SEEK_END), 0);
+	TEST_EQ(ftell(fp), 8);
+	fclose(fp);
+
+	TEST_EQ(open_task_data(&handle, 3), NULL);
+
+	put_stream_pool(&handle);
+	close_chunk_file(handle.chunks);
+
+	remove("chunk.dir/data-0.seg");
+	remove("chunk.dir/data-0.cidx");
+	remove("chunk.dir/data-2.seg");
+	remove("chunk.dir/data-2.cidx");
+	rmdir(handle.dirname);
+
+	return TEST_OK;
+}
+
+TEST_CASE(data_file_index)
+{
+	struct ftrace_ret_stack rstack[3] = {
+		{ .time = 0,   .type = FTRACE_LOST,  .magic = RECORD_MAGIC, .addr = 3, },
+		{ .time = 100, .type = FTRACE_ENTRY, .magic = RECORD_MAGIC, .addr = 1, },
+		{ .time = 200, .type = FTRACE_EXIT,  .magic = RECORD_MAGIC, .addr = 1, },
+	};
+	struct uftrace_index_entry entry;
+	const char *dirname = "index.dir";
+	int fd;
+
+	TEST_EQ(mkdir(dirname, 0755), 0);
+
+	/* buffer starts with a LOST record */
+	write_task_index(dirname, 1, 0, rstack, sizeof(rstack));
+	write_task_index(dirname, 1, 72, &rstack[2], sizeof(rstack[2]));
+	/* no ENTRY or EXIT record */
+	write_task_index(dirname, 1, 96, rstack, sizeof(rstack[0]));
+
+	fd = open("index.dir/1.idx", O_RDONLY);
+	TEST_GE(fd, 0);
+
+	TEST_EQ(read(fd, &entry, sizeof(entry)), (ssize_t)sizeof(entry));
+	TEST_EQ(entry.time, 100U);
+	TEST_EQ(entry.offset, 0U);
+
+	TEST_EQ(read(fd, &entry, sizeof(entry)), (ssize_t)sizeof(entry));
+	TEST_EQ(entry.time, 200U);
+	TEST_EQ(entry.offset, 72U);
+
+	TEST_EQ(read(fd, &entry, sizeof(entry)), 0);
+	close(fd);
+
+	remove("index.dir/1.idx");
+	rmdir(dirname);
+
+	return TEST_OK;
 }
+#endif /* UNIT_TEST */
@@ -5,6 +5,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <byteswap.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 /* This should be defined before #include "utils.h" */
 #define PR_FMT     "fstack"
@@ -24,6 +27,7 @@ bool live_disabled = false;
 static enum filter_mode fstack_filter_mode = FILTER_MODE_NONE;
 
 static int __read_task_ustack(struct ftrace_task_handle *task);
+static void free_func_index(struct fstack_func_index *fi);
 
 struct ftrace_task_handle *get_task_handle(struct ftrace_file_handle *handle,
 					   int tid)
@@ -41,26 +45,22 @@ void setup_task_handle(struct ftrace_file_handle *handle,
 		       struct ftrace_task_handle *task, int tid)
 {
 	int i;
-	char *filename;
 	int max_stack;
 
-	xasprintf(&filename, "%s/%d.dat", handle->dirname, tid);
-
 	memset(task, 0, sizeof(*task));
 
 	task->h = handle;
 	task->t = find_task(tid);
 
 	task->tid = tid;
-	task->fp = fopen(filename, "rb");
+	task->fp = open_task_data(handle, tid);
 	if (task->fp == NULL) {
-		pr_dbg("cannot open task data file: %s: %m\n", filename);
-		task->done = true;
+		pr_dbg("cannot open task data: %d: %m\n", tid);
+		/* it might be written later */
+		task->done = !handle->follow;
 	}
 	else
-		pr_dbg2("opening %s\n", filename);
-
-	free(filename);
+		pr_dbg2("opening task data: %d\n", tid);
 
 	task->stack_count = 0;
 	task->display_depth = 0;
@@ -84,6 +84,46 @@ void setup_task_handle(struct ftrace_file_handle *handle,
 		task->func_stack[i].orig_depth = handle->depth;
 }
 
+/**
+ * get_task_session - find a session of @task at @timestamp
+ * @task: task handle
+ * @timestamp: timestamp of the record
+ *
+ * This function returns the session of the @task.  As sessions are
+ * changed only by exec, it saves the last session with its valid
+ * time range in the @task and reuses it while the @timestamp is in
+ * the range.  If it cannot find a session of the task, it'll try the
+ * session of the thread leader.
+ */
+struct ftrace_session *get_task_session(struct ftrace_task_handle *task,
+					uint64_t timestamp)
+{
+	struct ftrace_session *sess;
+	uint64_t start, end, tid_end;
+
+	if (task->sess_start <= timestamp && timestamp < task->sess_end)
+		return task->sess;
+
+	sess = find_task_session_range(task->tid, timestamp, &start, &end);
+	if (sess == NULL && task->t) {
+		tid_end = end;
+		sess = find_task_session_range(task->t->pid, timestamp,
+					       &start, &end);
+		/* the task can have its own session later */
+		if (tid_end < end)
+			end = tid_end;
+	}
+
+	if (sess == NULL)
+		return NULL;
+
+	task->sess = sess;
+	task->sess_start = start;
+	task->sess_end = end;
+
+	return sess;
+}
+
 void reset_task_handle(struct ftrace_file_handle *handle)
 {
 	int i;
@@ -105,6 +145,9 @@ void reset_task_handle(struct ftrace_file_handle *handle)
 		free(task->func_stack);
 		task->func_stack = NULL;
 
+		free_func_index(task->func_index);
+		task->func_index = NULL;
+
 		reset_rstack_list(&task->rstack_list);
 	}
 
@@ -123,6 +166,47 @@ static void update_first_timestamp(struct ftrace_file_handle *handle,
 		handle->time_range.first = rstack->time;
 }
 
+/* tids given by --tid option (kept for new tasks) */
+static int *filter_tids;
+static int nr_filter_tids;
+
+static void setup_task(struct ftrace_file_handle *handle,
+		       struct ftrace_task_handle *task, int tid)
+{
+	bool found = !filter_tids;
+	int k;
+
+	for (k = 0; k < nr_filter_tids; k++) {
+		if (tid == filter_tids[k]) {
+			found = true;
+			break;
+		}
+	}
+
+	if (!found) {
+		memset(task, 0, sizeof(*task));
+		setup_rstack_list(&task->rstack_list);
+		task->done = true;
+		task->tid  = tid;
+		task->h    = handle;
+
+		/* need to read the data to check elapsed time */
+		task->fp = open_task_data(handle, tid);
+		if (task->fp) {
+			if (!__read_task_ustack(task)) {
+				update_first_timestamp(handle,
+						       &task->ustack);
+			}
+			fclose(task->fp);
+			task->fp = NULL;
+		}
+		return;
+	}
+
+	task->tid = tid;
+	setup_task_handle(handle, task, tid);
+}
+
 /**
  * setup_task_filter - setup task filters using tid
  * @tid_filter - CSV of tid (or possibly separated by  ':')
@@ -133,11 +217,13 @@ static void update_first_timestamp(struct ftrace_file_handle *handle,
  */
 void setup_task_filter(char *tid_filter, struct ftrace_file_handle *handle)
 {
-	int i, k;
-	int nr_filters = 0;
-	int *filter_tids = NULL;
+	int i;
 	char *p = tid_filter;
 
+	free(filter_tids);
+	filter_tids = NULL;
+	nr_filter_tids = 0;
+
 	if (tid_filter == NULL)
 		goto setup;
 
@@ -149,8 +235,8 @@ void setup_task_filter(char *tid_filter, struct ftrace_file_handle *handle)
 
 		id = strtol(p, &p, 10);
 
-		filter_tids = xrealloc(filter_tids, (nr_filters+1) * sizeof(int));
-		filter_tids[nr_filters++] = id;
+		filter_tids = xrealloc(filter_tids, (nr_filter_tids+1) * sizeof(int));
+		filter_tids[nr_filter_tids++] = id;
 
 	} while (*p);
 
@@ -158,47 +244,68 @@ setup:
 	handle->nr_tasks = handle->info.nr_tid;
 	handle->tasks = xmalloc(sizeof(*handle->tasks) * handle->nr_tasks);
 
-	for (i = 0; i < handle->nr_tasks; i++) {
-		bool found = !tid_filter;
-		int tid = handle->info.tids[i];
-		struct ftrace_task_handle *task = &handle->tasks[i];
+	for (i = 0; i < handle->nr_tasks; i++)
+		setup_task(handle, &handle->tasks[i], handle->info.tids[i]);
+}
 
-		for (k = 0; k < nr_filters; k++) {
-			if (tid == filter_tids[k]) {
-				found = true;
-				break;
-			}
-		}
+/* move a task handle to a new place, it has lists and pointers to itself */
+static void move_task_handle(struct ftrace_task_handle *dst,
+			     struct ftrace_task_handle *src)
+{
+	memcpy(dst, src, sizeof(*dst));
 
-		if (!found) {
-			char *filename = NULL;
+	setup_rstack_list(&dst->rstack_list);
+	list_splice(&src->rstack_list.read, &dst->rstack_list.read);
+	list_splice(&src->rstack_list.unused, &dst->rstack_list.unused);
+	dst->rstack_list.count = src->rstack_list.count;
 
-			memset(task, 0, sizeof(*task));
-			setup_rstack_list(&task->rstack_list);
-			task->done = true;
-			task->tid  = tid;
-			task->h    = handle;
-
-			/* need to read the data to check elapsed time */
-			xasprintf(&filename, "%s/%d.dat", handle->dirname, tid);
-			task->fp = fopen(filename, "rb");
-			if (task->fp) {
-				if (!__read_task_ustack(task)) {
-					update_first_timestamp(handle,
-							       &task->ustack);
-				}
-				fclose(task->fp);
-				task->fp = NULL;
-			}
-			free(filename);
+	if (src->rstack == &src->ustack)
+		dst->rstack = &dst->ustack;
+	else if (src->rstack == &src->kstack)
+		dst->rstack = &dst->kstack;
+}
+
+/**
+ * update_task_handle - update task handles for new data
+ * @handle - file handle
+ *
+ * This function is to follow data being recorded.  It opens the data
+ * file of tasks which were not written before, and sets up handles of
+ * new tasks added to @handle->info.  Note that it can move existing
+ * task handles.
+ */
+void update_task_handle(struct ftrace_file_handle *handle)
+{
+	struct ftrace_task_handle *tasks;
+	struct ftrace_task_handle *task;
+	int i;
+
+	for (i = 0; i < handle->nr_tasks; i++) {
+		task = &handle->tasks[i];
+
+		if (task->done || task->fp)
 			continue;
-		}
 
-		task->tid = tid;
-		setup_task_handle(handle, task, tid);
+		task->fp = open_task_data(handle, task->tid);
+		if (task->fp == NULL && !handle->follow)
+			task->done = true;
 	}
 
-	free(filter_tids);
+	if (handle->nr_tasks == handle->info.nr_tid)
+		return;
+
+	tasks = xmalloc(sizeof(*tasks) * handle->info.nr_tid);
+
+	for (i = 0; i < handle->nr_tasks; i++)
+		move_task_handle(&tasks[i], &handle->tasks[i]);
+	for (; i < handle->info.nr_tid; i++)
+		setup_task(handle, &tasks[i], handle->info.tids[i]);
+
+	pr_dbg("%d new task(s) found\n", handle->info.nr_tid - handle->nr_tasks);
+
+	free(handle->tasks);
+	handle->tasks = tasks;
+	handle->nr_tasks = handle->info.nr_tid;
 }
 
 static int setup_filters(struct ftrace_session *s, void *arg)
@@ -391,9 +498,7 @@ int fstack_entry(struct ftrace_task_handle *task,
 		return -1;
 	}
 
-	sess = find_task_session(task->tid, rstack->time);
-	if (sess == NULL)
-		sess = find_task_session(task->t->pid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 
 	if (is_kernel_address(addr)) {
 		addr = get_real_address(addr);
@@ -590,9 +695,7 @@ static int fstack_check_skip(struct ftrace_task_handle *task,
 		return 0;
 	}
 
-	sess = find_task_session(task->tid, rstack->time);
-	if (sess == NULL)
-		sess = find_task_session(task->t->pid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 
 	if (sess == NULL) {
 		if (is_kernel_address(addr))
@@ -848,10 +951,14 @@ static void swap_bitfields(struct ftrace_ret_stack *rstack)
 static int __read_task_ustack(struct ftrace_task_handle *task)
 {
 	FILE *fp = task->fp;
+	long pos = ftell(fp);
 
 	if (fread(&task->ustack, sizeof(task->ustack), 1, fp) != 1) {
-		if (feof(fp))
+		if (feof(fp)) {
+			/* discard a partial record, it might be written later */
+			fseek(fp, pos, SEEK_SET);
 			return -1;
+		}
 
 		pr_log("error reading rstack: %s\n", strerror(errno));
 		return -1;
@@ -927,7 +1034,7 @@ int read_task_args(struct ftrace_task_handle *task,
 	struct ftrace_arg_spec *arg;
 	int rem;
 
-	sess = find_task_session(task->tid, rstack->time);
+	sess = get_task_session(task, rstack->time);
 	if (sess == NULL) {
 		pr_dbg("cannot find session\n");
 		return -1;
@@ -984,11 +1091,20 @@ int read_task_ustack(struct ftrace_file_handle *handle,
 	if (task->done || task->fp == NULL)
 		return -1;
 
-	if (__read_task_ustack(task) < 0) {
+	/* the rest belongs to other time slices */
+	if (task->stop_offset &&
+	    (uint64_t)ftell(task->fp) >= task->stop_offset) {
 		task->done = true;
 		return -1;
 	}
 
+	if (__read_task_ustack(task) < 0) {
+		/* more data can be written later */
+		if (!handle->follow)
+			task->done = true;
+		return -1;
+	}
+
 	if (task->ustack.more) {
 		if (!(handle->hdr.feat_mask & (ARGUMENT | RETVAL)) ||
 		    handle->info.argspec == NULL)
@@ -1006,195 +1122,1067 @@ int read_task_ustack(struct ftrace_file_handle *handle,
 	return 0;
 }
 
-/**
- * get_task_ustack - read task's user function record
- * @handle: file handle
- * @idx: task index
- *
- * This function returns current ftrace record of @idx-th task from
- * data file in @handle.
+/*
+ * Skip records before the start of the time range using the index
+ * file.  It finds the last index entry before the start time and moves
+ * the file position if it's after the current one.
  */
-static struct ftrace_ret_stack *
-get_task_ustack(struct ftrace_file_handle *handle, int idx)
+static void seek_task_index(struct ftrace_file_handle *handle,
+			    struct ftrace_task_handle *task)
 {
-	struct ftrace_task_handle *task;
-	struct ftrace_ret_stack *curr;
-	struct uftrace_rstack_list *rstack_list;
+	struct uftrace_time_range *range = &handle->time_range;
+	struct uftrace_index_entry entry;
+	uint64_t start = range->start;
+	uint64_t offset = 0;
+	char *filename = NULL;
+	struct stat stbuf;
+	long lo, hi, mid;
+	int fd;
+
+	task->index_checked = true;
+
+	if (start == 0)
+		return;
+	if (range->start_elapsed)
+		start += range->first;
 
-	task = &handle->tasks[idx];
-	rstack_list = &task->rstack_list;
+	xasprintf(&filename, "%s/%d.idx", handle->dirname, task->tid);
+	fd = open(filename, O_RDONLY);
+	free(filename);
 
-	if (rstack_list->count)
-		goto out;
+	if (fd < 0)
+		return;
 
-	/*
-	 * read task (user) stack until it found an entry that exceeds
-	 * the given time filter (-t option).
-	 */
-	while (read_task_ustack(handle, task) == 0) {
-		struct ftrace_session *sess;
-		struct ftrace_trigger tr = {};
-		uint64_t time_filter = handle->time_filter;
+	if (fstat(fd, &stbuf) < 0)
+		goto out;
 
-		curr = &task->ustack;
+	lo = 0;
+	hi = stbuf.st_size / sizeof(entry);
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
 
-		/* prevent ustack from invalid access */
-		task->valid = false;
+		if (pread(fd, &entry, sizeof(entry),
+			  mid * sizeof(entry)) != sizeof(entry))
+			goto out;
 
-		if (!check_time_range(&handle->time_range, curr->time))
-			continue;
+		if (entry.time <= start) {
+			offset = entry.offset;
+			lo = mid + 1;
+		}
+		else
+			hi = mid;
+	}
 
-		sess = find_task_session(task->tid, curr->time);
-		if (sess == NULL)
-			sess = find_task_session(task->t->pid,
-						 curr->time);
+	if (offset > (uint64_t)ftell(task->fp)) {
+		pr_dbg2("task %d: skip to offset %"PRIu64" using index\n",
+			task->tid, offset);
+		fseek(task->fp, offset, SEEK_SET);
+	}
 
-		if (sess)
-			ftrace_match_filter(&sess->filters,
-					    curr->addr, &tr);
+out:
+	close(fd);
+}
 
-		if (task->filter.time)
-			time_filter = task->filter.time->threshold;
+/* number of records in a segment of the function index */
+static int func_index_seg_records = 1024;
 
-		if (curr->type == FTRACE_ENTRY) {
-			/* it needs to wait until matching exit found */
-			add_to_rstack_list(rstack_list, curr, &task->args);
+struct fstack_func_index {
+	char *buf;
+	int nr_segs;
+	struct uftrace_func_index_seg **segs;
+	/* next segment to skip to (matched or the last one) */
+	int *next;
+};
 
-			if (tr.flags & TRIGGER_FL_TIME_FILTER) {
-				struct time_filter_stack *tfs;
+struct func_index_buf {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
 
-				tfs = xmalloc(sizeof(*tfs));
-				tfs->next = task->filter.time;
-				tfs->depth = curr->depth;
-				tfs->context = FSTACK_CTX_USER;
-				tfs->threshold = tr.time;
+static size_t func_index_append(struct func_index_buf *fb,
+				void *data, size_t len)
+{
+	size_t pos = fb->len;
 
-				task->filter.time = tfs;
-			}
-		}
-		else if (curr->type == FTRACE_EXIT) {
-			struct uftrace_rstack_list_node *last;
-			uint64_t delta;
+	if (pos + len > fb->alloc) {
+		fb->alloc = ALIGN(pos + len, 4096) * 2;
+		fb->data = xrealloc(fb->data, fb->alloc);
+	}
 
-			if (task->filter.time) {
-				struct time_filter_stack *tfs;
+	if (len)
+		memcpy(fb->data + pos, data, len);
+	fb->len += len;
 
-				tfs = task->filter.time;
-				if (tfs->depth == curr->depth &&
-				    tfs->context == FSTACK_CTX_USER) {
-					/* discard stale filter */
-					task->filter.time = tfs->next;
-					free(tfs);
-				}
-			}
+	return pos;
+}
 
-			if (rstack_list->count == 0) {
-				/* it's already exceeded time filter, just return */
-				add_to_rstack_list(rstack_list, curr, &task->args);
-				break;
-			}
+static int cmp_func_addr(const void *a, const void *b)
+{
+	const uint64_t *x = a;
+	const uint64_t *y = b;
 
-			last = list_last_entry(&rstack_list->read,
-					       typeof(*last), list);
-			delta = curr->time - last->rstack.time;
+	if (*x == *y)
+		return 0;
+	return *x > *y ? 1 : -1;
+}
 
-			if (delta < time_filter) {
-				/*
-				 * it might set TRACE trigger, which shows
-				 * function even if it's less than the time
-				 * filter.
-				 */
-				if (tr.flags & TRIGGER_FL_TRACE) {
-					add_to_rstack_list(rstack_list, curr,
-							   &task->args);
-					break;
-				}
+/* sort and remove duplicates, returns new count */
+static size_t uniq_func_addrs(uint64_t *addrs, size_t nr_addrs)
+{
+	size_t i, n = 0;
 
-				/* also delete matching entry (at the last) */
-				delete_last_rstack_list(rstack_list);
-			} else {
-				/* found! process all existing rstacks in the list */
-				add_to_rstack_list(rstack_list, curr, &task->args);
-				break;
-			}
-		}
-		else {
-			/* TODO: handle LOST properly */
-			add_to_rstack_list(rstack_list, curr, &task->args);
-			break;
-		}
+	qsort(addrs, nr_addrs, sizeof(*addrs), cmp_func_addr);
 
+	for (i = 0; i < nr_addrs; i++) {
+		if (n && addrs[n - 1] == addrs[i])
+			continue;
+		addrs[n++] = addrs[i];
 	}
-	if (task->done && rstack_list->count == 0)
-		return NULL;
+	return n;
+}
 
-out:
-	task->valid = true;
-	curr = get_first_rstack_list(rstack_list);
-	memcpy(&task->ustack, curr, sizeof(*task->rstack));
+static uint64_t *func_index_funcs(struct uftrace_func_index_seg *seg)
+{
+	struct uftrace_func_index_frame *frames = (void *)(seg + 1);
 
-	return &task->ustack;
+	return (void *)(frames + seg->nr_frames);
 }
 
-static int read_user_stack(struct ftrace_file_handle *handle,
-			   struct ftrace_task_handle **task)
+static size_t add_func_index_seg(struct func_index_buf *fb, uint64_t offset,
+				 struct uftrace_func_index_frame *frames,
+				 int nr_frames)
 {
-	int i, next_i = -1;
-	uint64_t next_time = 0;
-	struct ftrace_ret_stack *tmp;
+	struct uftrace_func_index_seg seg = {
+		.offset    = offset,
+		.nr_frames = nr_frames,
+	};
+	size_t pos;
 
-	for (i = 0; i < handle->info.nr_tid; i++) {
-		tmp = get_task_ustack(handle, i);
-		if (tmp == NULL)
-			continue;
+	pos = func_index_append(fb, &seg, sizeof(seg));
+	func_index_append(fb, frames, nr_frames * sizeof(*frames));
 
-		if (next_i < 0 || tmp->time < next_time) {
-			next_time = tmp->time;
-			next_i = i;
-		}
-	}
+	return pos;
+}
 
-	if (next_i < 0)
-		return -1;
+static void finish_func_index_seg(struct func_index_buf *fb, size_t pos,
+				  uint64_t *funcs, int nr_funcs)
+{
+	struct uftrace_func_index_seg *seg;
 
-	*task = &handle->tasks[next_i];
+	nr_funcs = uniq_func_addrs(funcs, nr_funcs);
+	func_index_append(fb, funcs, nr_funcs * sizeof(*funcs));
 
-	return next_i;
+	seg = (void *)(fb->data + pos);
+	seg->nr_funcs = nr_funcs;
 }
 
-static void fstack_account_time(struct ftrace_task_handle *task)
+static void grow_func_index_frames(struct uftrace_func_index_frame **frames,
+				   int *max_frames, int nr_frames)
 {
-	struct fstack *fstack;
-	struct ftrace_ret_stack *rstack = task->rstack;
-	bool is_kernel_func = (rstack == &task->kstack);
-	int i;
+	if (nr_frames <= *max_frames)
+		return;
 
-	if (!task->fstack_set) {
+	*frames = xrealloc(*frames, nr_frames * sizeof(**frames));
+	memset(*frames + *max_frames, 0,
+	       (nr_frames - *max_frames) * sizeof(**frames));
+	*max_frames = nr_frames;
+}
 
-		/* inherit stack count after [v]fork() or recover from lost */
-		task->stack_count = rstack->depth;
-		if (rstack->type == FTRACE_EXIT) {
-			task->stack_count++;
-			/* [v]fork() usually starts with EXIT in child */
-			task->display_depth_set = false;
-		}
-		task->fstack_set = true;
+/*
+ * Read all records of the task and build the function index.  It keeps
+ * track of the call stack as fstack_account_time() does to save it at
+ * the start of each segment.
+ */
+static char *build_func_index(struct ftrace_file_handle *handle,
+			      struct ftrace_task_handle *task,
+			      uint64_t data_size, size_t *len)
+{
+	struct func_index_buf fb = {};
+	struct uftrace_func_index_header hdr = {
+		.magic     = UFTRACE_FIDX_MAGIC,
+		.data_size = data_size,
+	};
+	struct uftrace_func_index_frame *frames = NULL;
+	struct uftrace_func_index_seg *seg;
+	struct ftrace_ret_stack *rstack = &task->ustack;
+	uint64_t *funcs;
+	uint64_t last_time = 0;
+	int nr_recs = 0;
+	int nr_funcs = 0;
+	int nr_frames = 0;
+	int max_frames = 0;
+	bool stack_set = false;
+	bool lost_seen = false;
+	size_t pos = 0;
+	int i;
 
+	funcs = xmalloc(func_index_seg_records * sizeof(*funcs));
+	func_index_append(&fb, &hdr, sizeof(hdr));
 
-		if (is_kernel_func)
-			task->stack_count += task->user_stack_count;
+	rewind(task->fp);
 
-		/* calculate duration from now on */
-		for (i = 0; i < task->stack_count; i++) {
-			fstack = &task->func_stack[i];
+	while (true) {
+		int depth;
 
-			fstack->total_time = rstack->time;  /* start time */
-			fstack->child_time = 0;
-			fstack->valid = true;
+		if (nr_recs == 0) {
+			pos = add_func_index_seg(&fb, ftell(task->fp),
+						 frames, nr_frames);
 		}
 
-		task->filter.depth = task->h->depth;
-	}
+		task->valid = false;
+		if (read_task_ustack(handle, task) < 0)
+			break;
+
+		if (nr_recs == 0) {
+			seg = (void *)(fb.data + pos);
+			seg->time = rstack->time;
+		}
+		last_time = rstack->time;
+
+		depth = rstack->depth;
+		if (rstack->type == FTRACE_EXIT)
+			depth++;
+
+		if (!stack_set || (lost_seen && rstack->type != FTRACE_LOST)) {
+			grow_func_index_frames(&frames, &max_frames, depth);
+
+			for (i = 0; i < depth; i++) {
+				frames[i].time = rstack->time;
+				frames[i].child_time = 0;
+			}
+
+			nr_frames = depth;
+			stack_set = true;
+			lost_seen = false;
+		}
+
+		if (rstack->type == FTRACE_ENTRY) {
+			grow_func_index_frames(&frames, &max_frames,
+					       nr_frames + 1);
+
+			frames[nr_frames].addr = rstack->addr;
+			frames[nr_frames].time = rstack->time;
+			frames[nr_frames].child_time = 0;
+			nr_frames++;
+
+			funcs[nr_funcs++] = rstack->addr;
+		}
+		else if (rstack->type == FTRACE_EXIT && nr_frames > 0) {
+			uint64_t delta;
+
+			nr_frames--;
+			delta = rstack->time - frames[nr_frames].time;
+
+			/* add current time to parent's child time */
+			if (nr_frames > 0)
+				frames[nr_frames - 1].child_time += delta;
+		}
+		else if (rstack->type == FTRACE_LOST)
+			lost_seen = true;
+
+		if (++nr_recs == func_index_seg_records) {
+			finish_func_index_seg(&fb, pos, funcs, nr_funcs);
+			hdr.nr_segs++;
+
+			nr_recs = 0;
+			nr_funcs = 0;
+		}
+	}
+
+	if (nr_recs) {
+		finish_func_index_seg(&fb, pos, funcs, nr_funcs);
+		hdr.nr_segs++;
+
+		pos = add_func_index_seg(&fb, data_size, frames, nr_frames);
+	}
+	else {
+		/* reuse the empty segment as the last one */
+		seg = (void *)(fb.data + pos);
+		seg->offset = data_size;
+	}
+	seg = (void *)(fb.data + pos);
+	seg->time = last_time;
+	finish_func_index_seg(&fb, pos, funcs, 0);
+	hdr.nr_segs++;
+
+	memcpy(fb.data, &hdr, sizeof(hdr));
+
+	/* restore the task to read from the beginning */
+	rewind(task->fp);
+	task->valid = false;
+	task->done = false;
+	task->args.len = 0;
+
+	free(funcs);
+	free(frames);
+
+	*len = fb.len;
+	return fb.data;
+}
+
+static void free_func_index(struct fstack_func_index *fi)
+{
+	if (fi == NULL)
+		return;
+
+	free(fi->buf);
+	free(fi->segs);
+	free(fi->next);
+	free(fi);
+}
+
+static struct fstack_func_index *load_func_index(char *buf, size_t len,
+						  uint64_t data_size)
+{
+	struct uftrace_func_index_header *hdr = (void *)buf;
+	struct fstack_func_index *fi;
+	size_t pos = sizeof(*hdr);
+	int i;
+
+	if (len < sizeof(*hdr) ||
+	    memcmp(hdr->magic, UFTRACE_FIDX_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->data_size != data_size || hdr->nr_segs == 0)
+		return NULL;
+
+	fi = xzalloc(sizeof(*fi));
+	fi->buf = buf;
+	fi->nr_segs = hdr->nr_segs;
+	fi->segs = xcalloc(fi->nr_segs, sizeof(*fi->segs));
+	fi->next = xcalloc(fi->nr_segs, sizeof(*fi->next));
+
+	for (i = 0; i < fi->nr_segs; i++) {
+		struct uftrace_func_index_seg *seg = (void *)(buf + pos);
+
+		if (pos + sizeof(*seg) > len)
+			goto bad;
+
+		pos += sizeof(*seg);
+		pos += seg->nr_frames * sizeof(struct uftrace_func_index_frame);
+		pos += seg->nr_funcs * sizeof(uint64_t);
+		if (pos > len)
+			goto bad;
+
+		fi->segs[i] = seg;
+	}
+	return fi;
+
+bad:
+	fi->buf = NULL;
+	free_func_index(fi);
+	return NULL;
+}
+
+/* write to a temp file first so that others never see a partial index */
+static void save_func_index(const char *filename, void *buf, size_t len)
+{
+	char *tmpname = NULL;
+	int fd;
+
+	xasprintf(&tmpname, "%s.%d", filename, getpid());
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_dbg("cannot write function index: %s: %m\n", filename);
+		goto out;
+	}
+
+	if (write_all(fd, buf, len) < 0 || rename(tmpname, filename) < 0) {
+		pr_dbg("cannot write function index: %s: %m\n", filename);
+		unlink(tmpname);
+	}
+	close(fd);
+
+out:
+	free(tmpname);
+}
+
+static struct fstack_func_index *
+setup_task_func_index(struct ftrace_file_handle *handle,
+		      struct ftrace_task_handle *task)
+{
+	struct fstack_func_index *fi = NULL;
+	uint64_t data_size;
+	long pos;
+	char *filename;
+	char *buf = NULL;
+	size_t len = 0;
+	int fd;
+
+	/* it might not be a regular file */
+	pos = ftell(task->fp);
+	if (fseek(task->fp, 0, SEEK_END) < 0)
+		return NULL;
+	data_size = ftell(task->fp);
+	fseek(task->fp, pos, SEEK_SET);
+
+	xasprintf(&filename, "%s/%d.fidx", handle->dirname, task->tid);
+
+	fd = open(filename, O_RDONLY);
+	if (fd >= 0) {
+		struct stat st;
+
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			len = st.st_size;
+			buf = xmalloc(len);
+
+			if (read_all(fd, buf, len) == 0)
+				fi = load_func_index(buf, len, data_size);
+		}
+		close(fd);
+
+		if (fi == NULL)
+			free(buf);
+	}
+
+	if (fi == NULL) {
+		pr_dbg("build function index for task %d\n", task->tid);
+
+		buf = build_func_index(handle, task, data_size, &len);
+		fi = load_func_index(buf, len, data_size);
+
+		/* it's ok to fail, it'll be built again next time */
+		if (access(handle->dirname, W_OK) == 0)
+			save_func_index(filename, buf, len);
+	}
+
+	free(filename);
+	return fi;
+}
+
+static bool match_func_index(struct uftrace_func_index_seg *seg,
+			     uint64_t *addrs, size_t nr_addrs)
+{
+	uint64_t *funcs = func_index_funcs(seg);
+	unsigned i;
+
+	for (i = 0; i < seg->nr_funcs; i++) {
+		if (bsearch(&funcs[i], addrs, nr_addrs, sizeof(*addrs),
+			    cmp_func_addr))
+			return true;
+	}
+	return false;
+}
+
+/**
+ * fstack_setup_func_index - setup function index to skip task data
+ * @handle: file handle
+ * @match: callback to check a function is needed
+ * @arg: argument passed to @match
+ *
+ * This function loads (or builds) the function index of each task and
+ * finds segments of the data which call the functions accepted by
+ * @match.  Then fstack_skip_func_index() can skip other segments when
+ * the task is not in the middle of the functions.
+ *
+ * This function returns 0 if the index is set, -1 otherwise.
+ */
+int fstack_setup_func_index(struct ftrace_file_handle *handle,
+			    func_index_match_t match, void *arg)
+{
+	struct ftrace_task_handle *task;
+	struct fstack_func_index *fi;
+	uint64_t *addrs = NULL;
+	size_t nr_addrs = 0;
+	size_t nr_match = 0;
+	size_t i;
+	int k, n;
+
+	/* kernel records are not indexed, and data should not grow */
+	if (handle->kern || !fstack_enabled || handle->follow)
+		return -1;
+
+	for (n = 0; n < handle->nr_tasks; n++) {
+		task = &handle->tasks[n];
+
+		if (task->fp == NULL || task->func_stack == NULL)
+			continue;
+
+		fi = setup_task_func_index(handle, task);
+		if (fi == NULL)
+			continue;
+
+		task->func_index = fi;
+
+		/* collect all functions to call @match only once */
+		for (k = 0; k < fi->nr_segs; k++) {
+			struct uftrace_func_index_seg *seg = fi->segs[k];
+
+			addrs = xrealloc(addrs, (nr_addrs + seg->nr_funcs) *
+					 sizeof(*addrs));
+			memcpy(addrs + nr_addrs, func_index_funcs(seg),
+			       seg->nr_funcs * sizeof(*addrs));
+			nr_addrs += seg->nr_funcs;
+		}
+	}
+
+	nr_addrs = uniq_func_addrs(addrs, nr_addrs);
+
+	for (i = 0; i < nr_addrs; i++) {
+		if (match(addrs[i], arg))
+			addrs[nr_match++] = addrs[i];
+	}
+
+	for (n = 0; n < handle->nr_tasks; n++) {
+		fi = handle->tasks[n].func_index;
+		if (fi == NULL)
+			continue;
+
+		k = fi->nr_segs - 1;
+		fi->next[k] = k;
+
+		while (--k >= 0) {
+			if (match_func_index(fi->segs[k], addrs, nr_match))
+				fi->next[k] = k;
+			else
+				fi->next[k] = fi->next[k + 1];
+		}
+	}
+
+	pr_dbg("function index: %zd out of %zd functions matched\n",
+	       nr_match, nr_addrs);
+
+	free(addrs);
+	return 0;
+}
+
+static int check_filter_index(struct ftrace_session *s, void *arg)
+{
+	bool *ok = arg;
+	struct rb_node *node;
+
+	for (node = rb_first(&s->filters); node; node = rb_next(node)) {
+		struct ftrace_filter *fl;
+
+		fl = rb_entry(node, struct ftrace_filter, node);
+
+		/* notrace filters can hide the functions in skipped data */
+		if ((fl->trigger.flags & TRIGGER_FL_FILTER) &&
+		    fl->trigger.fmode != FILTER_MODE_IN)
+			*ok = false;
+
+		/* time filters are applied outside of the filters */
+		if (fl->trigger.flags & TRIGGER_FL_TIME_FILTER)
+			*ok = false;
+	}
+	return !*ok;
+}
+
+struct filter_index_arg {
+	unsigned long addr;
+	bool found;
+};
+
+static int find_filter_index(struct ftrace_session *s, void *arg)
+{
+	struct filter_index_arg *fia = arg;
+	struct ftrace_trigger tr = {};
+
+	if (ftrace_match_filter(&s->filters, fia->addr, &tr) &&
+	    (tr.flags & TRIGGER_FL_FILTER))
+		fia->found = true;
+
+	return fia->found;
+}
+
+static bool match_filter_index(unsigned long addr, void *arg)
+{
+	struct filter_index_arg fia = {
+		.addr = addr,
+	};
+
+	walk_sessions(find_filter_index, &fia);
+	return fia.found;
+}
+
+/**
+ * fstack_setup_filter_index - setup function index for (-F) filters
+ * @handle: file handle
+ *
+ * This function sets up the function index to skip task data outside
+ * of the filtered functions.  It's only possible when filters are used
+ * for selecting functions (not for hiding).
+ *
+ * This function returns 0 if the index is set, -1 otherwise.
+ */
+int fstack_setup_filter_index(struct ftrace_file_handle *handle)
+{
+	bool ok = true;
+
+	if (fstack_filter_mode != FILTER_MODE_IN)
+		return -1;
+
+	walk_sessions(check_filter_index, &ok);
+	if (!ok)
+		return -1;
+
+	return fstack_setup_func_index(handle, match_filter_index, NULL);
+}
+
+/* restore the function stack saved at the start of @seg */
+static void restore_func_index(struct ftrace_task_handle *task,
+			       struct uftrace_func_index_seg *seg)
+{
+	struct uftrace_func_index_frame *frames = (void *)(seg + 1);
+	int depth;
+	int i;
+
+	task->stack_count = seg->nr_frames;
+	if (task->stack_count >= task->h->hdr.max_stack)
+		task->stack_count = task->h->hdr.max_stack - 1;
+	task->user_stack_count = task->stack_count;
+	task->fstack_set = true;
+
+	/* functions outside of the filters are not recorded */
+	if (fstack_filter_mode == FILTER_MODE_IN)
+		depth = task->filter.depth;
+	else
+		depth = task->h->depth;
+
+	for (i = 0; i < task->stack_count; i++) {
+		struct fstack *fstack = &task->func_stack[i];
+
+		fstack->addr = frames[i].addr;
+		fstack->total_time = frames[i].time;
+		fstack->child_time = frames[i].child_time;
+		fstack->valid = true;
+		fstack->orig_depth = depth;
+		fstack->flags = 0;
+
+		/* unknown functions before the first record */
+		if (fstack->addr == 0)
+			continue;
+
+		if (fstack_filter_mode == FILTER_MODE_IN || depth <= 0)
+			fstack->flags |= FSTACK_FL_NORECORD;
+		else
+			depth--;
+	}
+	task->filter.depth = depth;
+}
+
+/**
+ * fstack_skip_func_index - skip task data using the function index
+ * @task: tracee task
+ *
+ * This function moves the file position of @task to the next segment
+ * which calls the functions set by fstack_setup_func_index().  Callers
+ * should call this only when the task is not in the functions.  The
+ * function stack is restored from the index as if it read all records
+ * in the skipped segments.
+ */
+void fstack_skip_func_index(struct ftrace_task_handle *task)
+{
+	struct fstack_func_index *fi = task->func_index;
+	struct uftrace_func_index_seg *seg;
+	uint64_t pos;
+	int lo, hi, mid;
+
+	if (fi == NULL || task->done || task->valid)
+		return;
+
+	/* the task has pending records or is in the filtered functions */
+	if (task->rstack_list.count || task->filter.in_count ||
+	    task->filter.out_count || task->filter.time)
+		return;
+
+	pos = ftell(task->fp);
+
+	/* find the current segment */
+	lo = 0;
+	hi = fi->nr_segs - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+
+		if (fi->segs[mid]->offset <= pos)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	if (fi->next[lo] == lo)
+		return;
+
+	seg = fi->segs[fi->next[lo]];
+	if (fseek(task->fp, seg->offset, SEEK_SET) < 0)
+		return;
+
+	pr_dbg2("task %d: skip to offset %"PRIu64" using function index\n",
+		task->tid, seg->offset);
+
+	restore_func_index(task, seg);
+}
+
+/**
+ * fstack_setup_checkpoints - setup checkpoints to read task data in slices
+ * @handle: file handle
+ *
+ * This function loads (or builds) the function index of each task to
+ * use the call stacks saved in the index as checkpoints.  Then the data
+ * can be split by fstack_split_time() and each time slice can be read
+ * separately after fstack_set_time_slice().
+ *
+ * This function returns 0 if succeeded, -1 otherwise.
+ */
+int fstack_setup_checkpoints(struct ftrace_file_handle *handle)
+{
+	struct ftrace_task_handle *task;
+	struct fstack_func_index *fi;
+	int k, n;
+
+	/* kernel records are not indexed, and data should not grow */
+	if (handle->kern || !fstack_enabled || handle->follow)
+		return -1;
+
+	for (n = 0; n < handle->nr_tasks; n++) {
+		task = &handle->tasks[n];
+
+		if (task->fp == NULL || task->func_stack == NULL)
+			continue;
+
+		if (task->func_index)
+			continue;
+
+		fi = setup_task_func_index(handle, task);
+		if (fi == NULL)
+			return -1;
+
+		/* do not skip any segment */
+		for (k = 0; k < fi->nr_segs; k++)
+			fi->next[k] = k;
+
+		task->func_index = fi;
+	}
+	return 0;
+}
+
+/* find the first checkpoint at or after @time (or the last one) */
+static int find_checkpoint(struct fstack_func_index *fi, uint64_t time)
+{
+	int lo = 0;
+	int hi = fi->nr_segs - 1;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (fi->segs[mid]->time < time)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * fstack_split_time - split task data into time slices
+ * @handle: file handle
+ * @nr_slices: number of slices
+ * @bounds: start time of each slice (output)
+ *
+ * This function chooses the start time of each slice from the
+ * checkpoints so that the slices have similar amount of records.
+ * The first slice always starts at 0.
+ *
+ * This function returns the number of slices which can be less than
+ * @nr_slices for small data.
+ */
+int fstack_split_time(struct ftrace_file_handle *handle, int nr_slices,
+		      uint64_t *bounds)
+{
+	struct fstack_func_index *fi;
+	uint64_t *times = NULL;
+	size_t nr_times = 0;
+	int i, k, n = 1;
+
+	for (i = 0; i < handle->nr_tasks; i++) {
+		fi = handle->tasks[i].func_index;
+		if (fi == NULL)
+			continue;
+
+		/* the last one is the end of data */
+		times = xrealloc(times, (nr_times + fi->nr_segs) *
+				 sizeof(*times));
+		for (k = 0; k < fi->nr_segs - 1; k++)
+			times[nr_times++] = fi->segs[k]->time;
+	}
+
+	bounds[0] = 0;
+	if (nr_times == 0)
+		goto out;
+
+	qsort(times, nr_times, sizeof(*times), cmp_func_addr);
+
+	for (i = 1; i < nr_slices; i++) {
+		uint64_t t = times[i * nr_times / nr_slices];
+
+		if (t > bounds[n - 1])
+			bounds[n++] = t;
+	}
+
+out:
+	free(times);
+	return n;
+}
+
+/**
+ * fstack_set_time_slice - set task data to read in the time slice
+ * @handle: file handle
+ * @start: start time of the slice
+ * @end: end time of the slice (0 means the end of data)
+ *
+ * This function moves each task to the first checkpoint in the slice
+ * and restores the function stack there.  Records from the checkpoint
+ * before @end will be read.  Task data is read by pread() so other
+ * processes can read the same files in parallel.
+ */
+void fstack_set_time_slice(struct ftrace_file_handle *handle,
+			   uint64_t start, uint64_t end)
+{
+	struct ftrace_task_handle *task;
+	struct fstack_func_index *fi;
+	int first, last;
+	int n;
+
+	for (n = 0; n < handle->nr_tasks; n++) {
+		task = &handle->tasks[n];
+		fi = task->func_index;
+
+		if (task->fp == NULL)
+			continue;
+
+		if (fi == NULL) {
+			task->done = true;
+			continue;
+		}
+
+		first = find_checkpoint(fi, start);
+		last = fi->nr_segs - 1;
+		if (end)
+			last = find_checkpoint(fi, end);
+
+		if (first >= last ||
+		    fseek(task->fp, fi->segs[first]->offset, SEEK_SET) < 0) {
+			task->done = true;
+			continue;
+		}
+
+		if (first > 0)
+			restore_func_index(task, fi->segs[first]);
+		if (last < fi->nr_segs - 1)
+			task->stop_offset = fi->segs[last]->offset;
+
+		pr_dbg2("task %d: read checkpoints %d to %d\n",
+			task->tid, first, last);
+	}
+}
+
+/**
+ * get_task_ustack - read task's user function record
+ * @handle: file handle
+ * @idx: task index
+ *
+ * This function returns current ftrace record of @idx-th task from
+ * data file in @handle.
+ */
+static struct ftrace_ret_stack *
+get_task_ustack(struct ftrace_file_handle *handle, int idx)
+{
+	struct ftrace_task_handle *task;
+	struct ftrace_ret_stack *curr;
+	struct uftrace_rstack_list *rstack_list;
+	int ret;
+
+	task = &handle->tasks[idx];
+	rstack_list = &task->rstack_list;
+
+	if (rstack_list->count && !task->rstack_pending)
+		goto out;
+
+	task->rstack_pending = false;
+
+	/*
+	 * read task (user) stack until it found an entry that exceeds
+	 * the given time filter (-t option).
+	 */
+	while ((ret = read_task_ustack(handle, task)) == 0) {
+		struct ftrace_session *sess;
+		struct ftrace_trigger tr = {};
+		uint64_t time_filter = handle->time_filter;
+
+		curr = &task->ustack;
+
+		/* prevent ustack from invalid access */
+		task->valid = false;
+
+		if (!check_time_range(&handle->time_range, curr->time)) {
+			if (!task->index_checked)
+				seek_task_index(handle, task);
+			continue;
+		}
+
+		sess = get_task_session(task, curr->time);
+
+		if (sess)
+			ftrace_match_filter(&sess->filters,
+					    curr->addr, &tr);
+
+		if (task->filter.time)
+			time_filter = task->filter.time->threshold;
+
+		if (curr->type == FTRACE_ENTRY) {
+			/* it needs to wait until matching exit found */
+			add_to_rstack_list(rstack_list, curr, &task->args);
+
+			if (tr.flags & TRIGGER_FL_TIME_FILTER) {
+				struct time_filter_stack *tfs;
+
+				tfs = xmalloc(sizeof(*tfs));
+				tfs->next = task->filter.time;
+				tfs->depth = curr->depth;
+				tfs->context = FSTACK_CTX_USER;
+				tfs->threshold = tr.time;
+
+				task->filter.time = tfs;
+			}
+		}
+		else if (curr->type == FTRACE_EXIT) {
+			struct uftrace_rstack_list_node *last;
+			uint64_t delta;
+
+			if (task->filter.time) {
+				struct time_filter_stack *tfs;
+
+				tfs = task->filter.time;
+				if (tfs->depth == curr->depth &&
+				    tfs->context == FSTACK_CTX_USER) {
+					/* discard stale filter */
+					task->filter.time = tfs->next;
+					free(tfs);
+				}
+			}
+
+			if (rstack_list->count == 0) {
+				/* it's already exceeded time filter, just return */
+				add_to_rstack_list(rstack_list, curr, &task->args);
+				break;
+			}
+
+			last = list_last_entry(&rstack_list->read,
+					       typeof(*last), list);
+			delta = curr->time - last->rstack.time;
+
+			if (delta < time_filter) {
+				/*
+				 * it might set TRACE trigger, which shows
+				 * function even if it's less than the time
+				 * filter.
+				 */
+				if (tr.flags & TRIGGER_FL_TRACE) {
+					add_to_rstack_list(rstack_list, curr,
+							   &task->args);
+					break;
+				}
+
+				/* also delete matching entry (at the last) */
+				delete_last_rstack_list(rstack_list);
+			} else {
+				/* found! process all existing rstacks in the list */
+				add_to_rstack_list(rstack_list, curr, &task->args);
+				break;
+			}
+		}
+		else {
+			/* TODO: handle LOST properly */
+			add_to_rstack_list(rstack_list, curr, &task->args);
+			break;
+		}
+
+	}
+
+	if (ret < 0) {
+		/*
+		 * With a time filter, the entries in the list should wait
+		 * for the exit which will be written later (--follow).
+		 * Otherwise they'll be shown anyway.
+		 */
+		if (!task->done && rstack_list->count &&
+		    (handle->time_filter || task->filter.time)) {
+			task->rstack_pending = true;
+			return NULL;
+		}
+
+		if (rstack_list->count == 0)
+			return NULL;
+	}
+
+out:
+	task->valid = true;
+	curr = get_first_rstack_list(rstack_list);
+	memcpy(&task->ustack, curr, sizeof(*task->rstack));
+
+	return &task->ustack;
+}
+
+static int read_user_stack(struct ftrace_file_handle *handle,
+			   struct ftrace_task_handle **task)
+{
+	int i, next_i = -1;
+	uint64_t next_time = 0;
+	struct ftrace_ret_stack *tmp;
+
+	for (i = 0; i < handle->info.nr_tid; i++) {
+		tmp = get_task_ustack(handle, i);
+		if (tmp == NULL)
+			continue;
+
+		if (next_i < 0 || tmp->time < next_time) {
+			next_time = tmp->time;
+			next_i = i;
+		}
+	}
+
+	if (next_i < 0)
+		return -1;
+
+	*task = &handle->tasks[next_i];
+
+	return next_i;
+}
+
+static void fstack_account_time(struct ftrace_task_handle *task)
+{
+	struct fstack *fstack;
+	struct ftrace_ret_stack *rstack = task->rstack;
+	bool is_kernel_func = (rstack == &task->kstack);
+	int i;
+
+	if (!task->fstack_set) {
+
+		/* inherit stack count after [v]fork() or recover from lost */
+		task->stack_count = rstack->depth;
+		if (rstack->type == FTRACE_EXIT) {
+			task->stack_count++;
+			/* [v]fork() usually starts with EXIT in child */
+			task->display_depth_set = false;
+		}
+		task->fstack_set = true;
+
+
+		if (is_kernel_func)
+			task->stack_count += task->user_stack_count;
+
+		/* calculate duration from now on */
+		for (i = 0; i < task->stack_count; i++) {
+			fstack = &task->func_stack[i];
+
+			fstack->total_time = rstack->time;  /* start time */
+			fstack->child_time = 0;
+			fstack->valid = true;
+		}
+
+		task->filter.depth = task->h->depth;
+	}
 
 	if (task->lost_seen) {
 		uint64_t timestamp_after_lost;
@@ -1618,6 +2606,13 @@ static void fstack_test_finish_file(void)
 
 		remove(filename);
 		free(filename);
+
+		if (asprintf(&filename, "%s/%d.fidx",
+			     handle->dirname, handle->info.tids[i]) < 0)
+			return;
+
+		remove(filename);
+		free(filename);
 	}
 	remove(handle->dirname);
 	handle->dirname = NULL;
@@ -1716,4 +2711,184 @@ TEST_CASE(fstack_time)
 	return TEST_OK;
 }
 
+static bool fstack_test_match(unsigned long addr, void *arg)
+{
+	return addr == *(unsigned long *)arg;
+}
+
+TEST_CASE(fstack_func_index)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+	unsigned long addr = 0x40000;
+	int i;
+
+	/* reset filters set by other tests */
+	handle->depth = OPT_DEPTH_DEFAULT;
+	handle->time_filter = 0;
+
+	TEST_EQ(fstack_test_setup_file(handle, 1), 0);
+
+	/* a segment per record: only the first one calls the function */
+	func_index_seg_records = 1;
+	TEST_EQ(fstack_setup_func_index(handle, fstack_test_match, &addr), 0);
+	func_index_seg_records = 1024;
+
+	task = &handle->tasks[0];
+	TEST_NE(task->func_index, NULL);
+	TEST_EQ(task->func_index->nr_segs, NUM_RECORD + 1);
+
+	/* entry records are kept in the rstack list until an exit */
+	for (i = 0; i < NUM_RECORD - 1; i++) {
+		TEST_EQ(read_rstack(handle, &task), 0);
+		TEST_EQ((uint64_t)task->rstack->addr,
+			(uint64_t)test_record[0][i].addr);
+	}
+	TEST_EQ(task->stack_count, 1);
+
+	/* it skips to the end of data and restores the stack there */
+	fstack_skip_func_index(task);
+	TEST_EQ(task->stack_count, 0);
+	TEST_EQ(read_rstack(handle, &task), -1);
+
+	return TEST_OK;
+}
+
+TEST_CASE(fstack_checkpoint)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+
+	handle->depth = OPT_DEPTH_DEFAULT;
+	handle->time_filter = 0;
+
+	TEST_EQ(fstack_test_setup_file(handle, 1), 0);
+
+	func_index_seg_records = 1;
+	TEST_EQ(fstack_setup_checkpoints(handle), 0);
+	func_index_seg_records = 1024;
+
+	/* start from the third record: both functions are running */
+	fstack_set_time_slice(handle, 300, 0);
+
+	task = &handle->tasks[0];
+	TEST_EQ(task->stack_count, 2);
+
+	TEST_EQ(read_rstack(handle, &task), 0);
+	TEST_EQ((uint64_t)task->rstack->addr, (uint64_t)0x41000);
+	TEST_EQ(task->func_stack[1].total_time, (uint64_t)100);
+
+	TEST_EQ(read_rstack(handle, &task), 0);
+	TEST_EQ((uint64_t)task->rstack->addr, (uint64_t)0x40000);
+	TEST_EQ(task->func_stack[0].total_time, (uint64_t)300);
+	TEST_EQ(task->func_stack[0].child_time, (uint64_t)100);
+
+	TEST_EQ(read_rstack(handle, &task), -1);
+
+	return TEST_OK;
+}
+
+static void fstack_test_write_file(struct ftrace_file_handle *handle, int idx)
+{
+	char *filename = NULL;
+	FILE *fp;
+
+	xasprintf(&filename, "%s/%d.dat", handle->dirname, test_tids[idx]);
+
+	fp = fopen(filename, "w");
+	if (fp) {
+		fwrite(test_record[idx], sizeof(test_record[idx][0]),
+		       ARRAY_SIZE(test_record[idx]), fp);
+		fclose(fp);
+	}
+	free(filename);
+}
+
+TEST_CASE(fstack_follow)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+	char *filename = NULL;
+	uint64_t times[] = { 150, 250, 300, 350, 400, 450 };
+	int tids[] = { 1, 1, 0, 1, 0, 1 };
+	unsigned i;
+
+	handle->depth = OPT_DEPTH_DEFAULT;
+	handle->time_filter = 0;
+
+	TEST_EQ(fstack_test_setup_file(handle, 1), 0);
+	handle->follow = true;
+
+	/* two records and a half are written */
+	xasprintf(&filename, "%s/%d.dat", handle->dirname, test_tids[0]);
+	TEST_EQ(truncate(filename, 2 * sizeof(test_record[0][0]) + 8), 0);
+	free(filename);
+
+	TEST_EQ(read_rstack(handle, &task), 0);
+	TEST_EQ(task->rstack->time, (uint64_t)100);
+	TEST_EQ(read_rstack(handle, &task), 0);
+	TEST_EQ(task->rstack->time, (uint64_t)200);
+	TEST_EQ(read_rstack(handle, &task), -1);
+	TEST_EQ(handle->tasks[0].done, false);
+
+	/* the rest of data and a new task are written */
+	fstack_test_write_file(handle, 0);
+	fstack_test_write_file(handle, 1);
+
+	handle->info.nr_tid = 2;
+	test_tasks[1].tid = test_tids[1];
+	update_task_handle(handle);
+	TEST_EQ(handle->nr_tasks, 2);
+	handle->tasks[1].t = &test_tasks[1];
+
+	/* the recording is finished */
+	handle->follow = false;
+
+	for (i = 0; i < ARRAY_SIZE(times); i++) {
+		TEST_EQ(read_rstack(handle, &task), 0);
+		TEST_EQ(task->tid, test_tids[tids[i]]);
+		TEST_EQ(task->rstack->time, times[i]);
+	}
+	TEST_EQ(read_rstack(handle, &task), -1);
+
+	return TEST_OK;
+}
+
+TEST_CASE(fstack_follow_time)
+{
+	struct ftrace_file_handle *handle = &fstack_test_handle;
+	struct ftrace_task_handle *task;
+	char *filename = NULL;
+
+	handle->depth = OPT_DEPTH_DEFAULT;
+	/* this makes to discard depth 1 records */
+	handle->time_filter = 200;
+
+	TEST_EQ(fstack_test_setup_file(handle, 1), 0);
+	handle->follow = true;
+
+	/* the exit of the depth 0 function is not written yet */
+	xasprintf(&filename, "%s/%d.dat", handle->dirname, test_tids[0]);
+	TEST_EQ(truncate(filename, 3 * sizeof(test_record[0][0])), 0);
+	free(filename);
+
+	/* the entry should wait for the exit to check the time filter */
+	TEST_EQ(read_rstack(handle, &task), -1);
+	TEST_EQ(read_rstack(handle, &task), -1);
+	TEST_EQ(handle->tasks[0].done, false);
+
+	fstack_test_write_file(handle, 0);
+
+	TEST_EQ(read_rstack(handle, &task), 0);
+	TEST_EQ(task->rstack->time, (uint64_t)100);
+	TEST_EQ(read_rstack(handle, &task), 0);
+	TEST_EQ(task->rstack->time, (uint64_t)400);
+
+	/* the recording is finished */
+	handle->follow = false;
+	TEST_EQ(read_rstack(handle, &task), -1);
+
+	return TEST_OK;
+}
+
 #endif /* UNIT_TEST */
@@ -9,6 +9,7 @@
 
 struct sym;
 struct ftrace_trigger;
+struct fstack_func_index;
 
 enum fstack_flag {
 	FSTACK_FL_FILTERED	= (1U << 0),
@@ -38,10 +39,17 @@ struct ftrace_task_handle {
 	bool lost_seen;
 	bool fstack_set;
 	bool display_depth_set;
+	bool index_checked;
+	/* rstack_list has entries waiting for their exit (--follow) */
+	bool rstack_pending;
 	FILE *fp;
 	struct sym *func;
 	struct ftrace_task *t;
 	struct ftrace_file_handle *h;
+	/* cached session which is valid in [sess_start, sess_end) */
+	struct ftrace_session *sess;
+	uint64_t sess_start;
+	uint64_t sess_end;
 	struct ftrace_ret_stack ustack;
 	struct ftrace_ret_stack kstack;
 	struct ftrace_ret_stack *rstack;
@@ -70,6 +78,9 @@ struct ftrace_task_handle {
 		uint64_t child_time;
 	} *func_stack;
 	struct fstack_arguments args;
+	struct fstack_func_index *func_index;
+	/* file offset to stop reading (for time slices) */
+	uint64_t stop_offset;
 };
 
 enum argspec_string_bits {
@@ -98,6 +109,9 @@ void setup_task_handle(struct ftrace_file_handle *handle,
 struct ftrace_task_handle *get_task_handle(struct ftrace_file_handle *handle,
 					   int tid);
 void reset_task_handle(struct ftrace_file_handle *handle);
+void update_task_handle(struct ftrace_file_handle *handle);
+struct ftrace_session *get_task_session(struct ftrace_task_handle *task,
+					uint64_t timestamp);
 
 int read_rstack(struct ftrace_file_handle *handle,
 		struct ftrace_task_handle **task);
@@ -128,6 +142,18 @@ struct ftrace_task_handle *fstack_skip(struct ftrace_file_handle *handle,
 				       struct ftrace_task_handle *task,
 				       int curr_depth);
 bool fstack_check_filter(struct ftrace_task_handle *task);
+
+typedef bool (*func_index_match_t)(unsigned long addr, void *arg);
+
+int fstack_setup_func_index(struct ftrace_file_handle *handle,
+			    func_index_match_t match, void *arg);
+int fstack_setup_filter_index(struct ftrace_file_handle *handle);
+void fstack_skip_func_index(struct ftrace_task_handle *task);
+int fstack_setup_checkpoints(struct ftrace_file_handle *handle);
+int fstack_split_time(struct ftrace_file_handle *handle, int nr_slices,
+		      uint64_t *bounds);
+void fstack_set_time_slice(struct ftrace_file_handle *handle,
+			   uint64_t start, uint64_t end);
 void get_argspec_string(struct ftrace_task_handle *task,
 		        char *args, size_t len,
 		        enum argspec_string_bits str_mode);
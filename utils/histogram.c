@@ -0,0 +1,242 @@
+/*
+ * latency histogram routines for uftrace
+ *
+ * It keeps the distribution of function execution times in a bounded
+ * memory to get percentiles.  Histograms can be merged so the result
+ * doesn't depend on how the data was split (threads or processes).
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "hist"
+#define PR_DOMAIN  DBG_FTRACE
+
+#include "utils/utils.h"
+#include "utils/histogram.h"
+
+/* values less than this are counted exactly */
+#define HIST_LINEAR_MAX  (2 * HIST_SUB_BUCKETS)
+
+unsigned hist_index(uint64_t val)
+{
+	unsigned shift;
+
+	if (val < HIST_LINEAR_MAX)
+		return val;
+
+	shift = 63 - __builtin_clzll(val) - HIST_SUB_BITS;
+	return shift * HIST_SUB_BUCKETS + (val >> shift);
+}
+
+uint64_t hist_bucket_start(unsigned idx)
+{
+	unsigned shift;
+
+	if (idx < HIST_LINEAR_MAX)
+		return idx;
+
+	shift = idx / HIST_SUB_BUCKETS - 1;
+	return (uint64_t)(idx - shift * HIST_SUB_BUCKETS) << shift;
+}
+
+static uint64_t hist_bucket_size(unsigned idx)
+{
+	if (idx < HIST_LINEAR_MAX)
+		return 1;
+
+	return 1ULL << (idx / HIST_SUB_BUCKETS - 1);
+}
+
+/* make sure the buckets from @first to @last are allocated */
+static void hist_expand(struct uftrace_hist *hist, unsigned first, unsigned last)
+{
+	unsigned start = hist->start;
+	unsigned end = hist->start + hist->nr;
+
+	if (hist->nr == 0) {
+		start = first;
+		end = last + 1;
+	}
+	else if (first >= start && last < end)
+		return;
+
+	if (first < start)
+		start = first;
+	if (last >= end)
+		end = last + 1;
+
+	hist->counts = xrealloc(hist->counts, (end - start) * sizeof(*hist->counts));
+
+	if (hist->nr) {
+		/* move existing buckets to the new position */
+		memmove(hist->counts + (hist->start - start), hist->counts,
+			hist->nr * sizeof(*hist->counts));
+		memset(hist->counts, 0, (hist->start - start) * sizeof(*hist->counts));
+		memset(hist->counts + (hist->start - start) + hist->nr, 0,
+		       (end - hist->start - hist->nr) * sizeof(*hist->counts));
+	}
+	else {
+		memset(hist->counts, 0, (end - start) * sizeof(*hist->counts));
+	}
+
+	hist->start = start;
+	hist->nr = end - start;
+}
+
+void hist_add(struct uftrace_hist *hist, uint64_t val, uint64_t count)
+{
+	unsigned idx = hist_index(val);
+
+	if (count == 0)
+		return;
+
+	hist_expand(hist, idx, idx);
+	hist->counts[idx - hist->start] += count;
+
+	if (hist->total == 0 || hist->min > val)
+		hist->min = val;
+	if (hist->total == 0 || hist->max < val)
+		hist->max = val;
+
+	hist->total += count;
+}
+
+void hist_merge(struct uftrace_hist *dst, struct uftrace_hist *src)
+{
+	unsigned i;
+
+	if (src->total == 0)
+		return;
+
+	hist_expand(dst, src->start, src->start + src->nr - 1);
+
+	for (i = 0; i < src->nr; i++)
+		dst->counts[src->start - dst->start + i] += src->counts[i];
+
+	if (dst->total == 0 || dst->min > src->min)
+		dst->min = src->min;
+	if (dst->total == 0 || dst->max < src->max)
+		dst->max = src->max;
+
+	dst->total += src->total;
+}
+
+/**
+ * hist_percentile - get an approximate value at the given percentile
+ * @hist: histogram
+ * @pct: percentile (0 - 100)
+ *
+ * This function returns the middle of the bucket containing the value
+ * at @pct.  The result is between the min and max value.
+ */
+uint64_t hist_percentile(struct uftrace_hist *hist, double pct)
+{
+	uint64_t rank;
+	uint64_t sum = 0;
+	uint64_t val;
+	unsigned i;
+
+	if (hist->total == 0)
+		return 0;
+
+	rank = (uint64_t)(pct * hist->total / 100);
+	if (rank * 100 < pct * hist->total)
+		rank++;
+
+	/* the first and the last values are known exactly */
+	if (rank <= 1)
+		return hist->min;
+	if (rank >= hist->total)
+		return hist->max;
+
+	for (i = 0; i < hist->nr; i++) {
+		sum += hist->counts[i];
+		if (sum >= rank)
+			break;
+	}
+
+	if (i == hist->nr)
+		return hist->max;
+
+	i += hist->start;
+	val = hist_bucket_start(i) + hist_bucket_size(i) / 2;
+
+	if (val < hist->min)
+		val = hist->min;
+	if (val > hist->max)
+		val = hist->max;
+
+	return val;
+}
+
+void hist_free(struct uftrace_hist *hist)
+{
+	free(hist->counts);
+	memset(hist, 0, sizeof(*hist));
+}
+
+#ifdef UNIT_TEST
+TEST_CASE(histogram_index)
+{
+	uint64_t val;
+	unsigned idx;
+
+	for (val = 0; val < HIST_LINEAR_MAX; val++)
+		TEST_EQ(hist_index(val), (unsigned)val);
+
+	for (val = 1; val < (1ULL << 62); val = val * 3 + 1) {
+		idx = hist_index(val);
+
+		TEST_GE(val, hist_bucket_start(idx));
+		TEST_LT(val, hist_bucket_start(idx) + hist_bucket_size(idx));
+		TEST_EQ(hist_bucket_start(idx + 1),
+			hist_bucket_start(idx) + hist_bucket_size(idx));
+	}
+
+	return TEST_OK;
+}
+
+TEST_CASE(histogram_percentile)
+{
+	struct uftrace_hist hist = {};
+	struct uftrace_hist hist1 = {};
+	struct uftrace_hist hist2 = {};
+	uint64_t val;
+	uint64_t p50, p99;
+
+	for (val = 1; val <= 10000; val++) {
+		hist_add(&hist, val * 1000, 1);
+		/* split odd and even values */
+		hist_add(val % 2 ? &hist1 : &hist2, val * 1000, 1);
+	}
+
+	TEST_EQ(hist.total, 10000ULL);
+	TEST_EQ(hist_percentile(&hist, 0), 1000ULL);
+	TEST_EQ(hist_percentile(&hist, 100), 10000000ULL);
+
+	/* relative error should be small */
+	p50 = hist_percentile(&hist, 50);
+	p99 = hist_percentile(&hist, 99);
+	TEST_LT(p50 > 5000000 ? p50 - 5000000 : 5000000 - p50, 5000000ULL / 32);
+	TEST_LT(p99 > 9900000 ? p99 - 9900000 : 9900000 - p99, 9900000ULL / 32);
+
+	/* merged histogram should be same */
+	hist_merge(&hist1, &hist2);
+	TEST_EQ(hist1.total, hist.total);
+	TEST_EQ(hist1.start, hist.start);
+	TEST_EQ(hist1.nr, hist.nr);
+	TEST_MEMEQ(hist1.counts, hist.counts, hist.nr * sizeof(*hist.counts));
+	TEST_EQ(hist_percentile(&hist1, 99.9), hist_percentile(&hist, 99.9));
+
+	hist_free(&hist);
+	hist_free(&hist1);
+	hist_free(&hist2);
+
+	TEST_EQ(hist_percentile(&hist, 50), 0ULL);
+	return TEST_OK;
+}
+#endif /* UNIT_TEST */
@@ -0,0 +1,32 @@
+#ifndef __FTRACE_HISTOGRAM_H__
+#define __FTRACE_HISTOGRAM_H__
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram of time values (in nsec).  Each power of 2 is
+ * split into HIST_SUB_BUCKETS buckets so the relative error is about
+ * 1/HIST_SUB_BUCKETS regardless of the value.  Only the buckets between
+ * the lowest and the highest value are allocated.
+ */
+#define HIST_SUB_BITS     5
+#define HIST_SUB_BUCKETS  (1U << HIST_SUB_BITS)
+
+struct uftrace_hist {
+	uint64_t *counts;
+	unsigned start;		/* index of the first bucket in counts */
+	unsigned nr;		/* number of buckets in counts */
+	uint64_t total;		/* number of values */
+	uint64_t min;
+	uint64_t max;
+};
+
+unsigned hist_index(uint64_t val);
+uint64_t hist_bucket_start(unsigned idx);
+
+void hist_add(struct uftrace_hist *hist, uint64_t val, uint64_t count);
+void hist_merge(struct uftrace_hist *dst, struct uftrace_hist *src);
+uint64_t hist_percentile(struct uftrace_hist *hist, double pct);
+void hist_free(struct uftrace_hist *hist);
+
+#endif /* __FTRACE_HISTOGRAM_H__ */
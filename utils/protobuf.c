@@ -0,0 +1,158 @@
+/*
+ * protocol buffer encoding routines for uftrace
+ *
+ * Only the wire types needed to write perfetto traces (varint and
+ * length-delimited) are supported.
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "protobuf"
+#define PR_DOMAIN  DBG_FTRACE
+
+#include "utils/utils.h"
+#include "utils/protobuf.h"
+
+static void pb_reserve(struct pb_buf *pb, size_t len)
+{
+	if (pb->len + len <= pb->size)
+		return;
+
+	pb->size = ALIGN(pb->len + len, 4096);
+	pb->data = xrealloc(pb->data, pb->size);
+}
+
+void pb_varint(struct pb_buf *pb, uint64_t val)
+{
+	pb_reserve(pb, 10);
+
+	while (val >= 0x80) {
+		pb->data[pb->len++] = (val & 0x7f) | 0x80;
+		val >>= 7;
+	}
+	pb->data[pb->len++] = val;
+}
+
+void pb_uint(struct pb_buf *pb, int field, uint64_t val)
+{
+	pb_varint(pb, field << 3);  /* wire type 0: varint */
+	pb_varint(pb, val);
+}
+
+void pb_string(struct pb_buf *pb, int field, const char *str)
+{
+	size_t len = strlen(str);
+
+	pb_varint(pb, (field << 3) | 2);  /* wire type 2: length-delimited */
+	pb_varint(pb, len);
+	pb_reserve(pb, len);
+	memcpy(pb->data + pb->len, str, len);
+	pb->len += len;
+}
+
+/* start a nested message and return the position of the length */
+size_t pb_begin(struct pb_buf *pb, int field)
+{
+	size_t pos;
+
+	pb_varint(pb, (field << 3) | 2);
+	pb_reserve(pb, PB_LEN_SIZE);
+
+	pos = pb->len;
+	pb->len += PB_LEN_SIZE;
+	return pos;
+}
+
+void pb_end(struct pb_buf *pb, size_t pos)
+{
+	size_t len = pb->len - pos - PB_LEN_SIZE;
+	int i;
+
+	/* the length should fit in the reserved bytes */
+	assert(len < (1UL << (7 * PB_LEN_SIZE)));
+
+	/* use redundant varint encoding to fill the reserved bytes */
+	for (i = 0; i < PB_LEN_SIZE - 1; i++) {
+		pb->data[pos + i] = (len & 0x7f) | 0x80;
+		len >>= 7;
+	}
+	pb->data[pos + i] = len;
+}
+
+#ifdef UNIT_TEST
+TEST_CASE(protobuf_varint)
+{
+	struct pb_buf pb = {};
+	unsigned char expect[] = {
+		0x00,					/* 0 */
+		0x7f,					/* 127 */
+		0xac, 0x02,				/* 300 */
+		0xff, 0xff, 0xff, 0xff, 0xff,		/* UINT64_MAX */
+		0xff, 0xff, 0xff, 0xff, 0x01,
+		0x10, 0x96, 0x01,			/* field 2: 150 */
+	};
+
+	pb_varint(&pb, 0);
+	pb_varint(&pb, 127);
+	pb_varint(&pb, 300);
+	pb_varint(&pb, UINT64_MAX);
+	pb_uint(&pb, 2, 150);
+
+	TEST_EQ(pb.len, sizeof(expect));
+	TEST_MEMEQ(pb.data, expect, sizeof(expect));
+
+	free(pb.data);
+	return TEST_OK;
+}
+
+TEST_CASE(protobuf_nested)
+{
+	struct pb_buf pb = {};
+	unsigned char expect[] = {
+		0x0a, 0x8a, 0x80, 0x80, 0x00,		/* field 1: len 10 */
+		0x12, 0x83, 0x80, 0x80, 0x00,		/* field 2: len 3 */
+		0x08, 0x96, 0x01,			/* field 1: 150 */
+		0x1a, 0x00,				/* field 3: "" */
+		0x22, 0x02, 'h', 'i',			/* field 4: "hi" */
+	};
+	size_t outer, inner;
+	char *str;
+
+	outer = pb_begin(&pb, 1);
+	inner = pb_begin(&pb, 2);
+	pb_uint(&pb, 1, 150);
+	pb_end(&pb, inner);
+	pb_string(&pb, 3, "");
+	pb_end(&pb, outer);
+	pb_string(&pb, 4, "hi");
+
+	TEST_EQ(pb.len, sizeof(expect));
+	TEST_MEMEQ(pb.data, expect, sizeof(expect));
+
+	/* long data needs multiple bytes in the length */
+	pb.len = 0;
+	str = xmalloc(300);
+	memset(str, 'x', 299);
+	str[299] = '\0';
+
+	outer = pb_begin(&pb, 1);
+	pb_string(&pb, 2, str);
+	pb_end(&pb, outer);
+
+	/* 1 (tag) + 2 (len) + 299 */
+	TEST_EQ((unsigned char)pb.data[1], 0xae);
+	TEST_EQ((unsigned char)pb.data[2], 0x82);
+	TEST_EQ((unsigned char)pb.data[3], 0x80);
+	TEST_EQ((unsigned char)pb.data[4], 0x00);
+	TEST_EQ(pb.len, 1 + PB_LEN_SIZE + 302UL);
+
+	free(str);
+	free(pb.data);
+	return TEST_OK;
+}
+#endif /* UNIT_TEST */
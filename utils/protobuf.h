@@ -0,0 +1,27 @@
+#ifndef __FTRACE_PROTOBUF_H__
+#define __FTRACE_PROTOBUF_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * A minimal protocol buffer encoder (for perfetto traces).  Messages are
+ * encoded in a growing buffer.  Nested messages reserve PB_LEN_SIZE bytes
+ * for the length and fill them with a (padded) varint at the end so that
+ * no data needs to be moved.
+ */
+#define PB_LEN_SIZE  4
+
+struct pb_buf {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+void pb_varint(struct pb_buf *pb, uint64_t val);
+void pb_uint(struct pb_buf *pb, int field, uint64_t val);
+void pb_string(struct pb_buf *pb, int field, const char *str);
+size_t pb_begin(struct pb_buf *pb, int field);
+void pb_end(struct pb_buf *pb, size_t pos);
+
+#endif /* __FTRACE_PROTOBUF_H__ */
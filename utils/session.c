@@ -130,22 +130,16 @@ void create_session(struct ftrace_msg_sess *msg, char *dirname, char *exename,
 	rb_insert_color(&s->node, &sessions);
 }
 
-/**
- * find_session - find a matching session using @pid and @timestamp
- * @pid: task pid to search
- * @timestamp: timestamp of task
- *
- * This function searches the sessions tree using @pid and @timestamp.
- * The most recent session that has a smaller than the @timestamp will
- * be returned.
- */
-struct ftrace_session *find_session(int pid, uint64_t timestamp)
+static struct ftrace_session *__find_session(int pid, uint64_t timestamp,
+					     uint64_t *next)
 {
 	struct ftrace_session *iter;
 	struct ftrace_session *s = NULL;
 	struct rb_node *parent = NULL;
 	struct rb_node **p = &sessions.rb_node;
 
+	*next = -1ULL;
+
 	while (*p) {
 		parent = *p;
 		iter = rb_entry(parent, struct ftrace_session, node);
@@ -154,8 +148,11 @@ struct ftrace_session *find_session(int pid, uint64_t timestamp)
 			p = &parent->rb_left;
 		else if (iter->pid < pid)
 			p = &parent->rb_right;
-		else if (iter->start_time > timestamp)
+		else if (iter->start_time > timestamp) {
+			/* the last one is the next session of the pid */
+			*next = iter->start_time;
 			p = &parent->rb_left;
+		}
 		else {
 			s = iter;
 			p = &parent->rb_right;
@@ -165,6 +162,22 @@ struct ftrace_session *find_session(int pid, uint64_t timestamp)
 	return s;
 }
 
+/**
+ * find_session - find a matching session using @pid and @timestamp
+ * @pid: task pid to search
+ * @timestamp: timestamp of task
+ *
+ * This function searches the sessions tree using @pid and @timestamp.
+ * The most recent session that has a smaller than the @timestamp will
+ * be returned.
+ */
+struct ftrace_session *find_session(int pid, uint64_t timestamp)
+{
+	uint64_t next;
+
+	return __find_session(pid, timestamp, &next);
+}
+
 /**
  * walk_sessions - iterates all session and invokes @callback
  * @callback: function to be called for each task
@@ -219,31 +232,30 @@ void session_add_dlopen(struct ftrace_session *sess, const char *dirname,
 	memset(&udl->symtabs, 0, sizeof(udl->symtabs));
 	udl->symtabs.flags = SYMTAB_FL_DEMANGLE | SYMTAB_FL_SKIP_DYNAMIC;
 
-	load_dlopen_symtabs(&udl->symtabs, base_addr, libname);
+	load_dlopen_symtabs(&udl->symtabs, base_addr, udl->name);
 
 	list_for_each_entry(pos, &sess->dlopen_libs, list) {
 		if (pos->time > timestamp)
 			break;
 	}
 	list_add_tail(&udl->list, &pos->list);
+
+	add_dlopen_symtabs(&sess->symtabs, &udl->symtabs, timestamp);
 }
 
-struct sym * session_find_dlsym(struct ftrace_session *sess, uint64_t timestamp,
-				unsigned long addr)
+/**
+ * session_find_sym - find a symbol of the session at @timestamp
+ * @sess: session to search
+ * @timestamp: time of the address was used
+ * @addr: address of the symbol
+ *
+ * This function searches symbols in the session including libraries
+ * loaded by dlopen() before the @timestamp.
+ */
+struct sym * session_find_sym(struct ftrace_session *sess, uint64_t timestamp,
+			      unsigned long addr)
 {
-	struct uftrace_dlopen_list *pos, *udl = NULL;
-	struct sym *sym = NULL;
-
-	list_for_each_entry(pos, &sess->dlopen_libs, list) {
-		if (pos->time > timestamp)
-			break;
-
-		udl = pos;
-	}
-	if (udl)
-		sym = find_symtabs(&udl->symtabs, addr);
-
-	return sym;
+	return find_symtabs_time(&sess->symtabs, addr, timestamp);
 }
 
 static struct rb_root task_tree = RB_ROOT;
@@ -275,23 +287,32 @@ static void add_session_ref(struct ftrace_task *task, struct ftrace_session *ses
 }
 
 /**
- * find_task_session - find a matching session using @pid and @timestamp
+ * find_task_session_range - find a matching session and its time range
  * @pid - task pid to search
  * @timestamp - timestamp of task
+ * @start - start time of the session for the task
+ * @end - end time of the session for the task
  *
- * This function searches the sessions tree using @pid and @timestamp.
- * The most recent session that has a smaller than the @timestamp will
- * be returned.  If it didn't find a session tries to search sesssion
- * list of parent or thread-leader.
+ * This function is same as find_task_session() but it also returns
+ * the time range [@start, @end) that the session is valid for the
+ * task so that the caller can reuse the result.  The @end is set
+ * even if it cannot find a session.
  */
-struct ftrace_session *find_task_session(int pid, uint64_t timestamp)
+struct ftrace_session *find_task_session_range(int pid, uint64_t timestamp,
+					       uint64_t *start, uint64_t *end)
 {
 	struct ftrace_task *t;
 	struct ftrace_sess_ref *r;
-	struct ftrace_session *s = find_session(pid, timestamp);
+	struct ftrace_session *s;
+	uint64_t next;
+
+	s = __find_session(pid, timestamp, &next);
+	*end = next;
 
-	if (s)
+	if (s) {
+		*start = s->start_time;
 		return s;
+	}
 
 	/* if it cannot find its own session, inherit from parent or leader */
 	t = find_task(pid);
@@ -300,14 +321,35 @@ struct ftrace_session *find_task_session(int pid, uint64_t timestamp)
 
 	r = &t->sess;
 	while (r) {
-		if (r->start <= timestamp && timestamp < r->end)
+		if (r->start <= timestamp && timestamp < r->end) {
+			*start = r->start;
+			if (r->end < next)
+				*end = r->end;
 			return r->sess;
+		}
 		r = r->next;
 	}
 
 	return NULL;
 }
 
+/**
+ * find_task_session - find a matching session using @pid and @timestamp
+ * @pid - task pid to search
+ * @timestamp - timestamp of task
+ *
+ * This function searches the sessions tree using @pid and @timestamp.
+ * The most recent session that has a smaller than the @timestamp will
+ * be returned.  If it didn't find a session tries to search sesssion
+ * list of parent or thread-leader.
+ */
+struct ftrace_session *find_task_session(int pid, uint64_t timestamp)
+{
+	uint64_t start, end;
+
+	return find_task_session_range(pid, timestamp, &start, &end);
+}
+
 /**
  * create_task - create a new task from task message
  * @msg: ftrace task message read from task file
@@ -456,6 +498,22 @@ TEST_CASE(session_search)
 		TEST_LT(t, s->start_time + 100);
 	}
 
+	for (i = 0; i < 1000; i++) {
+		int t;
+		uint64_t start, end;
+		struct ftrace_session *s;
+
+		t = random() % (1000 * 100);
+		s = find_task_session_range(1, t, &start, &end);
+
+		TEST_NE(s, NULL);
+		TEST_EQ(start, s->start_time);
+		if (s->start_time == 999 * 100)
+			TEST_EQ(end, -1ULL);
+		else
+			TEST_EQ(end, s->start_time + 100);
+	}
+
 	return TEST_OK;
 }
 
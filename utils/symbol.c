@@ -15,6 +15,7 @@
 #include <gelf.h>
 #include <unistd.h>
 #include <assert.h>
+#include <pthread.h>
 
 /* This should be defined before #include "utils.h" */
 #define PR_FMT     "symbol"
@@ -154,11 +155,15 @@ static void __unload_symtab(struct symtab *symtab)
 	symtab->sym_names = NULL;
 }
 
+static struct sym_index *get_sym_index(struct symtabs *symtabs);
+static void free_sym_index(struct symtabs *symtabs);
+
 void unload_symtabs(struct symtabs *symtabs)
 {
 	pr_dbg2("unload symbol tables\n");
 	__unload_symtab(&symtabs->symtab);
 	__unload_symtab(&symtabs->dsymtab);
+	free_sym_index(symtabs);
 
 	symtabs->loaded = false;
 }
@@ -288,6 +293,7 @@ static int load_symtab(struct symtab *symtab, const char *filename,
 
 		sym->addr = elf_sym.st_value + offset;
 		sym->size = elf_sym.st_size;
+		sym->id = 0;
 
 		switch (GELF_ST_BIND(elf_sym.st_info)) {
 		case STB_LOCAL:
@@ -534,6 +540,7 @@ static int load_dynsymtab(struct symtab *dsymtab, const char *filename,
 		sym->addr = esym.st_value ?: prev_addr + plt_entsize;
 		sym->size = plt_entsize;
 		sym->type = ST_PLT;
+		sym->id = 0;
 
 		prev_addr = sym->addr;
 
@@ -577,6 +584,7 @@ int check_trace_functions(const char *filename)
 	Elf_Scn *dynsym_sec, *sec;
 	Elf_Data *dynsym_data;
 	size_t shstr_idx, dynstr_idx = 0;
+	bool has_xray = false;
 	const char *trace_funcs[] = {
 		"mcount",
 		"__fentry__",
@@ -602,21 +610,26 @@ int check_trace_functions(const char *filename)
 	sec = dynsym_sec = NULL;
 	while ((sec = elf_nextscn(elf, sec)) != NULL) {
 		GElf_Shdr shdr;
+		char *shstr;
 
 		if (gelf_getshdr(sec, &shdr) == NULL)
 			goto elf_error;
 
-		if (shdr.sh_type == SHT_DYNSYM) {
+		/* binaries built with clang -fxray-instrument */
+		shstr = elf_strptr(elf, shstr_idx, shdr.sh_name);
+		if (shstr && !strcmp(shstr, "xray_instr_map"))
+			has_xray = true;
+
+		if (shdr.sh_type == SHT_DYNSYM && dynsym_sec == NULL) {
 			dynsym_sec = sec;
 			dynstr_idx = shdr.sh_link;
 			nr_dynsym = shdr.sh_size / shdr.sh_entsize;
-			break;
 		}
 	}
 
 	if (dynsym_sec == NULL) {
 		pr_dbg("cannot find dynamic symbols.. skipping\n");
-		ret = 0;
+		ret = has_xray ? 3 : 0;
 		goto out;
 	}
 
@@ -640,7 +653,8 @@ int check_trace_functions(const char *filename)
 			}
 		}
 	}
-	ret = 0;
+	/* 3 for xray sleds */
+	ret = has_xray ? 3 : 0;
 
 out:
 	elf_end(elf);
@@ -725,6 +739,9 @@ void load_symtabs(struct symtabs *symtabs, const char *dirname,
 	    !(symtabs->flags & SYMTAB_FL_SKIP_DYNAMIC))
 		load_dynsymtab(&symtabs->dsymtab, filename, offset, symtabs->flags);
 
+	/* build the index now as it can be used by multiple threads */
+	get_sym_index(symtabs);
+
 	symtabs->loaded = true;
 }
 
@@ -734,6 +751,8 @@ void load_dlopen_symtabs(struct symtabs *symtabs, unsigned long offset,
 	if (symtabs->loaded)
 		return;
 
+	symtabs->filename = filename;
+
 	if (!(symtabs->flags & SYMTAB_FL_SKIP_NORMAL))
 		load_symtab(&symtabs->symtab, filename, offset, symtabs->flags);
 	if (!(symtabs->flags & SYMTAB_FL_SKIP_DYNAMIC))
@@ -882,6 +901,7 @@ int load_symbol_file(struct symtabs *symtabs, const char *symfile,
 		sym->type = type;
 		sym->name = demangle(name);
 		sym->size = 0;
+		sym->id = 0;
 
 		pr_dbg3("[%zd] %c %lx + %-5u %s\n", stab->nr_sym,
 			sym->type, sym->addr, sym->size, sym->name);
@@ -1085,6 +1105,7 @@ static int load_module_symbol(struct symtab *symtab, const char *symfile,
 		sym->type = type;
 		sym->name = demangle(name);
 		sym->size = 0;
+		sym->id = 0;
 
 		pr_dbg3("[%zd] %c %lx + %-5u %s\n", symtab->nr_sym,
 			sym->type, sym->addr, sym->size, sym->name);
@@ -1283,12 +1304,438 @@ unsigned long get_real_address(unsigned long addr)
 	return addr;
 }
 
-struct sym * find_symtabs(struct symtabs *symtabs, unsigned long addr)
+/* search order of overlapping ranges (lower first) */
+enum sym_range_order {
+	RANGE_SYMTAB,
+	RANGE_DYNSYM,
+	RANGE_MAPS,
+	RANGE_DLOPEN,
+};
+
+struct sym_range {
+	unsigned long start;
+	unsigned long end;
+	unsigned long max_end;	/* max end address up to this range */
+	uint64_t time;		/* dlopen time (0 for others) */
+	enum sym_range_order order;
+	unsigned module;	/* module id for symbol ids */
+	struct symtab *symtab;
+	struct ftrace_proc_maps *map;	/* to load symbols lazily */
+};
+
+/*
+ * Symbol tables in a symtabs (including the modules and dlopen-ed
+ * libraries) are indexed by their address ranges so that it can find
+ * the table using a binary search rather than trying them one by one.
+ * Ranges can overlap (e.g. symtab and map of the executable) so it
+ * keeps the max end address to find all the ranges having an address.
+ */
+struct sym_index {
+	/* to check whether the symtabs is changed after built */
+	struct ftrace_proc_maps *maps;
+	struct sym *sym;
+	struct sym *dsym;
+	size_t nr_sym;
+	size_t nr_dsym;
+
+	unsigned gen;	/* 0 means it needs to be (re)built */
+	int nr_ranges;
+	struct sym_range *ranges;
+
+	/* dlopen ranges are kept when rebuilding the index */
+	int nr_dlopen;
+	struct sym_range *dlopen;
+};
+
+#define SYM_CACHE_SIZE   4
+#define SYM_MAX_RANGES   8  /* max number of overlapping ranges */
+
+/* recently found symbols (per-thread) */
+struct sym_cache {
+	struct sym_index *index;
+	unsigned gen;
+	struct sym *sym;
+	/* the result is valid for timestamp in [time_lo, time_hi) */
+	uint64_t time_lo;
+	uint64_t time_hi;
+};
+
+static unsigned sym_index_gen;
+static __thread struct sym_cache sym_cache[SYM_CACHE_SIZE];
+
+/*
+ * Symbols found by find_symtabs() get a dense id so that analysis
+ * commands can use it as an array index.  The id is unique for a
+ * (module, symbol name, offset in the module) so the same function
+ * in different sessions (e.g. after exec) has the same id.
+ */
+struct symid_entry {
+	const char *name;
+	unsigned long offset;
+	unsigned module;
+	unsigned id;
+};
+
+#define SYMID_HASH_INIT  1024
+
+static struct symid_entry *symid_hash;
+static unsigned symid_hash_size;
+static unsigned nr_symids;
+static char **symid_names;	/* indexed by id */
+static char **symid_modules;
+static unsigned nr_symid_modules;
+static pthread_mutex_t symid_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned symid_module(const char *filename)
+{
+	const char *name;
+	unsigned i;
+
+	if (filename == NULL)
+		filename = "";
+
+	name = strrchr(filename, '/');
+	name = name ? name + 1 : filename;
+
+	pthread_mutex_lock(&symid_lock);
+
+	for (i = 0; i < nr_symid_modules; i++) {
+		if (!strcmp(symid_modules[i], name))
+			goto out;
+	}
+
+	symid_modules = xrealloc(symid_modules,
+				 (i + 1) * sizeof(*symid_modules));
+	symid_modules[i] = xstrdup(name);
+	nr_symid_modules++;
+
+out:
+	pthread_mutex_unlock(&symid_lock);
+	return i;
+}
+
+static unsigned long symid_hash_key(unsigned module, const char *name,
+				    unsigned long offset)
+{
+	/* FNV-1a */
+	unsigned long hash = 14695981039346656037UL;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211UL;
+	}
+	hash ^= offset;
+	hash *= 1099511628211UL;
+	hash ^= module;
+	hash *= 1099511628211UL;
+
+	return hash;
+}
+
+static struct symid_entry *symid_find(unsigned module, const char *name,
+				      unsigned long offset)
+{
+	unsigned long mask = symid_hash_size - 1;
+	unsigned long pos = symid_hash_key(module, name, offset) & mask;
+	struct symid_entry *entry;
+
+	while (true) {
+		entry = &symid_hash[pos];
+
+		if (entry->id == 0)
+			return entry;
+
+		if (entry->module == module && entry->offset == offset &&
+		    !strcmp(entry->name, name))
+			return entry;
+
+		pos = (pos + 1) & mask;
+	}
+}
+
+static void symid_grow(void)
+{
+	struct symid_entry *old = symid_hash;
+	unsigned old_size = symid_hash_size;
+	unsigned i;
+
+	symid_hash_size = old_size ? old_size * 2 : SYMID_HASH_INIT;
+	symid_hash = xcalloc(symid_hash_size, sizeof(*symid_hash));
+
+	for (i = 0; i < old_size; i++) {
+		if (old[i].id == 0)
+			continue;
+
+		*symid_find(old[i].module, old[i].name, old[i].offset) = old[i];
+	}
+	free(old);
+}
+
+static void set_symbol_id(struct sym *sym, unsigned module, unsigned long base)
+{
+	struct symid_entry *entry;
+	unsigned long offset = sym->addr - base;
+
+	pthread_mutex_lock(&symid_lock);
+
+	/* check again as other thread might set it */
+	if (sym->id)
+		goto out;
+
+	/* keep the load factor under 1/2 */
+	if ((nr_symids + 1) * 2 > symid_hash_size)
+		symid_grow();
+
+	entry = symid_find(module, sym->name, offset);
+	if (entry->id == 0) {
+		/* id 0 is reserved for unknown symbols */
+		entry->id = ++nr_symids;
+		entry->name = xstrdup(sym->name);
+		entry->module = module;
+		entry->offset = offset;
+
+		symid_names = xrealloc(symid_names,
+				       (nr_symids + 1) * sizeof(*symid_names));
+		symid_names[entry->id] = (char *)entry->name;
+	}
+	sym->id = entry->id;
+
+out:
+	pthread_mutex_unlock(&symid_lock);
+}
+
+/* number of symbol ids assigned so far (ids are from 1 to this) */
+unsigned symbol_nr_ids(void)
+{
+	return nr_symids;
+}
+
+const char *symbol_id_name(unsigned id)
+{
+	if (id == 0 || id > nr_symids)
+		return NULL;
+
+	return symid_names[id];
+}
+
+static void set_symtab_range(struct sym_range *r, struct symtab *symtab,
+			     enum sym_range_order order, uint64_t time,
+			     unsigned module)
+{
+	struct sym *last = &symtab->sym[symtab->nr_sym - 1];
+
+	r->start  = symtab->sym[0].addr;
+	r->end    = last->addr + last->size;
+	r->time   = time;
+	r->order  = order;
+	r->module = module;
+	r->symtab = symtab;
+	r->map    = NULL;
+}
+
+static int rangesort(const void *a, const void *b)
 {
+	const struct sym_range *ra = a;
+	const struct sym_range *rb = b;
+
+	if (ra->start > rb->start)
+		return 1;
+	if (ra->start < rb->start)
+		return -1;
+	return 0;
+}
+
+static struct sym_index *get_sym_index(struct symtabs *symtabs)
+{
+	struct sym_index *idx = symtabs->index;
 	struct symtab *stab = &symtabs->symtab;
 	struct symtab *dtab = &symtabs->dsymtab;
-	struct ftrace_proc_maps *maps;
+	struct ftrace_proc_maps *map;
+	struct sym_range *r;
+	unsigned module;
+	int nr = 2;
+	int i;
+
+	if (idx == NULL)
+		idx = symtabs->index = xzalloc(sizeof(*idx));
+	else if (idx->gen && idx->maps == symtabs->maps &&
+		 idx->sym == stab->sym && idx->nr_sym == stab->nr_sym &&
+		 idx->dsym == dtab->sym && idx->nr_dsym == dtab->nr_sym)
+		return idx;
+
+	for (map = symtabs->maps; map; map = map->next)
+		nr++;
+
+	free(idx->ranges);
+	idx->ranges = r = xmalloc((nr + idx->nr_dlopen) * sizeof(*r));
+
+	module = symid_module(symtabs->filename);
+
+	if (stab->nr_sym)
+		set_symtab_range(r++, stab, RANGE_SYMTAB, 0, module);
+	if (dtab->nr_sym)
+		set_symtab_range(r++, dtab, RANGE_DYNSYM, 0, module);
+
+	for (map = symtabs->maps; map; map = map->next, r++) {
+		r->start  = map->start;
+		r->end    = map->end;
+		r->time   = 0;
+		r->order  = RANGE_MAPS;
+		r->module = symid_module(map->libname);
+		r->symtab = &map->symtab;
+		r->map    = map;
+	}
+
+	memcpy(r, idx->dlopen, idx->nr_dlopen * sizeof(*r));
+	r += idx->nr_dlopen;
+
+	idx->nr_ranges = r - idx->ranges;
+	qsort(idx->ranges, idx->nr_ranges, sizeof(*r), rangesort);
+
+	for (i = 0; i < idx->nr_ranges; i++) {
+		r = &idx->ranges[i];
+		r->max_end = r->end;
+		if (i > 0 && r->max_end < idx->ranges[i - 1].max_end)
+			r->max_end = idx->ranges[i - 1].max_end;
+	}
+
+	idx->maps    = symtabs->maps;
+	idx->sym     = stab->sym;
+	idx->nr_sym  = stab->nr_sym;
+	idx->dsym    = dtab->sym;
+	idx->nr_dsym = dtab->nr_sym;
+	idx->gen     = __sync_add_and_fetch(&sym_index_gen, 1);
+
+	pr_dbg3("symbol index built: %d ranges\n", idx->nr_ranges);
+	return idx;
+}
+
+static void free_sym_index(struct symtabs *symtabs)
+{
+	struct sym_index *idx = symtabs->index;
+
+	if (idx == NULL)
+		return;
+
+	free(idx->ranges);
+	free(idx->dlopen);
+	free(idx);
+
+	symtabs->index = NULL;
+}
+
+/* add symbol tables of a dlopen-ed library (valid after @timestamp) */
+void add_dlopen_symtabs(struct symtabs *symtabs, struct symtabs *dlsyms,
+			uint64_t timestamp)
+{
+	struct sym_index *idx = get_sym_index(symtabs);
+	unsigned module = symid_module(dlsyms->filename);
+	struct sym_range *r;
+
+	idx->dlopen = xrealloc(idx->dlopen,
+			       (idx->nr_dlopen + 2) * sizeof(*idx->dlopen));
+
+	r = &idx->dlopen[idx->nr_dlopen];
+	if (dlsyms->symtab.nr_sym)
+		set_symtab_range(r++, &dlsyms->symtab, RANGE_DLOPEN,
+				 timestamp, module);
+	if (dlsyms->dsymtab.nr_sym)
+		set_symtab_range(r++, &dlsyms->dsymtab, RANGE_DLOPEN,
+				 timestamp, module);
+
+	idx->nr_dlopen = r - idx->dlopen;
+	idx->gen = 0;
+}
+
+static void load_map_symtab(struct symtabs *symtabs,
+			    struct ftrace_proc_maps *maps)
+{
+	if (symtabs->flags & SYMTAB_FL_USE_SYMFILE) {
+		char *symfile = NULL;
+		unsigned long offset = 0;
+		int ret;
+
+		if (symtabs->flags & SYMTAB_FL_ADJ_OFFSET)
+			offset = maps->start;
+
+		xasprintf(&symfile, "%s/%s.sym", symtabs->dirname,
+			  basename(maps->libname));
+		ret = load_module_symbol(&maps->symtab, symfile, offset);
+		free(symfile);
+
+		if (ret == 0)
+			return;
+	}
+
+	load_symtab(&maps->symtab, maps->libname, maps->start, symtabs->flags);
+}
+
+static struct sym *lookup_sym_cache(struct sym_index *idx, unsigned long addr,
+				    uint64_t timestamp)
+{
+	struct sym_cache tmp;
+	int i;
+
+	for (i = 0; i < SYM_CACHE_SIZE; i++) {
+		struct sym_cache *c = &sym_cache[i];
+
+		if (c->index != idx || c->gen != idx->gen)
+			continue;
+		if (addr < c->sym->addr || addr >= c->sym->addr + c->sym->size)
+			continue;
+		if (timestamp < c->time_lo || timestamp >= c->time_hi)
+			continue;
+
+		/* move it to the front */
+		tmp = *c;
+		memmove(&sym_cache[1], &sym_cache[0], i * sizeof(tmp));
+		sym_cache[0] = tmp;
+
+		return tmp.sym;
+	}
+	return NULL;
+}
+
+static void add_sym_cache(struct sym_index *idx, struct sym *sym,
+			  uint64_t time_lo, uint64_t time_hi)
+{
+	memmove(&sym_cache[1], &sym_cache[0],
+		(SYM_CACHE_SIZE - 1) * sizeof(*sym_cache));
+
+	sym_cache[0].index   = idx;
+	sym_cache[0].gen     = idx->gen;
+	sym_cache[0].sym     = sym;
+	sym_cache[0].time_lo = time_lo;
+	sym_cache[0].time_hi = time_hi;
+}
+
+static bool range_before(struct sym_range *a, struct sym_range *b)
+{
+	if (a->order != b->order)
+		return a->order < b->order;
+	/* use more recent one */
+	return a->time > b->time;
+}
+
+/**
+ * find_symtabs_time - find a symbol at @addr using the @timestamp
+ * @symtabs: symbol tables to search
+ * @addr: address of the symbol
+ * @timestamp: time to check the dlopen-ed libraries
+ *
+ * This function searches symbol tables in @symtabs and its modules.
+ * Libraries added by add_dlopen_symtabs() are searched only if they
+ * were loaded before the @timestamp.
+ */
+struct sym * find_symtabs_time(struct symtabs *symtabs, unsigned long addr,
+			       uint64_t timestamp)
+{
+	struct sym_range *cands[SYM_MAX_RANGES];
+	struct sym_index *idx;
+	uint64_t time_hi = -1ULL;
 	struct sym *sym;
+	int nr_cand = 0;
+	int lo, hi, i, k;
 
 	if (is_kernel_address(addr)) {
 		struct symtab *ktab = get_kernel_symtab();
@@ -1299,60 +1746,88 @@ struct sym * find_symtabs(struct symtabs *symtabs, unsigned long addr)
 
 		sym = bsearch(kaddr, ktab->sym, ktab->nr_sym,
 			      sizeof(*ktab->sym), addrfind);
+		if (sym && !sym->id)
+			set_symbol_id(sym, symid_module("kernel"),
+				      ktab->sym[0].addr);
 		return sym;
 	}
 
-	sym = bsearch((const void *)addr, stab->sym, stab->nr_sym,
-		      sizeof(*sym), addrfind);
-	if (sym)
-		return sym;
+	if (symtabs == NULL)
+		return NULL;
 
-	/* try dynamic symbols if failed */
-	sym = bsearch((const void *)addr, dtab->sym, dtab->nr_sym,
-		      sizeof(*sym), addrfind);
+	idx = get_sym_index(symtabs);
+
+	sym = lookup_sym_cache(idx, addr, timestamp);
 	if (sym)
 		return sym;
 
-	maps = symtabs->maps;
-	while (maps) {
-		if (maps->start <= addr && addr < maps->end)
-			break;
+	/* find the first range starting after the addr */
+	lo = 0;
+	hi = idx->nr_ranges;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
 
-		maps = maps->next;
+		if (idx->ranges[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	if (maps) {
-		if (maps->symtab.nr_sym == 0) {
-			bool found = false;
-
-			if (symtabs->flags & SYMTAB_FL_USE_SYMFILE) {
-				char *symfile = NULL;
-				unsigned long offset = 0;
+	/* collect ranges having the addr in the search order */
+	for (i = lo - 1; i >= 0 && idx->ranges[i].max_end > addr; i--) {
+		struct sym_range *r = &idx->ranges[i];
 
-				if (symtabs->flags & SYMTAB_FL_ADJ_OFFSET)
-					offset = maps->start;
+		if (addr >= r->end)
+			continue;
 
-				xasprintf(&symfile, "%s/%s.sym", symtabs->dirname,
-					  basename(maps->libname));
-				if (!load_module_symbol(&maps->symtab, symfile,
-							offset)) {
-					found = true;
-				}
-				free(symfile);
-			}
+		if (r->time > timestamp) {
+			if (r->time < time_hi)
+				time_hi = r->time;
+			continue;
+		}
 
-			if (!found) {
-				load_symtab(&maps->symtab, maps->libname,
-					    maps->start, symtabs->flags);
-			}
+		for (k = nr_cand; k > 0; k--) {
+			if (!range_before(r, cands[k - 1]))
+				break;
+			if (k < SYM_MAX_RANGES)
+				cands[k] = cands[k - 1];
 		}
+		if (k < SYM_MAX_RANGES)
+			cands[k] = r;
+		if (nr_cand < SYM_MAX_RANGES)
+			nr_cand++;
+	}
+
+	for (i = 0; i < nr_cand; i++) {
+		struct sym_range *r = cands[i];
+		struct symtab *stab = r->symtab;
+
+		if (r->map && stab->nr_sym == 0)
+			load_map_symtab(symtabs, r->map);
 
-		stab = &maps->symtab;
 		sym = bsearch((const void *)addr, stab->sym, stab->nr_sym,
 			      sizeof(*sym), addrfind);
+		if (sym == NULL)
+			continue;
+
+		if (!sym->id)
+			set_symbol_id(sym, r->module, r->start);
+
+		/* symbols from dlopen-ed libraries depend on the time */
+		if (r->order == RANGE_DLOPEN)
+			add_sym_cache(idx, sym, r->time, time_hi);
+		else
+			add_sym_cache(idx, sym, 0, -1ULL);
+
+		return sym;
 	}
 
-	return sym;
+	return NULL;
+}
+
+struct sym * find_symtabs(struct symtabs *symtabs, unsigned long addr)
+{
+	return find_symtabs_time(symtabs, addr, 0);
 }
 
 struct sym * find_symname(struct symtab *symtab, const char *name)
@@ -1430,3 +1905,170 @@ void print_symtabs(struct symtabs *symtabs)
 		symbol_putname(sym, name);
 	}
 }
+
+#ifdef UNIT_TEST
+
+TEST_CASE(symbol_index)
+{
+	static struct sym syms[] = {
+		{ 0x1000, 0x1000, ST_GLOBAL, "main" },
+		{ 0x2000, 0x1000, ST_GLOBAL, "foo" },
+	};
+	static struct sym dsyms[] = {
+		{ 0x4000, 0x1000, ST_PLT, "malloc" },
+	};
+	static struct sym lsyms[] = {
+		{ 0x10000, 0x1000, ST_GLOBAL, "lib_func" },
+	};
+	static struct sym dlsyms1[] = {
+		{ 0x20000, 0x1000, ST_GLOBAL, "dl_func1" },
+	};
+	static struct sym dlsyms2[] = {
+		{ 0x20000, 0x1000, ST_GLOBAL, "dl_func2" },
+	};
+	struct ftrace_proc_maps map = {
+		.start = 0x10000,
+		.end = 0x18000,
+		.symtab = {
+			.sym = lsyms,
+			.nr_sym = ARRAY_SIZE(lsyms),
+		},
+	};
+	struct symtabs stabs = {
+		.symtab = {
+			.sym = syms,
+			.nr_sym = ARRAY_SIZE(syms),
+		},
+		.dsymtab = {
+			.sym = dsyms,
+			.nr_sym = ARRAY_SIZE(dsyms),
+		},
+		.maps = &map,
+	};
+	struct symtabs dl1 = {
+		.symtab = {
+			.sym = dlsyms1,
+			.nr_sym = ARRAY_SIZE(dlsyms1),
+		},
+	};
+	struct symtabs dl2 = {
+		.symtab = {
+			.sym = dlsyms2,
+			.nr_sym = ARRAY_SIZE(dlsyms2),
+		},
+	};
+	struct sym *sym;
+	int i;
+
+	/* run twice to check the cache */
+	for (i = 0; i < 2; i++) {
+		sym = find_symtabs(&stabs, 0x2100);
+		TEST_NE(sym, NULL);
+		TEST_STREQ(sym->name, "foo");
+
+		sym = find_symtabs(&stabs, 0x4100);
+		TEST_NE(sym, NULL);
+		TEST_STREQ(sym->name, "malloc");
+
+		sym = find_symtabs(&stabs, 0x10100);
+		TEST_NE(sym, NULL);
+		TEST_STREQ(sym->name, "lib_func");
+
+		TEST_EQ(find_symtabs(&stabs, 0x3100), NULL);
+		TEST_EQ(find_symtabs(&stabs, 0x20100), NULL);
+	}
+
+	/* the same address is used by different libraries */
+	add_dlopen_symtabs(&stabs, &dl1, 100);
+	add_dlopen_symtabs(&stabs, &dl2, 200);
+
+	for (i = 0; i < 2; i++) {
+		TEST_EQ(find_symtabs_time(&stabs, 0x20100, 50), NULL);
+
+		sym = find_symtabs_time(&stabs, 0x20100, 150);
+		TEST_NE(sym, NULL);
+		TEST_STREQ(sym->name, "dl_func1");
+
+		sym = find_symtabs_time(&stabs, 0x20100, 250);
+		TEST_NE(sym, NULL);
+		TEST_STREQ(sym->name, "dl_func2");
+
+		sym = find_symtabs_time(&stabs, 0x1100, 250);
+		TEST_NE(sym, NULL);
+		TEST_STREQ(sym->name, "main");
+	}
+
+	free_sym_index(&stabs);
+	return TEST_OK;
+}
+
+TEST_CASE(symbol_id)
+{
+	static struct sym syms1[] = {
+		{ 0x1000, 0x1000, ST_GLOBAL, "main" },
+		{ 0x2000, 0x1000, ST_GLOBAL, "foo" },
+		{ 0x3000, 0x1000, ST_LOCAL,  "foo" },
+	};
+	/* same binary loaded at a different address */
+	static struct sym syms2[] = {
+		{ 0x81000, 0x1000, ST_GLOBAL, "main" },
+		{ 0x82000, 0x1000, ST_GLOBAL, "foo" },
+		{ 0x83000, 0x1000, ST_LOCAL,  "foo" },
+	};
+	/* different binary */
+	static struct sym syms3[] = {
+		{ 0x1000, 0x1000, ST_GLOBAL, "main" },
+	};
+	struct symtabs stabs1 = {
+		.filename = "/usr/bin/prog1",
+		.symtab = {
+			.sym = syms1,
+			.nr_sym = ARRAY_SIZE(syms1),
+		},
+	};
+	struct symtabs stabs2 = {
+		.filename = "/tmp/prog1",
+		.symtab = {
+			.sym = syms2,
+			.nr_sym = ARRAY_SIZE(syms2),
+		},
+	};
+	struct symtabs stabs3 = {
+		.filename = "/usr/bin/prog2",
+		.symtab = {
+			.sym = syms3,
+			.nr_sym = ARRAY_SIZE(syms3),
+		},
+	};
+	struct sym *main1, *foo1, *bar1;
+	struct sym *main2, *foo2, *bar2;
+	struct sym *main3;
+
+	main1 = find_symtabs(&stabs1, 0x1100);
+	foo1  = find_symtabs(&stabs1, 0x2100);
+	bar1  = find_symtabs(&stabs1, 0x3100);
+	main2 = find_symtabs(&stabs2, 0x81100);
+	foo2  = find_symtabs(&stabs2, 0x82100);
+	bar2  = find_symtabs(&stabs2, 0x83100);
+	main3 = find_symtabs(&stabs3, 0x1100);
+
+	TEST_NE(main1->id, 0);
+	TEST_NE(main1->id, foo1->id);
+	/* static functions with the same name */
+	TEST_NE(foo1->id, bar1->id);
+
+	TEST_EQ(main1->id, main2->id);
+	TEST_EQ(foo1->id, foo2->id);
+	TEST_EQ(bar1->id, bar2->id);
+	TEST_NE(main1->id, main3->id);
+
+	TEST_STREQ(symbol_id_name(foo1->id), "foo");
+	TEST_GE(symbol_nr_ids(), main3->id);
+
+	free_sym_index(&stabs1);
+	free_sym_index(&stabs2);
+	free_sym_index(&stabs3);
+	return TEST_OK;
+}
+
+#endif /* UNIT_TEST */
@@ -28,6 +28,7 @@ struct sym {
 	unsigned size;
 	enum symtype type;
 	char *name;
+	unsigned id;	/* dense symbol id (0 if not assigned yet) */
 };
 
 #define SYMTAB_GROW  16
@@ -58,6 +59,8 @@ enum symtab_flag {
 	SYMTAB_FL_SKIP_DYNAMIC	= (1U << 4),
 };
 
+struct sym_index;
+
 struct symtabs {
 	bool loaded;
 	const char *dirname;
@@ -66,6 +69,8 @@ struct symtabs {
 	struct symtab symtab;
 	struct symtab dsymtab;
 	struct ftrace_proc_maps *maps;
+	/* address ranges of the above (and dlopen) tables for lookup */
+	struct sym_index *index;
 };
 
 #if __SIZEOF_LONG__ == 8
@@ -81,7 +86,11 @@ static inline bool is_kernel_address(unsigned long addr)
 unsigned long get_real_address(unsigned long addr);
 
 struct sym * find_symtabs(struct symtabs *symtabs, unsigned long addr);
+struct sym * find_symtabs_time(struct symtabs *symtabs, unsigned long addr,
+			       uint64_t timestamp);
 struct sym * find_symname(struct symtab *symtab, const char *name);
+unsigned symbol_nr_ids(void);
+const char *symbol_id_name(unsigned id);
 void load_symtabs(struct symtabs *symtabs, const char *dirname,
 		  const char *filename);
 void unload_symtabs(struct symtabs *symtabs);
@@ -91,6 +100,8 @@ void load_module_symtabs(struct symtabs *symtabs, struct list_head *head);
 void save_module_symtabs(struct symtabs *symtabs, struct list_head *head);
 void load_dlopen_symtabs(struct symtabs *symtabs, unsigned long offset,
 			 const char *filename);
+void add_dlopen_symtabs(struct symtabs *symtabs, struct symtabs *dlsyms,
+			uint64_t timestamp);
 
 bool check_libpthread(const char *filename);
 int check_trace_functions(const char *filename);
@@ -239,6 +239,9 @@ void print_diff_percent(uint64_t base_nsec, uint64_t delta_nsec);
 void start_pager(void);
 void wait_for_pager(void);
 
+void start_output_writer(void);
+void finish_output_writer(void);
+
 bool check_time_range(struct uftrace_time_range *range, uint64_t timestamp);
 
 #endif /* __FTRACE_UTILS_H__ */
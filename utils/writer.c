@@ -0,0 +1,318 @@
+/*
+ * output writer routines for uftrace
+ *
+ * Formatting the output and writing it to a pipe (or a file) are done
+ * in a row on a single thread.  The output writer replaces @outfp with
+ * a stream which collects the output in large buffers and a separate
+ * thread writes them so that the write() calls don't block formatting.
+ * Note that only the write is moved: reading records, symbol lookup and
+ * formatting are still done by the main thread.
+ *
+ * A pipe (i.e. to the pager) is read by a user, so the output is passed
+ * to the writer at a line boundary when it has enough data or when the
+ * writer is idle.  Only a regular file waits for a full buffer.
+ *
+ * Released under the GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+/* This should be defined before #include "utils.h" */
+#define PR_FMT     "writer"
+#define PR_DOMAIN  DBG_FTRACE
+
+#include "utils/utils.h"
+
+#define OUTPUT_BUF_SIZE  (1024 * 1024)
+#define OUTPUT_BUF_NR    4
+#define OUTPUT_PIPE_SIZE  (4 * 1024)
+
+struct output_buf {
+	size_t len;
+	char data[OUTPUT_BUF_SIZE];
+};
+
+static struct output_writer {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct output_buf *bufs[OUTPUT_BUF_NR];
+	/* buffers in [head, tail) are waiting to be written */
+	unsigned head;
+	unsigned tail;
+	bool done;
+	bool registered;
+	int fd;
+	/* pass the buffer at a line boundary when it has this much data */
+	size_t flush_size;
+	FILE *orig_fp;
+	FILE *fp;
+	char stdio_buf[64 * 1024];
+} writer;
+
+static void *writer_thread(void *arg)
+{
+	struct output_writer *w = arg;
+	struct output_buf *buf;
+
+	pthread_mutex_lock(&w->lock);
+	while (true) {
+		while (w->head == w->tail && !w->done)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (w->head == w->tail)
+			break;
+
+		buf = w->bufs[w->head % OUTPUT_BUF_NR];
+		pthread_mutex_unlock(&w->lock);
+
+		if (write_all(w->fd, buf->data, buf->len) < 0)
+			pr_dbg("cannot write output: %m\n");
+
+		pthread_mutex_lock(&w->lock);
+		w->head++;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+/* pass the current buffer to the writer and wait for a free one */
+static void submit_output_buf(struct output_writer *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->tail++;
+	pthread_cond_broadcast(&w->cond);
+
+	while (w->tail - w->head == OUTPUT_BUF_NR)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	w->bufs[w->tail % OUTPUT_BUF_NR]->len = 0;
+}
+
+static bool writer_idle(struct output_writer *w)
+{
+	return __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == w->tail;
+}
+
+static ssize_t writer_write(void *cookie, const char *data, size_t size)
+{
+	struct output_writer *w = cookie;
+	struct output_buf *buf;
+	size_t total = size;
+
+	while (size) {
+		size_t len;
+
+		buf = w->bufs[w->tail % OUTPUT_BUF_NR];
+		len = OUTPUT_BUF_SIZE - buf->len;
+
+		if (len > size)
+			len = size;
+
+		memcpy(buf->data + buf->len, data, len);
+		buf->len += len;
+		data += len;
+		size -= len;
+
+		if (buf->len == OUTPUT_BUF_SIZE)
+			submit_output_buf(w);
+	}
+
+	/* a regular file is written with full buffers only */
+	if (w->flush_size == OUTPUT_BUF_SIZE)
+		return total;
+
+	buf = w->bufs[w->tail % OUTPUT_BUF_NR];
+	if (buf->len == 0 || buf->data[buf->len - 1] != '\n')
+		return total;
+
+	if (buf->len >= w->flush_size || writer_idle(w))
+		submit_output_buf(w);
+
+	return total;
+}
+
+/**
+ * start_output_writer - write the output in a separate thread
+ *
+ * This function replaces @outfp to send the output to a writer thread
+ * which only calls write() with the buffered output.  It does nothing
+ * if the output is a terminal since it needs to be shown as soon as
+ * possible.  A pipe gets the output line by line unless the writer
+ * falls behind.
+ */
+void start_output_writer(void)
+{
+	cookie_io_functions_t writer_io = {
+		.write = writer_write,
+	};
+	struct output_writer *w = &writer;
+	struct stat stbuf;
+	int i;
+
+	if (w->fp || isatty(fileno(outfp)))
+		return;
+
+	for (i = 0; i < OUTPUT_BUF_NR; i++)
+		w->bufs[i] = xmalloc(sizeof(*w->bufs[i]));
+	w->bufs[0]->len = 0;
+	w->head = w->tail = 0;
+	w->done = false;
+
+	fflush(outfp);
+	w->fd = fileno(outfp);
+
+	if (fstat(w->fd, &stbuf) == 0 && S_ISREG(stbuf.st_mode))
+		w->flush_size = OUTPUT_BUF_SIZE;
+	else
+		w->flush_size = OUTPUT_PIPE_SIZE;
+
+	w->fp = fopencookie(w, "w", writer_io);
+	if (w->fp == NULL)
+		goto err;
+
+	setvbuf(w->fp, w->stdio_buf,
+		w->flush_size == OUTPUT_BUF_SIZE ? _IOFBF : _IOLBF,
+		sizeof(w->stdio_buf));
+	__fsetlocking(w->fp, FSETLOCKING_BYCALLER);
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+
+	if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+		fclose(w->fp);
+		w->fp = NULL;
+		goto err;
+	}
+
+	w->orig_fp = outfp;
+	outfp = w->fp;
+
+	/* flush the remaining output on exit (i.e. pr_err) */
+	if (!w->registered) {
+		atexit(finish_output_writer);
+		w->registered = true;
+	}
+	return;
+
+err:
+	pr_dbg("cannot start output writer\n");
+	for (i = 0; i < OUTPUT_BUF_NR; i++) {
+		free(w->bufs[i]);
+		w->bufs[i] = NULL;
+	}
+}
+
+/**
+ * finish_output_writer - flush the output and stop the writer thread
+ *
+ * This function restores the original @outfp.
+ */
+void finish_output_writer(void)
+{
+	struct output_writer *w = &writer;
+	struct output_buf *buf;
+	int i;
+
+	if (w->fp == NULL)
+		return;
+
+	fflush(w->fp);
+
+	pthread_mutex_lock(&w->lock);
+	buf = w->bufs[w->tail % OUTPUT_BUF_NR];
+	if (buf->len)
+		w->tail++;
+	w->done = true;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	pthread_join(w->thread, NULL);
+
+	outfp = w->orig_fp;
+	fclose(w->fp);
+	w->fp = NULL;
+
+	for (i = 0; i < OUTPUT_BUF_NR; i++) {
+		free(w->bufs[i]);
+		w->bufs[i] = NULL;
+	}
+}
+
+#ifdef UNIT_TEST
+TEST_CASE(output_writer)
+{
+	FILE *orig_fp = outfp;
+	FILE *fp = tmpfile();
+	char buf[64];
+	int i;
+
+	TEST_NE(fp, NULL);
+	outfp = fp;
+
+	start_output_writer();
+	TEST_NE(outfp, fp);
+
+	/* it needs to cross the buffer boundary */
+	for (i = 0; i < OUTPUT_BUF_SIZE / 8 + 1; i++)
+		pr_out("%07d\n", i);
+
+	finish_output_writer();
+	TEST_EQ(outfp, fp);
+
+	TEST_EQ(fseek(fp, -8, SEEK_END), 0);
+	TEST_NE(fgets(buf, sizeof(buf), fp), NULL);
+	TEST_STREQ(buf, "0131072\n");
+	TEST_EQ(ftell(fp), (long)(OUTPUT_BUF_SIZE + 8));
+
+	fclose(fp);
+	outfp = orig_fp;
+	return TEST_OK;
+}
+
+TEST_CASE(output_writer_pipe)
+{
+	FILE *orig_fp = outfp;
+	struct pollfd pfd;
+	char buf[64];
+	int fds[2];
+	int n;
+
+	TEST_EQ(pipe(fds), 0);
+	outfp = fdopen(fds[1], "w");
+	TEST_NE(outfp, NULL);
+
+	start_output_writer();
+	TEST_EQ(writer.flush_size, (size_t)OUTPUT_PIPE_SIZE);
+
+	/* a line should be passed to the pipe before finishing */
+	pr_out("hello\n");
+
+	pfd.fd = fds[0];
+	pfd.events = POLLIN;
+	TEST_EQ(poll(&pfd, 1, 1000), 1);
+
+	n = read(fds[0], buf, sizeof(buf) - 1);
+	TEST_EQ(n, 6);
+	buf[n] = '\0';
+	TEST_STREQ(buf, "hello\n");
+
+	finish_output_writer();
+
+	fclose(outfp);
+	close(fds[0]);
+	outfp = orig_fp;
+	return TEST_OK;
+}
+#endif /* UNIT_TEST */